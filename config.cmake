@@ -18,21 +18,102 @@ set(STANDARD_FLAGS
 )
 
 # Define targets
-set(EXECUTABLE_TARGETS main)
+set(EXECUTABLE_TARGETS main fault_proxy bench trace2json)
 set(LIBRARY_TARGETS "")
 
 set(main_SOURCES
+        src/bridge.c
+        src/buffer_pool.c
+        src/capture.c
         src/client.c
+        src/client_daemon.c
+        src/clock_sync.c
+        src/frame.c
+        src/history.c
+        src/messaging.c
+        src/metrics.c
+        src/net_thread.c
         src/network_funcs.c
+        src/render.c
+        src/replay.c
+        src/script.c
+        src/session.c
+        src/shm_ring.c
+        src/spsc_queue.c
+        src/trace.c
+        src/user_directory.c
         src/utils.c
 )
 
 set(main_HEADERS
+        include/bridge.h
+        include/buffer_pool.h
+        include/capture.h
         include/client.h
+        include/client_daemon.h
+        include/clock_sync.h
+        include/frame.h
+        include/history.h
+        include/messaging.h
+        include/metrics.h
+        include/net_thread.h
         include/network_funcs.h
         include/protocol.h
+        include/render.h
+        include/replay.h
+        include/script.h
+        include/session.h
+        include/shm_ring.h
+        include/spsc_queue.h
+        include/trace.h
+        include/user_directory.h
         include/utils.h
 )
 
-set(main_LINK_LIBRARIES "")
+set(main_LINK_LIBRARIES "pthread")
 
+set(fault_proxy_SOURCES
+        src/fault_proxy.c
+)
+
+set(fault_proxy_HEADERS
+        include/fault_proxy.h
+)
+
+set(bench_SOURCES
+        src/bench.c
+        src/bench_check.c
+        src/capture.c
+        src/clock_sync.c
+        src/frame.c
+        src/history.c
+        src/metrics.c
+        src/trace.c
+        src/user_directory.c
+        src/utils.c
+)
+
+set(bench_HEADERS
+        include/bench.h
+        include/capture.h
+        include/clock_sync.h
+        include/frame.h
+        include/history.h
+        include/metrics.h
+        include/protocol.h
+        include/trace.h
+        include/user_directory.h
+        include/utils.h
+)
+
+set(bench_LINK_LIBRARIES "pthread")
+
+set(trace2json_SOURCES
+        src/trace2json.c
+)
+
+set(trace2json_HEADERS
+        include/client.h
+        include/protocol.h
+        include/trace.h
+)
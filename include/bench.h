@@ -0,0 +1,50 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    BENCH_DEFAULT_REPS = 7,
+    BENCH_MAX_REPS = 101,
+    BENCH_MIN_RUN_NS = 20000000, // calibrate each repetition to at least this
+    BENCH_STREAM_FRAMES = 256,   // frames in the decoder benchmark stream
+    BENCH_TEXT_LENGTH = 64,      // message text in the sample frames
+    BENCH_MEMBER_COUNT = 8,      // ids in the channel info/list samples
+    BENCH_FRAME_MAX = 256
+};
+
+// do `iterations` operations (or close to it), return how many were done.
+// fold results into *sink so the compiler cannot drop the work
+typedef uint64_t (*bench_fn)(int arg, uint64_t iterations, uint64_t *sink);
+
+typedef struct
+{
+    const char *name;
+    bench_fn run;
+    int arg;
+} bench_case;
+
+typedef struct
+{
+    double ns_median;
+    double ns_min;
+    double ns_max;
+    double allocs_per_op; // negative when allocations cannot be counted
+} bench_result;
+
+// one sample frame per protocol.h body layout
+typedef struct
+{
+    const char *name;
+    uint8_t type;
+    uint8_t wire[BENCH_FRAME_MAX]; // header + body as sent
+    size_t len;
+} bench_sample;
+
+// bench -c: deterministic checks of clock_sync, user_directory and history.
+// prints a summary and returns the number of failed checks
+int bench_check(void);
+
+#endif /* BENCH_H */
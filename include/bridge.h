@@ -0,0 +1,17 @@
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include "client.h"
+
+enum
+{
+    BRIDGE_MAX_ACCOUNTS = 4096
+};
+
+// run every account listed in ctx->accounts_path ("username password" per
+// line) on one event loop. incoming messages go to stdout as tab separated
+// "account channel sender timestamp text", and stdin lines of the form
+// "account text" are sent from that account
+void bridge_run(client_context *ctx);
+
+#endif /* BRIDGE_H */
@@ -0,0 +1,29 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+enum
+{
+    BUFFER_POOL_SLAB_BLOCKS = 64
+};
+
+// free-list of fixed-size blocks carved out of slabs. blocks are handed back
+// to the list, never to malloc, so a busy loop stops allocating once warm
+typedef struct
+{
+    size_t block_size;
+    void *free_list;  // next pointer lives in the first bytes of each block
+    void *slabs;      // slab chain, freed on destroy
+    size_t in_use;
+    size_t total;
+} buffer_pool;
+
+void buffer_pool_init(buffer_pool *pool, size_t block_size);
+void buffer_pool_destroy(buffer_pool *pool);
+
+// NULL only when the system is out of memory
+void *buffer_pool_get(buffer_pool *pool);
+void buffer_pool_put(buffer_pool *pool, void *block);
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,71 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "frame.h"
+#include "protocol.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    CAPTURE_MAGIC = 0x43474942, // "BIGC"
+    CAPTURE_VERSION = 2,
+    CAPTURE_BUFFER_SIZE = 1 << 20
+};
+
+typedef enum
+{
+    CAPTURE_SENT = 0,
+    CAPTURE_RECEIVED = 1,
+    CAPTURE_CONNECT = 2, // body is a capture_peer, header zeroed
+    CAPTURE_CLOSE = 3    // no body, header zeroed
+} capture_direction;
+
+// trace layout: one capture_file_header, then back to back records, each a
+// capture_record followed by the wire header and `length` bytes of body.
+// everything is in host order except the embedded big_header_t, which is
+// kept exactly as it crossed the wire, and capture_peer, which is in network
+// order like a sockaddr_in
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_wall_ms;
+} capture_file_header;
+
+typedef struct
+{
+    uint64_t t_ns;     // monotonic, relative to capture_start
+    uint32_t conn;     // conn_id_of the socket, never reused within a trace
+    uint32_t length;   // body bytes that follow the wire header
+    uint8_t direction; // capture_direction
+    uint8_t reserved[7];
+} capture_record;
+
+typedef struct __attribute__((packed))
+{
+    ipv4_address_t ip;
+    uint16_t port;
+} capture_peer;
+
+// nonzero while a trace is being written, so call sites cost one load
+extern atomic_int capture_active;
+
+// open the trace and start the writer thread. stops itself at exit
+int capture_start(const char *path);
+void capture_stop(void);
+
+// record one frame on socket fd. hdr is the header as it is on the wire
+void capture_frame(capture_direction direction, int fd,
+                   const big_header_t *hdr, const void *body, size_t length);
+
+// record a frame the decoder just finished (body truncated to body_cap)
+void capture_decoded(int fd, const frame_decoder *dec);
+
+// fd was just connected (after conn_id_open) or is about to be closed
+// (before conn_id_close)
+void capture_connect(int fd);
+void capture_close(int fd);
+
+#endif /* CAPTURE_H */
@@ -16,6 +16,22 @@ enum
     CHANNEL_NAME_LENGTH = 16
 };
 
+// what main does once the arguments are parsed
+typedef enum
+{
+    MODE_INTERACTIVE,
+    MODE_DAEMON,
+    MODE_ATTACH,
+    MODE_BRIDGE,
+    MODE_REPLAY,
+    MODE_SCRIPT
+} client_mode;
+
+enum
+{
+    DAEMON_NAME_LENGTH = 32
+};
+
 typedef enum 
 {
     STATE_DISCONNECTED,
@@ -35,6 +51,17 @@ typedef struct
     int exit_code;
     char *exit_message;
 
+    client_mode mode;
+    char daemon_name[DAEMON_NAME_LENGTH];
+    const char *accounts_path; // bridge mode account list
+    const char *capture_path;  // record every frame here when set
+    const char *trace_path;    // record timeline events here when set
+    const char *metrics_spec;  // unix:<path>, http:<port> or file:<path>
+    const char *replay_path;   // replay mode trace
+    double replay_speed;       // replay time scale, 0 = as fast as possible
+    const char *script_path;   // script mode commands, "-" for stdin
+    size_t script_window;      // script mode requests in flight
+
     client_state state; //keep track of where we're at
     int active_sock_fd; //the active socket (gonna switch from manager to chat)
     struct sockaddr_storage addr;
@@ -47,6 +74,9 @@ typedef struct
     char password[PASSWORD_LENGTH];
     uint8_t account_id;
 
+    // channel the messaging phase talks to
+    uint8_t channel_id;
+
 } client_context;
 
 #endif /*CLIENT_H*/
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef CLIENT_DAEMON_H
+#define CLIENT_DAEMON_H
+
+#include "client.h"
+
+enum
+{
+    DAEMON_MAX_CLIENTS = 32,
+    DAEMON_SOCKET_PATH_LENGTH = 108
+};
+
+// hold the logged-in session, publish incoming messages into the shared
+// ring named ctx->daemon_name and take commands on its unix socket until
+// SIGINT/SIGTERM or the node goes away
+void client_daemon_run(client_context *ctx);
+
+// local front-end: follow the daemon's ring and forward stdin lines
+// ("send <text>", "join <id>", "fetch") to its control socket
+void client_daemon_attach(client_context *ctx);
+
+void client_daemon_socket_path(char *dest, size_t size, const char *name);
+
+#endif /* CLIENT_DAEMON_H */
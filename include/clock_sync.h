@@ -0,0 +1,86 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include "frame.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    CLOCK_SYNC_RTO_INITIAL_MS = 1000, // RFC 6298 2.1
+    CLOCK_SYNC_RTO_MIN_MS = 1000,     // RFC 6298 2.4
+    CLOCK_SYNC_RTO_MAX_MS = 60000,
+    CLOCK_SYNC_GRANULARITY_NS = 1000000, // G, our timers tick in ms
+    CLOCK_SYNC_FILTER = 8 // offset samples kept, the fastest one wins
+};
+
+typedef struct
+{
+    int64_t rtt_ns;
+    int64_t offset_ns;
+} clock_sample;
+
+// round trip and clock offset to one node, learned from the requests the
+// connection sends anyway. rtt follows RFC 6298 (SRTT, RTTVAR, RTO); the
+// offset is NTP's ((t1 - t0) + (t2 - t3)) / 2 with t1 == t2 being the one
+// server stamp a response carries. of the last few offsets the one with
+// the shortest round trip is used, it spent the least time queued.
+// time is kept as a wall clock reading plus monotonic nanoseconds since it
+// was taken, so stamping costs one clock_gettime and a step of the local
+// clock cannot reorder our own messages. single threaded, owned by
+// whoever owns the socket
+typedef struct
+{
+    uint64_t base_ms; // wall clock when base_ns was read
+    int64_t base_ns;
+    int64_t offset_ns; // server minus local, 0 until the server said
+    uint64_t last_stamp_ms; // newest timestamp handed to a send
+
+    unsigned rtt_samples; // 0 means srtt/rttvar are not set yet
+    int64_t srtt_ns;
+    int64_t rttvar_ns;
+    int64_t rto_ns;
+
+    clock_sample filter[CLOCK_SYNC_FILTER];
+    size_t filter_count;
+    size_t filter_next;
+} clock_sync;
+
+void clock_sync_init(clock_sync *cs);
+
+// a round trip from a request that was the only one in flight. samples from
+// ambiguous answers (more than one request outstanding, Karn) must not
+// come here
+void clock_sync_rtt(clock_sync *cs, int64_t rtt_ns);
+
+// an answer carrying the server's clock, server_ms, to a request sent at
+// sent_ns and answered at received_ns (both monotonic_ns). also an rtt
+// sample, so do not call clock_sync_rtt for the same response
+void clock_sync_server_time(clock_sync *cs, int64_t sent_ns,
+                            int64_t received_ns, uint64_t server_ms);
+
+// the server's clock as read off a response, 0 when the frame has none.
+// only a send message response echoing the stored message can have one, and
+// only if the node restamped it: an echo of the stamp we sent carries our
+// own clock (offset included), and feeding it back would walk the offset
+// down by rtt/2 per sample. dec must answer the newest send
+uint64_t clock_sync_stamp_of(const clock_sync *cs, const frame_decoder *dec);
+
+// the request timed out: double the RTO (RFC 6298 5.5)
+void clock_sync_backoff(clock_sync *cs);
+
+// protocol timestamp (ms since the epoch) in server time
+uint64_t clock_sync_now_ms(const clock_sync *cs);
+
+// clock_sync_now_ms for a send message request, remembered so its echo can
+// be told apart from a node stamp
+uint64_t clock_sync_stamp(clock_sync *cs);
+
+// how long to wait for an answer: the RTO once there has been a sample,
+// fallback_ms before
+int64_t clock_sync_timeout_ms(const clock_sync *cs, int64_t fallback_ms);
+
+// smoothed round trip in ms, fallback_ms before the first sample
+int64_t clock_sync_srtt_ms(const clock_sync *cs, int64_t fallback_ms);
+
+#endif /* CLOCK_SYNC_H */
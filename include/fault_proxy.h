@@ -0,0 +1,91 @@
+#ifndef FAULT_PROXY_H
+#define FAULT_PROXY_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    PROXY_MAX_PAIRS = 256,
+    PROXY_READ_CHUNK = 16384,
+    PROXY_MAX_QUEUED = 4 * 1024 * 1024, // per direction, then stop reading
+    PROXY_SCRIPT_LINE = 256,
+    PROXY_STATS_INTERVAL_MS = 1000
+};
+
+// what the proxy does to the bytes. every knob can be changed on the fly
+// from the script
+typedef struct
+{
+    uint32_t split;        // cut reads into random pieces of 1..split bytes
+    uint32_t gap_ms;       // pause between the pieces of one read
+    uint32_t coalesce_ms;  // hold data this long so frames get merged
+    uint32_t delay_ms;     // fixed latency
+    uint32_t jitter_ms;    // plus 0..jitter_ms of random latency
+    uint32_t rate;         // bytes per second per direction, 0 = unlimited
+    uint32_t reset_chance; // per 1000 reads, abort the connection with RST
+} proxy_faults;
+
+// bytes read from one side, waiting for their release time
+typedef struct proxy_segment
+{
+    struct proxy_segment *next;
+    int64_t release_at;
+    size_t len;
+    size_t off;
+    uint8_t data[];
+} proxy_segment;
+
+typedef struct
+{
+    proxy_segment *head;
+    proxy_segment *tail;
+    size_t queued;
+    int64_t last_release; // keeps segments in order whatever the jitter
+    int64_t coalesce_until;
+    double tokens;        // rate limiter bucket
+    int64_t refilled_at;
+    int eof;              // source closed, shut down the write side once empty
+    int blocked;          // last write hit EAGAIN, wait for POLLOUT
+} proxy_direction;
+
+// client <-> server. dir[0] flows client to server, dir[1] the other way
+typedef struct
+{
+    int fd[2];
+    proxy_direction dir[2];
+} proxy_pair;
+
+// one scripted change: at `at_ms` after start, set `name` to `value`
+typedef struct
+{
+    int64_t at_ms;
+    char name[32];
+    uint32_t value;
+} proxy_step;
+
+typedef struct
+{
+    struct sockaddr_in listen_addr;
+    struct sockaddr_in target;
+    int listen_fd;
+    proxy_faults faults;
+    proxy_pair pairs[PROXY_MAX_PAIRS];
+    size_t pair_count;
+
+    proxy_step *steps;
+    size_t step_count;
+    size_t next_step;
+
+    uint64_t seed;
+    int64_t start;
+    int64_t next_stats;
+    int stats;
+    uint64_t accepted;
+    uint64_t resets;
+    uint64_t total_bytes;
+    uint64_t last_total;
+} fault_proxy;
+
+#endif /* FAULT_PROXY_H */
@@ -0,0 +1,82 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// largest message text we accept (big_send_message_t.message_length is u16)
+enum
+{
+    MESSAGE_MAX_LENGTH = UINT16_MAX
+};
+
+typedef enum
+{
+    FRAME_NEED_MORE = 0,
+    FRAME_COMPLETE = 1,
+    FRAME_ERROR = -1
+} frame_result;
+
+// incremental frame parser, the body buffer is owned by the caller so it can
+// come from a pool or the stack
+typedef struct
+{
+    big_header_t hdr;  // header with body converted to host order
+    size_t hdr_have;   // header bytes collected so far
+    size_t body_have;  // body bytes collected so far
+    size_t body_skip;  // body bytes past body_cap, dropped
+    uint8_t *body;     // caller-owned body storage
+    size_t body_cap;
+} frame_decoder;
+
+void frame_header_init(big_header_t *hdr, uint8_t type, uint8_t status,
+                       uint32_t body_len);
+
+uint64_t frame_hton64(uint64_t value);
+uint64_t frame_ntoh64(uint64_t value);
+
+// write/read the whole buffer, retrying on EINTR, short writes and EAGAIN
+int frame_write_all(int fd, const void *buf, size_t len);
+int frame_read_all(int fd, void *buf, size_t len);
+
+// send header + body as one frame, returns 0 or -1
+int frame_send(int fd, uint8_t type, uint8_t status, const void *body,
+               uint32_t body_len);
+
+// request bodies, filled in the same way by every client. auth goes out as
+// is: fixed width, NUL padded, not necessarily terminated
+void frame_create_account_body(big_create_account_req_t *body,
+                               const big_auth_t *auth);
+
+// client_ip is fd's local address. -1 (client_ip left 0) if it has none
+int frame_login_logout_body(big_login_logout_req_t *body,
+                            const big_auth_t *auth, int fd,
+                            uint8_t status_flag);
+
+// anything on channel_id newer than since_ms
+void frame_get_message_body(big_get_message_t *body, const big_auth_t *auth,
+                            uint64_t since_ms, uint8_t channel_id);
+
+// the fixed part only, the length bytes of text follow it
+void frame_send_message_body(big_send_message_t *body, const big_auth_t *auth,
+                             uint64_t timestamp_ms, uint8_t channel_id,
+                             uint16_t length);
+
+// check a body against the layout its type requires. hdr->body is the full
+// body length in host order (as frame_decoder keeps it) and `have` is how
+// much of the body is in memory, only the fixed part has to be. returns
+// STATUS_OK or the status a node would answer the frame with
+uint8_t frame_validate_body(const big_header_t *hdr, const uint8_t *body,
+                            size_t have);
+
+void frame_decoder_init(frame_decoder *dec, uint8_t *body, size_t body_cap);
+void frame_decoder_reset(frame_decoder *dec);
+
+// consume bytes from data, *used is set to how many were taken. returns
+// FRAME_COMPLETE once a whole frame is buffered (call reset before the next).
+// a body larger than body_cap is truncated: body_skip says how much was lost
+frame_result frame_decoder_push(frame_decoder *dec, const uint8_t *data,
+                                size_t len, size_t *used);
+
+#endif /* FRAME_H */
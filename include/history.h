@@ -0,0 +1,50 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    HISTORY_TEXT_LENGTH = 512,
+    HISTORY_DEFAULT_CAPACITY = 1024
+};
+
+typedef struct
+{
+    uint64_t timestamp;
+    uint8_t channel_id;
+    uint8_t sender_id;
+    uint16_t length;
+    char text[HISTORY_TEXT_LENGTH];
+} history_entry;
+
+// bounded timeline of received messages. entries live in a ring addressed by
+// a monotonically increasing sequence number, and an open-addressed index on
+// (channel, sender, timestamp) drops the duplicates repeated fetches return
+typedef struct
+{
+    history_entry *entries;
+    uint64_t *index;    // seq + 1 per slot, 0 when empty
+    size_t mask;        // ring capacity - 1
+    size_t index_mask;  // index capacity - 1
+    uint64_t next_seq;  // seq the next insert will get
+} history_store;
+
+// capacity is rounded up to a power of two
+int history_init(history_store *h, size_t capacity);
+void history_destroy(history_store *h);
+
+// returns 1 if stored, 0 if it was already there
+int history_insert(history_store *h, uint8_t channel_id, uint8_t sender_id,
+                   uint64_t timestamp, const char *text, size_t length);
+
+const history_entry *history_lookup(const history_store *h,
+                                    uint8_t channel_id, uint8_t sender_id,
+                                    uint64_t timestamp);
+
+// oldest seq still held, and the entry for a seq (NULL once evicted)
+uint64_t history_first_seq(const history_store *h);
+const history_entry *history_at(const history_store *h, uint64_t seq);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,107 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "client.h"
+#include "protocol.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    METRICS_STATUS_CODES = 256,
+    METRICS_STATE_COUNT = STATE_EXITING + 1,
+    METRICS_RTT_BUCKETS = 12,
+    METRICS_FILE_INTERVAL_MS = 10000, // how often file mode rewrites
+    METRICS_POLL_MS = 200,            // how often the exporter checks for stop
+    METRICS_REQUEST_TIMEOUT_MS = 1000,
+    METRICS_REQUEST_SIZE = 1024,
+    METRICS_RESPONSE_SIZE = 32768
+};
+
+typedef enum
+{
+    METRICS_QUEUE_NET_COMMANDS,
+    METRICS_QUEUE_NET_EVENTS,
+    METRICS_QUEUE_COUNT
+} metrics_queue;
+
+typedef enum
+{
+    METRICS_SINK_NONE,
+    METRICS_SINK_UNIX, // unix:<path>, http over a unix socket
+    METRICS_SINK_HTTP, // http:<port>, loopback only
+    METRICS_SINK_FILE  // file:<path>, rewritten for a textfile collector
+} metrics_sink;
+
+// everything here is written with relaxed atomics from whichever thread
+// sees the event and only ever read by the exporter, so a scrape never
+// takes a lock the hot path could be waiting on. throughput is left to
+// rate() over the counters
+typedef struct
+{
+    atomic_uint_fast64_t frames_sent;
+    atomic_uint_fast64_t frames_received;
+    atomic_uint_fast64_t bytes_sent;
+    atomic_uint_fast64_t bytes_received;
+    atomic_uint_fast64_t messages_sent;     // send message requests
+    atomic_uint_fast64_t messages_received; // messages handed to the ui
+    atomic_uint_fast64_t connects;
+    atomic_uint_fast64_t reconnects;        // failures that scheduled a retry
+    atomic_uint_fast64_t events_dropped;    // net thread -> ui overflow
+
+    // request -> response, only sampled when the pairing is unambiguous
+    atomic_uint_fast64_t rtt_buckets[METRICS_RTT_BUCKETS];
+    atomic_uint_fast64_t rtt_count;
+    atomic_uint_fast64_t rtt_sum_us;
+    atomic_uint_fast64_t rtt_last_us;
+
+    atomic_uint queue_depth[METRICS_QUEUE_COUNT];
+    atomic_int sessions[METRICS_STATE_COUNT]; // by client_state
+    atomic_uint_fast64_t responses[METRICS_STATUS_CODES]; // by status byte
+} metrics_registry;
+
+extern metrics_registry metrics;
+
+// parse unix:<path>, http:<port> or file:<path> and start the exporter
+// thread. stops itself at exit
+int metrics_start(const char *spec);
+void metrics_stop(void);
+
+void metrics_rtt(int64_t ns);
+
+static inline void metrics_add(atomic_uint_fast64_t *counter, uint64_t n) {
+  atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline void metrics_frame_sent(uint8_t type, size_t body_len) {
+  metrics_add(&metrics.frames_sent, 1);
+  metrics_add(&metrics.bytes_sent, sizeof(big_header_t) + body_len);
+  if (type == TYPE_SEND_MESSAGE_REQUEST) {
+    metrics_add(&metrics.messages_sent, 1);
+  }
+}
+
+static inline void metrics_frame_received(uint8_t status, size_t body_len) {
+  metrics_add(&metrics.frames_received, 1);
+  metrics_add(&metrics.bytes_received, sizeof(big_header_t) + body_len);
+  metrics_add(&metrics.responses[status], 1);
+}
+
+// -1 for either side when the connection is appearing or going away
+static inline void metrics_set_state(int from, int to) {
+  if (from >= 0 && from < METRICS_STATE_COUNT) {
+    atomic_fetch_sub_explicit(&metrics.sessions[from], 1,
+                              memory_order_relaxed);
+  }
+  if (to >= 0 && to < METRICS_STATE_COUNT) {
+    atomic_fetch_add_explicit(&metrics.sessions[to], 1, memory_order_relaxed);
+  }
+}
+
+static inline void metrics_set_queue(metrics_queue queue, size_t depth) {
+  atomic_store_explicit(&metrics.queue_depth[queue], (unsigned)depth,
+                        memory_order_relaxed);
+}
+
+#endif /* METRICS_H */
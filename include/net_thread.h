@@ -0,0 +1,108 @@
+#ifndef NET_THREAD_H
+#define NET_THREAD_H
+
+#include "client.h"
+#include "clock_sync.h"
+#include "protocol.h"
+#include "spsc_queue.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+enum
+{
+    NET_TEXT_LENGTH = 512,
+    NET_QUEUE_SLOTS = 256,
+    NET_FETCH_INTERVAL_MS = 500
+};
+
+typedef enum
+{
+    NET_CMD_SEND_MESSAGE,
+    NET_CMD_FETCH,
+    NET_CMD_JOIN,
+    NET_CMD_CHANNEL_INFO,
+    NET_CMD_SHUTDOWN
+} net_command_type;
+
+// ui -> network
+typedef struct
+{
+    net_command_type type;
+    uint8_t channel_id;
+    uint16_t length;
+    char text[NET_TEXT_LENGTH];
+} net_command;
+
+typedef enum
+{
+    NET_EVT_CONNECTED,
+    NET_EVT_MESSAGE,
+    NET_EVT_RESPONSE,
+    NET_EVT_ERROR,
+    NET_EVT_MEMBERS, // channel info: text holds length user ids
+    NET_EVT_DISCONNECTED
+} net_event_type;
+
+// network -> ui
+typedef struct
+{
+    net_event_type type;
+    uint8_t msg_type;
+    uint8_t status;
+    uint8_t channel_id;
+    uint8_t sender_id;
+    uint64_t timestamp;
+    uint16_t length;
+    char text[NET_TEXT_LENGTH];
+} net_event;
+
+// eventfd on linux, a self-pipe everywhere else
+typedef struct
+{
+    int read_fd;
+    int write_fd;
+} net_wakeup;
+
+typedef struct
+{
+    pthread_t thread;
+    spsc_queue commands;
+    spsc_queue events;
+    net_wakeup cmd_wake;
+    net_wakeup evt_wake;
+    atomic_int running;
+    atomic_int exited; // set last thing, the queue may have dropped the event
+    atomic_size_t events_dropped;
+    int disconnect_seen; // ui side
+
+    // copied out of client_context so the thread never touches it
+    struct sockaddr_storage addr;
+    uint16_t port;
+    big_auth_t auth;
+    uint8_t channel_id;
+
+    // owned by the network thread
+    int sock_fd;
+    int fetch_outstanding;
+    unsigned in_flight; // requests waiting for a response
+    int64_t sent_ns;    // when the newest of them went out
+    clock_sync clock;
+    uint64_t last_timestamp;
+} net_thread;
+
+int net_thread_start(net_thread *nt, const client_context *ctx);
+void net_thread_stop(net_thread *nt);
+
+// ui side, never blocks. returns -1 when the command queue is full
+int net_thread_submit(net_thread *nt, const net_command *cmd);
+
+// ui side, returns 0 and fills evt, or -1 when nothing is queued. once the
+// thread is gone this hands out NET_EVT_DISCONNECTED even if pushing it failed
+int net_thread_next_event(net_thread *nt, net_event *evt);
+
+// poll this for readability, then clear it before draining events
+int net_thread_event_fd(const net_thread *nt);
+void net_thread_clear_event_fd(const net_thread *nt);
+
+#endif /* NET_THREAD_H */
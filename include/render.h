@@ -0,0 +1,83 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "history.h"
+#include "user_directory.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    RENDER_MAX_ROWS = 256,
+    RENDER_LINE_LENGTH = 1024,
+    RENDER_DETAIL_LENGTH = 64,
+    RENDER_DEFAULT_FPS = 30
+};
+
+// growable output buffer reused for every frame
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} render_buffer;
+
+// terminal renderer. each frame is built in one buffer, only rows whose
+// content changed since the last frame are rewritten, and the result goes
+// out in a single write at most fps times a second. when fd is not a tty it
+// degrades to appending new timeline rows as plain lines
+typedef struct
+{
+    int fd;
+    int is_tty;
+    int rows;
+    int cols;
+    int min_frame_ms;
+    int64_t last_frame_ms;
+    int dirty;
+    int full_redraw;
+
+    render_buffer out;
+    char status[RENDER_LINE_LENGTH];
+    char status_detail[RENDER_DETAIL_LENGTH];
+    char prompt[RENDER_LINE_LENGTH];
+    uint64_t drawn[RENDER_MAX_ROWS]; // hash of what each screen row shows
+
+    const history_store *history;
+    uint64_t drawn_seq; // next timeline seq not yet on screen
+    user_directory *users; // names for sender ids, optional
+} renderer;
+
+int render_init(renderer *r, int fd, const history_store *history, int fps);
+void render_destroy(renderer *r);
+
+void render_set_status(renderer *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// appended to the status on a terminal only. for counters and the like:
+// piped output prints the status again whenever it changes
+void render_set_status_detail(renderer *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void render_set_prompt(renderer *r, const char *prompt);
+
+// show names instead of sender ids where the directory has them, and for
+// the rest whether channel info still lists them. lookups queue fetches,
+// the owner flushes the directory after render_flush
+void render_set_users(renderer *r, user_directory *users);
+
+// the history gained rows
+void render_mark_dirty(renderer *r);
+
+// the terminal scrolled or was resized, repaint everything next frame
+void render_invalidate(renderer *r);
+
+// ms until the next frame may be drawn, -1 when nothing is pending
+int render_timeout_ms(const renderer *r);
+
+// draw a frame if one is pending and the rate cap allows it
+int render_flush(renderer *r);
+
+// draw a pending frame now, rate cap or not (the last one before exit)
+int render_flush_now(renderer *r);
+
+#endif /* RENDER_H */
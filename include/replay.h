@@ -0,0 +1,17 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "client.h"
+
+enum
+{
+    REPLAY_DRAIN_MS = 2000 // how long to wait for the last responses
+};
+
+// map the trace in ctx->replay_path and send its recorded frames to
+// ctx->manager_ip:manager_port, one connection per recorded connection,
+// spaced like the original scaled by ctx->replay_speed (0 = as fast as
+// possible). prints how send lag and response latency compare to the trace
+void replay_run(client_context *ctx);
+
+#endif /* REPLAY_H */
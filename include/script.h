@@ -0,0 +1,63 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "client.h"
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    SCRIPT_DEFAULT_WINDOW = 16,
+    SCRIPT_MAX_WINDOW = 1024,
+    SCRIPT_LINE_LENGTH = 1024,
+    SCRIPT_INPUT_SIZE = 65536,
+    SCRIPT_OUTPUT_SIZE = 65536, // frames waiting for the socket to drain
+    SCRIPT_DETAIL_LENGTH = 1024,
+    SCRIPT_TIMEOUT_MS = 5000 // least the oldest request may wait, the RTO can add
+};
+
+typedef enum
+{
+    SCRIPT_REGISTER,
+    SCRIPT_LOGIN,
+    SCRIPT_JOIN,
+    SCRIPT_SEND,
+    SCRIPT_FETCH,
+    SCRIPT_LOGOUT,
+    SCRIPT_INVALID
+} script_command;
+
+// one command between reading it and printing its result. local commands
+// (join, bad lines) are born done but still wait their turn to print
+typedef struct
+{
+    unsigned line;
+    uint8_t command; // script_command
+    uint8_t expect;  // response type, 0 when nothing was sent
+    uint8_t done;
+    uint8_t answered; // status came from the server
+    uint8_t status;
+    int64_t sent_ns;
+    int64_t rtt_ns;
+    char detail[SCRIPT_DETAIL_LENGTH];
+} script_slot;
+
+// read commands from ctx->script_path ("-" for stdin), one per line:
+//   register <user> <password>
+//   login <user> <password>
+//   join <channel>
+//   send <text...>
+//   fetch [<since_ms>]
+//   logout
+// and run them over one node connection with up to ctx->script_window
+// requests in flight. the node answers in order, so each response belongs
+// to the oldest unanswered request. a bare fetch asks for what is newer than
+// the last message fetched, so nothing after it is sent until it is
+// answered. results go to stdout in script order, tab separated:
+// "line command status rtt_us detail", status being the server's code as
+// 0xNN, "local" or "error". a fetched message's detail is
+// "channel sender timestamp text". exits non-zero if any command failed
+void script_run(client_context *ctx);
+
+#endif /* SCRIPT_H */
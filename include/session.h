@@ -0,0 +1,102 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "buffer_pool.h"
+#include "client.h"
+#include "clock_sync.h"
+#include "frame.h"
+#include "protocol.h"
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    SESSION_BUFFER_SIZE = 1024,
+    SESSION_FETCH_INTERVAL_MS = 500,
+    SESSION_TIMEOUT_MS = 5000,
+    SESSION_RETRY_MIN_MS = 1000,
+    SESSION_RETRY_MAX_MS = 30000,
+    SESSION_LOGOUT_GRACE_MS = 2000
+};
+
+// one account driven without blocking. the interactive phases map onto
+// client_state like this:
+//   STATE_DISCONNECTED          idle until the (re)connect deadline
+//   STATE_DISCOVERING           talking to the manager
+//   STATE_CONNECTING_TO_SERVER  connecting to the node, account creation
+//   STATE_AWAITING_USER_INFO    login in flight
+//   STATE_MESSAGING             logged in, fetching on a timer
+//   STATE_EXITING               logout in flight
+// buffers come from the loop's pool only while a frame is being assembled
+// or a write is half done, so an idle account holds nothing but this struct
+typedef struct
+{
+    client_state state;
+    int fd;
+    int connecting;
+    int finished;
+    int fetch_outstanding;
+    unsigned pending; // requests waiting for a response
+    int64_t sent_ns;  // when the newest pending request went out
+    clock_sync clock; // to the node, kept across reconnects
+
+    big_auth_t auth;
+    uint8_t account_id;
+    uint8_t channel_id;
+    struct sockaddr_in manager;
+    struct sockaddr_in node;
+
+    frame_decoder dec;
+    uint8_t *rx;
+    uint8_t *tx;
+    size_t tx_len;
+    size_t tx_off;
+
+    int64_t deadline;   // response timeout, or when to reconnect
+    int64_t next_fetch;
+    int64_t retry_ms;
+    uint64_t last_timestamp;
+} session;
+
+typedef void (*session_message_fn)(void *arg, const session *s,
+                                   uint8_t channel_id, uint8_t sender_id,
+                                   uint64_t timestamp, const char *text,
+                                   size_t length);
+
+// every session shares one poll set, one read chunk and one buffer pool
+typedef struct
+{
+    session *sessions;
+    size_t count;
+    size_t capacity;
+    struct pollfd *pfds;
+    buffer_pool pool;
+    session_message_fn on_message;
+    void *arg;
+    int stopping;
+} session_loop;
+
+int session_loop_init(session_loop *loop, size_t capacity,
+                      session_message_fn on_message, void *arg);
+void session_loop_destroy(session_loop *loop);
+
+session *session_loop_add(session_loop *loop, const char *username,
+                          const char *password,
+                          const struct sockaddr_in *manager);
+session *session_loop_find(session_loop *loop, const char *username);
+
+// -1 when the session is not logged in or still flushing a previous write
+int session_send_message(session_loop *loop, session *s, const char *text,
+                         size_t length);
+
+// poll once (extra_fd too, if >= 0), run every due state transition and
+// return how many sessions are still alive
+size_t session_loop_run_once(session_loop *loop, int extra_fd,
+                             int *extra_ready);
+
+// log every session out; keep calling run_once until it returns 0
+void session_loop_shutdown(session_loop *loop);
+
+#endif /* SESSION_H */
@@ -0,0 +1,62 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    SHM_RING_MAGIC = 0x42494752, // "BIGR"
+    SHM_RING_VERSION = 1,
+    SHM_RING_SLOTS = 1024,
+    SHM_RING_TEXT_LENGTH = 512,
+    SHM_RING_NAME_LENGTH = 64
+};
+
+// one published message. seq is a per-slot seqlock: odd while the writer is
+// filling the slot, 2 * (n + 1) once message n is complete
+typedef struct
+{
+    atomic_uint_fast64_t seq;
+    uint64_t timestamp;
+    uint8_t channel_id;
+    uint8_t sender_id;
+    uint16_t length;
+    char text[SHM_RING_TEXT_LENGTH];
+} shm_ring_slot;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    _Alignas(64) atomic_uint_fast64_t head; // number of messages published
+    _Alignas(64) shm_ring_slot slots[SHM_RING_SLOTS];
+} shm_ring_layout;
+
+// one writer (the daemon) publishes, any number of processes map it
+// read-only and follow along with their own cursor
+typedef struct
+{
+    char name[SHM_RING_NAME_LENGTH];
+    shm_ring_layout *ring;
+    int writer;
+    uint64_t cursor; // reader: next message number to read
+} shm_ring;
+
+int shm_ring_create(shm_ring *r, const char *name);
+int shm_ring_attach(shm_ring *r, const char *name);
+void shm_ring_close(shm_ring *r);
+
+void shm_ring_publish(shm_ring *r, uint8_t channel_id, uint8_t sender_id,
+                      uint64_t timestamp, const char *text, size_t length);
+
+// zero-copy read: begin hands out the slot for the reader's cursor (NULL
+// when caught up), end returns 0 if the slot was not overwritten meanwhile.
+// lost counts messages skipped because the reader fell a full ring behind
+const shm_ring_slot *shm_ring_begin(shm_ring *r, uint64_t *lost);
+int shm_ring_end(shm_ring *r, const shm_ring_slot *slot);
+
+#endif /* SHM_RING_H */
@@ -0,0 +1,34 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+enum
+{
+    SPSC_CACHE_LINE = 64
+};
+
+// bounded single-producer/single-consumer ring of fixed-size slots.
+// head is only written by the consumer and tail only by the producer, so
+// neither side ever takes a lock
+typedef struct
+{
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t head;
+    _Alignas(SPSC_CACHE_LINE) atomic_size_t tail;
+    _Alignas(SPSC_CACHE_LINE) size_t mask;
+    size_t slot_size;
+    unsigned char *slots;
+} spsc_queue;
+
+// capacity is rounded up to a power of two
+int spsc_queue_init(spsc_queue *q, size_t capacity, size_t slot_size);
+void spsc_queue_destroy(spsc_queue *q);
+
+// both return 0 on success, -1 when full/empty
+int spsc_queue_push(spsc_queue *q, const void *item);
+int spsc_queue_pop(spsc_queue *q, void *item);
+
+size_t spsc_queue_depth(spsc_queue *q);
+
+#endif /* SPSC_QUEUE_H */
@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+enum
+{
+    TRACE_MAGIC = 0x54474942, // "BIGT"
+    TRACE_VERSION = 2,
+    TRACE_RING_EVENTS = 8192, // per thread, power of two
+    TRACE_MAX_THREADS = 64,
+    TRACE_FLUSH_INTERVAL_MS = 50
+};
+
+typedef enum
+{
+    TRACE_STATE = 1,        // id: 0 client, 1 + slot bridge session,
+                            // a: new client_state, b: old
+    TRACE_FRAME_SENT,       // id: connection, a: type, b: status,
+                            // value: body size
+    TRACE_FRAME_RECEIVED,   // same
+    TRACE_CONNECT,          // id: connection, value: port
+    TRACE_CLOSE,            // id: connection
+    TRACE_QUEUE_DEPTH,      // id: trace_queue, value: depth
+    TRACE_DROPPED           // value: events lost because a ring was full
+} trace_kind;
+
+typedef enum
+{
+    TRACE_QUEUE_NET_COMMANDS,
+    TRACE_QUEUE_NET_EVENTS
+} trace_queue;
+
+// one event, 24 bytes on disk and in the ring
+typedef struct
+{
+    uint64_t t_ns; // monotonic, relative to trace_start
+    uint32_t value;
+    int32_t id;
+    uint16_t tid;  // ring index, one per thread
+    uint8_t kind;  // trace_kind
+    uint8_t a;
+    uint8_t b;
+    uint8_t reserved[3];
+} trace_event;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_wall_ms;
+} trace_file_header;
+
+// single producer (the owning thread), single consumer (the flusher)
+typedef struct
+{
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) atomic_uint_fast32_t dropped;
+    uint16_t tid;
+    trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+extern atomic_int trace_enabled;
+
+// open the file and start the flusher. stops itself at exit
+int trace_start(const char *path);
+void trace_stop(void);
+
+// slow path, only reached while tracing. frame and socket events are
+// recorded with the fd and stored under its conn_id_of, fds get reused
+void trace_emit(trace_kind kind, int32_t id, uint8_t a, uint8_t b,
+                uint32_t value);
+
+// the only cost when tracing is off is this load and branch
+static inline void trace_record(trace_kind kind, int32_t id, uint8_t a,
+                                uint8_t b, uint32_t value) {
+  if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+    trace_emit(kind, id, a, b, value);
+  }
+}
+
+#endif /* TRACE_H */
@@ -0,0 +1,82 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    USER_DIRECTORY_SLOTS = 256,         // one per possible sender_id
+    USER_DIRECTORY_TTL_MS = 300000,     // how long a fetched entry is trusted
+    USER_DIRECTORY_RETRY_MS = 5000,     // give up on an unanswered fetch
+    USER_DIRECTORY_BATCH = 32           // ids handed to one fetch
+};
+
+typedef enum
+{
+    USER_EMPTY,   // never seen
+    USER_MEMBER,  // listed in channel info, name not known
+    USER_ABSENT,  // asked for and not listed
+    USER_KNOWN    // name known
+} user_entry_state;
+
+typedef struct
+{
+    uint8_t state;     // user_entry_state
+    uint8_t pinned;    // learned from an account response, never expires
+    uint8_t fetching;  // queued or in flight, do not ask again
+    uint32_t version;  // directory version the entry was filled under
+    int64_t expires;   // TTL, or the retry deadline while fetching
+    char name[USERNAME_LENGTH + 1];
+} user_entry;
+
+// asked for a batch of ids nobody has resolved yet. the entries stay
+// in flight until user_directory_members/learn answers them or they time out
+typedef void (*user_directory_fetch_fn)(void *arg, const uint8_t *ids,
+                                        size_t count);
+
+// sender_id -> username, indexed directly by the id. single threaded: the
+// owner looks names up while drawing and flushes the batch once per pass,
+// so a burst of messages from one unknown sender costs one fetch
+typedef struct
+{
+    user_entry entries[USER_DIRECTORY_SLOTS];
+    uint32_t version; // bump to make every unpinned entry stale at once
+    int64_t ttl_ms;
+
+    uint8_t batch[USER_DIRECTORY_BATCH];
+    size_t batch_count;
+    user_directory_fetch_fn fetch;
+    void *arg;
+} user_directory;
+
+void user_directory_init(user_directory *d, int64_t ttl_ms,
+                         user_directory_fetch_fn fetch, void *arg);
+
+// the name for id, or NULL. an unknown or stale id is queued for the next
+// flush unless a fetch for it is already in flight
+const char *user_directory_lookup(user_directory *d, uint8_t id, int64_t now);
+
+// what the last answer said about id in the current channel: USER_EMPTY
+// until one arrived, or once a version bump made it stale. channel info
+// only carries ids, so for anyone but ourselves this is as far as a fetch
+// gets: USER_MEMBER or USER_ABSENT, never a name
+user_entry_state user_directory_state(const user_directory *d, uint8_t id);
+
+// hand the queued ids to the fetch callback
+void user_directory_flush(user_directory *d);
+
+// a name from an account response
+void user_directory_learn(user_directory *d, uint8_t id, const char *name,
+                          size_t length, int pinned, int64_t now);
+
+// the member list from a channel info response. anything in flight that is
+// not listed is remembered as absent until the TTL runs out
+void user_directory_members(user_directory *d, const uint8_t *ids,
+                            size_t count, int64_t now);
+
+// membership changed (joined another channel, reconnected)
+void user_directory_invalidate(user_directory *d);
+
+#endif /* USER_DIRECTORY_H */
@@ -2,6 +2,14 @@
 #define UTILS_H
 
 #include "client.h"
+#include <pthread.h>
+#include <stdint.h>
+
+enum
+{
+    CONN_ID_FDS = 4096,           // fds above this are not tracked
+    CONN_ID_UNTRACKED = 1 << 30   // or'ed with the fd by conn_id_of
+};
 
 void cleanup_client(client_context *ctx);
 
@@ -11,4 +19,27 @@ void get_user_input(char *dest, size_t size, const char *prompt);
 
 void quit(client_context *ctx);
 
+// every phase change goes through here so it shows up in traces
+void client_set_state(client_context *ctx, client_state state);
+
+// CLOCK_MONOTONIC in ms, for timeouts and intervals
+int64_t monotonic_ms(void);
+int64_t monotonic_ns(void);
+
+// protocol timestamps are milliseconds since the unix epoch
+uint64_t wall_clock_ms(void);
+
+// fds get reused (discovery, login and the node socket usually share one
+// number), so captures name connections by these instead. conn_id_open
+// hands the next number to a freshly connected fd, conn_id_close forgets it
+uint32_t conn_id_open(int fd);
+void conn_id_close(int fd);
+
+// the fd's connection number, CONN_ID_UNTRACKED | fd if nobody opened it
+uint32_t conn_id_of(int fd);
+
+// pthread_create with SIGINT and SIGTERM blocked in the new thread, so a
+// stop signal always lands on the main thread and interrupts its poll
+int spawn_thread(pthread_t *thread, void *(*fn)(void *), void *arg);
+
 #endif /* UTILS_H */
\ No newline at end of file
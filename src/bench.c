@@ -0,0 +1,518 @@
+#include "bench.h"
+#include "frame.h"
+#include "history.h"
+#include "protocol.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// microbenchmarks for the codec and the per-message hot paths. every case is
+// calibrated until one repetition runs for BENCH_MIN_RUN_NS, then repeated
+// and reported as the median with the min/max spread
+
+#ifdef __GLIBC__
+// count every heap allocation made while a case runs by wrapping the
+// allocator glibc exports under its internal names
+// NOLINTBEGIN(bugprone-reserved-identifier)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+// NOLINTEND(bugprone-reserved-identifier)
+
+static size_t bench_allocs;
+
+void *malloc(size_t size) {
+  bench_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  bench_allocs++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  return __libc_realloc(ptr, size);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#endif
+
+static volatile uint64_t bench_sink;
+
+static bench_sample samples[] = {
+    {.name = "discovery_res", .type = TYPE_DISCOVERY_RESPONSE},
+    {.name = "create_account", .type = TYPE_ACCOUNT_CREATE_REQUEST},
+    {.name = "login_logout", .type = TYPE_LOGIN_OR_LOGOUT_REQUEST},
+    {.name = "channel_info", .type = TYPE_GET_CHANNEL_INFO_RESPONSE},
+    {.name = "channel_list", .type = TYPE_LIST_ALL_CHANNELS_RESPONSE},
+    {.name = "send_message", .type = TYPE_SEND_MESSAGE_REQUEST},
+    {.name = "get_message", .type = TYPE_GET_MESSAGE_RESPONSE},
+};
+enum
+{
+    SAMPLE_COUNT = sizeof(samples) / sizeof(samples[0])
+};
+
+static const big_auth_t bench_auth = {.username = "benchmark",
+                                      .password = "hunter2"};
+static const char bench_text[BENCH_TEXT_LENGTH] =
+    "the quick brown fox jumps over the lazy dog, again and again....";
+
+static uint8_t *stream;
+static size_t stream_len;
+static history_store fill_store;   // takes fresh keys, evicting as it goes
+static history_store lookup_store; // prefilled, never modified
+static uint64_t fill_timestamp;
+
+static void usage(const char *argv0);
+static size_t encode_frame(uint8_t type, uint64_t seq, uint8_t *out);
+static size_t decode_frame(const uint8_t *in, uint64_t *sink);
+static int setup(void);
+static void teardown(void);
+static uint64_t bench_encode(int arg, uint64_t iterations, uint64_t *sink);
+static uint64_t bench_decode(int arg, uint64_t iterations, uint64_t *sink);
+static uint64_t bench_validate(int arg, uint64_t iterations, uint64_t *sink);
+static uint64_t bench_stream(int arg, uint64_t iterations, uint64_t *sink);
+static uint64_t bench_history_insert(int arg, uint64_t iterations,
+                                     uint64_t *sink);
+static uint64_t bench_history_duplicate(int arg, uint64_t iterations,
+                                        uint64_t *sink);
+static uint64_t bench_history_lookup(int arg, uint64_t iterations,
+                                     uint64_t *sink);
+static bench_result run_case(const bench_case *c, int reps);
+static int compare_double(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+  const char *filter = NULL;
+  int reps = BENCH_DEFAULT_REPS;
+  int opt;
+
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":r:f:ch")) != -1) {
+    switch (opt) {
+    case 'c':
+      return bench_check() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    case 'r':
+      reps = atoi(optarg);
+      if (reps < 1 || reps > BENCH_MAX_REPS) {
+        fprintf(stderr, "Error: -r takes 1-%d repetitions.\n",
+                BENCH_MAX_REPS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (setup() == -1) {
+    fputs("bench: out of memory\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  // encode/decode/validate per layout, 4 stream splits, 4 history cases
+  char names[(3 * SAMPLE_COUNT) + 8][48];
+  bench_case cases[(3 * SAMPLE_COUNT) + 8];
+  size_t count = 0;
+  static const int chunks[] = {1, 7, 64, 4096};
+
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    snprintf(names[count], sizeof(names[count]), "encode %s", samples[i].name);
+    cases[count] = (bench_case){names[count], bench_encode, i};
+    count++;
+  }
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    snprintf(names[count], sizeof(names[count]), "decode %s", samples[i].name);
+    cases[count] = (bench_case){names[count], bench_decode, i};
+    count++;
+  }
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    snprintf(names[count], sizeof(names[count]), "validate %s",
+             samples[i].name);
+    cases[count] = (bench_case){names[count], bench_validate, i};
+    count++;
+  }
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+    snprintf(names[count], sizeof(names[count]), "stream split %d",
+             chunks[i]);
+    cases[count] = (bench_case){names[count], bench_stream, chunks[i]};
+    count++;
+  }
+  cases[count++] = (bench_case){"history insert", bench_history_insert, 0};
+  cases[count++] =
+      (bench_case){"history insert dup", bench_history_duplicate, 0};
+  cases[count++] = (bench_case){"history lookup hit", bench_history_lookup, 1};
+  cases[count++] = (bench_case){"history lookup miss", bench_history_lookup, 0};
+
+  printf("%-24s %10s %14s %10s   %s (%d reps)\n", "benchmark", "ns/op",
+         "ops/sec", "allocs/op", "min-max ns", reps);
+  for (size_t i = 0; i < count; i++) {
+    if (filter != NULL && strstr(cases[i].name, filter) == NULL) {
+      continue;
+    }
+
+    bench_result r = run_case(&cases[i], reps);
+    char allocs[16];
+    if (r.allocs_per_op < 0) {
+      snprintf(allocs, sizeof(allocs), "n/a");
+    } else {
+      snprintf(allocs, sizeof(allocs), "%.3f", r.allocs_per_op);
+    }
+    printf("%-24s %10.1f %14.0f %10s   %.1f-%.1f\n", cases[i].name,
+           r.ns_median, 1e9 / r.ns_median, allocs, r.ns_min, r.ns_max);
+  }
+
+  teardown();
+  return EXIT_SUCCESS;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [-r <reps>] [-f <filter>] [-c] [-h]\n", argv0);
+  fputs("\nOptions: \n", stderr);
+  fputs("  -r <reps> Timed repetitions per benchmark (default 7)\n", stderr);
+  fputs("  -f <filter> Only run benchmarks whose name contains <filter>\n",
+        stderr);
+  fputs("  -c Run the self-checks instead, exit non-zero on a failure\n",
+        stderr);
+  fputs(" -h Display this help and exit\n", stderr);
+}
+
+// build a whole frame of the given type the way the client would, host
+// values converted on the way in
+static size_t encode_frame(uint8_t type, uint64_t seq, uint8_t *out) {
+  uint8_t *body = out + sizeof(big_header_t);
+  size_t len = 0;
+
+  switch (type) {
+  case TYPE_DISCOVERY_RESPONSE: {
+    big_discovery_res_t res = {.ip_address = {127, 0, 0, 1},
+                               .server_id = (uint8_t)seq};
+    memcpy(body, &res, sizeof(res));
+    len = sizeof(res);
+    break;
+  }
+  case TYPE_ACCOUNT_CREATE_REQUEST: {
+    big_create_account_req_t req;
+    req.authentication = bench_auth;
+    req.client_id = (uint8_t)seq;
+    memcpy(body, &req, sizeof(req));
+    len = sizeof(req);
+    break;
+  }
+  case TYPE_LOGIN_OR_LOGOUT_REQUEST: {
+    big_login_logout_req_t req;
+    req.authentication = bench_auth;
+    req.client_ip = (ipv4_address_t){127, 0, 0, 1};
+    req.status = 1;
+    memcpy(body, &req, sizeof(req));
+    len = sizeof(req);
+    break;
+  }
+  case TYPE_GET_CHANNEL_INFO_RESPONSE: {
+    big_channel_info_t info;
+    info.authentication = bench_auth;
+    memset(info.channel_name, 0, sizeof(info.channel_name));
+    memcpy(info.channel_name, "general", sizeof("general"));
+    info.channel_id = (uint8_t)seq;
+    info.user_id_length = BENCH_MEMBER_COUNT;
+    memcpy(body, &info, sizeof(info));
+    for (uint8_t i = 0; i < BENCH_MEMBER_COUNT; i++) {
+      body[sizeof(info) + i] = (uint8_t)(seq + i);
+    }
+    len = sizeof(info) + BENCH_MEMBER_COUNT;
+    break;
+  }
+  case TYPE_LIST_ALL_CHANNELS_RESPONSE: {
+    big_channel_list_t list;
+    list.authentication = bench_auth;
+    list.channel_id_length = BENCH_MEMBER_COUNT;
+    memcpy(body, &list, sizeof(list));
+    for (uint8_t i = 0; i < BENCH_MEMBER_COUNT; i++) {
+      body[sizeof(list) + i] = (uint8_t)(seq + i);
+    }
+    len = sizeof(list) + BENCH_MEMBER_COUNT;
+    break;
+  }
+  case TYPE_SEND_MESSAGE_REQUEST: {
+    big_send_message_t msg;
+    msg.authentication = bench_auth;
+    msg.timestamp = frame_hton64(seq);
+    msg.message_length = htons(BENCH_TEXT_LENGTH);
+    msg.channel_id = 1;
+    memcpy(body, &msg, sizeof(msg));
+    memcpy(body + sizeof(msg), bench_text, BENCH_TEXT_LENGTH);
+    len = sizeof(msg) + BENCH_TEXT_LENGTH;
+    break;
+  }
+  case TYPE_GET_MESSAGE_RESPONSE: {
+    big_get_message_t msg;
+    msg.authentication = bench_auth;
+    msg.timestamp = frame_hton64(seq);
+    msg.message_length = htons(BENCH_TEXT_LENGTH);
+    msg.channel_id = 1;
+    msg.sender_id = (uint8_t)seq;
+    memcpy(body, &msg, sizeof(msg));
+    memcpy(body + sizeof(msg), bench_text, BENCH_TEXT_LENGTH);
+    len = sizeof(msg) + BENCH_TEXT_LENGTH;
+    break;
+  }
+  default:
+    break;
+  }
+
+  big_header_t hdr;
+  frame_header_init(&hdr, type, STATUS_OK, (uint32_t)len);
+  memcpy(out, &hdr, sizeof(hdr));
+  return sizeof(hdr) + len;
+}
+
+// pull the fields back out into host order, returns the body length
+static size_t decode_frame(const uint8_t *in, uint64_t *sink) {
+  big_header_t hdr;
+  const uint8_t *body = in + sizeof(hdr);
+
+  memcpy(&hdr, in, sizeof(hdr));
+  size_t len = ntohl(hdr.body);
+
+  switch (hdr.type) {
+  case TYPE_DISCOVERY_RESPONSE: {
+    big_discovery_res_t res;
+    memcpy(&res, body, sizeof(res));
+    *sink += res.ip_address.d + res.server_id;
+    break;
+  }
+  case TYPE_ACCOUNT_CREATE_REQUEST: {
+    big_create_account_req_t req;
+    memcpy(&req, body, sizeof(req));
+    *sink += req.client_id + (uint8_t)req.authentication.username[0];
+    break;
+  }
+  case TYPE_LOGIN_OR_LOGOUT_REQUEST: {
+    big_login_logout_req_t req;
+    memcpy(&req, body, sizeof(req));
+    *sink += req.status + req.client_ip.a;
+    break;
+  }
+  case TYPE_GET_CHANNEL_INFO_RESPONSE: {
+    big_channel_info_t info;
+    memcpy(&info, body, sizeof(info));
+    *sink += info.channel_id + body[sizeof(info) + info.user_id_length - 1];
+    break;
+  }
+  case TYPE_LIST_ALL_CHANNELS_RESPONSE: {
+    big_channel_list_t list;
+    memcpy(&list, body, sizeof(list));
+    *sink += body[sizeof(list) + list.channel_id_length - 1];
+    break;
+  }
+  case TYPE_SEND_MESSAGE_REQUEST: {
+    big_send_message_t msg;
+    memcpy(&msg, body, sizeof(msg));
+    *sink += frame_ntoh64(msg.timestamp) + ntohs(msg.message_length);
+    break;
+  }
+  case TYPE_GET_MESSAGE_RESPONSE: {
+    big_get_message_t msg;
+    memcpy(&msg, body, sizeof(msg));
+    *sink += frame_ntoh64(msg.timestamp) + ntohs(msg.message_length) +
+             msg.sender_id;
+    break;
+  }
+  default:
+    break;
+  }
+  return len;
+}
+
+static int setup(void) {
+  for (int i = 0; i < SAMPLE_COUNT; i++) {
+    samples[i].len = encode_frame(samples[i].type, (uint64_t)i + 1,
+                                  samples[i].wire);
+  }
+
+  // a stream that cycles through every layout
+  stream_len = 0;
+  for (int i = 0; i < BENCH_STREAM_FRAMES; i++) {
+    stream_len += samples[i % SAMPLE_COUNT].len;
+  }
+  stream = malloc(stream_len);
+  if (stream == NULL) {
+    return -1;
+  }
+  size_t off = 0;
+  for (int i = 0; i < BENCH_STREAM_FRAMES; i++) {
+    const bench_sample *s = &samples[i % SAMPLE_COUNT];
+    memcpy(stream + off, s->wire, s->len);
+    off += s->len;
+  }
+
+  if (history_init(&fill_store, HISTORY_DEFAULT_CAPACITY) == -1 ||
+      history_init(&lookup_store, HISTORY_DEFAULT_CAPACITY) == -1) {
+    return -1;
+  }
+  for (uint64_t ts = 1; ts <= HISTORY_DEFAULT_CAPACITY; ts++) {
+    history_insert(&lookup_store, 1, (uint8_t)ts, ts, bench_text,
+                   BENCH_TEXT_LENGTH);
+  }
+  return 0;
+}
+
+static void teardown(void) {
+  history_destroy(&lookup_store);
+  history_destroy(&fill_store);
+  free(stream);
+}
+
+static uint64_t bench_encode(int arg, uint64_t iterations, uint64_t *sink) {
+  uint8_t out[BENCH_FRAME_MAX];
+  uint8_t type = samples[arg].type;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    size_t len = encode_frame(type, i, out);
+    *sink += len + out[len - 1];
+  }
+  return iterations;
+}
+
+static uint64_t bench_decode(int arg, uint64_t iterations, uint64_t *sink) {
+  const uint8_t *wire = samples[arg].wire;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    *sink += decode_frame(wire, sink);
+  }
+  return iterations;
+}
+
+static uint64_t bench_validate(int arg, uint64_t iterations, uint64_t *sink) {
+  const bench_sample *s = &samples[arg];
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    big_header_t hdr;
+    memcpy(&hdr, s->wire, sizeof(hdr));
+    hdr.body = ntohl(hdr.body);
+    *sink += frame_validate_body(&hdr, s->wire + sizeof(hdr),
+                                 s->len - sizeof(hdr));
+  }
+  return iterations;
+}
+
+// feed the stream to a decoder `arg` bytes at a time, one op per frame
+static uint64_t bench_stream(int arg, uint64_t iterations, uint64_t *sink) {
+  uint8_t body[BENCH_FRAME_MAX];
+  frame_decoder dec;
+  uint64_t frames = 0;
+  size_t chunk = (size_t)arg;
+
+  while (frames < iterations) {
+    frame_decoder_init(&dec, body, sizeof(body));
+    for (size_t off = 0; off < stream_len; off += chunk) {
+      size_t n = stream_len - off < chunk ? stream_len - off : chunk;
+      size_t used = 0;
+      for (size_t at = 0; at < n; at += used) {
+        if (frame_decoder_push(&dec, stream + off + at, n - at, &used) ==
+            FRAME_COMPLETE) {
+          *sink += dec.hdr.type + dec.body_have;
+          frame_decoder_reset(&dec);
+          frames++;
+        }
+      }
+    }
+  }
+  return frames;
+}
+
+static uint64_t bench_history_insert(int arg, uint64_t iterations,
+                                     uint64_t *sink) {
+  (void)arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    fill_timestamp++;
+    *sink += (uint64_t)history_insert(&fill_store, 1, (uint8_t)fill_timestamp,
+                                      fill_timestamp, bench_text,
+                                      BENCH_TEXT_LENGTH);
+  }
+  return iterations;
+}
+
+static uint64_t bench_history_duplicate(int arg, uint64_t iterations,
+                                        uint64_t *sink) {
+  (void)arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t ts = 1 + (i % HISTORY_DEFAULT_CAPACITY);
+    *sink += (uint64_t)history_insert(&lookup_store, 1, (uint8_t)ts, ts,
+                                      bench_text, BENCH_TEXT_LENGTH);
+  }
+  return iterations;
+}
+
+// arg 1 looks up keys that are there, 0 keys that are not
+static uint64_t bench_history_lookup(int arg, uint64_t iterations,
+                                     uint64_t *sink) {
+  uint64_t base = arg ? 1 : HISTORY_DEFAULT_CAPACITY + 1;
+
+  for (uint64_t i = 0; i < iterations; i++) {
+    uint64_t ts = base + (i % HISTORY_DEFAULT_CAPACITY);
+    *sink += history_lookup(&lookup_store, 1, (uint8_t)ts, ts) != NULL;
+  }
+  return iterations;
+}
+
+static bench_result run_case(const bench_case *c, int reps) {
+  bench_result r;
+  double ns[BENCH_MAX_REPS];
+  uint64_t sink = 0;
+  uint64_t iterations = 1;
+
+  // warm up while growing the batch until it is long enough to time
+  for (;;) {
+    int64_t start = monotonic_ns();
+    c->run(c->arg, iterations, &sink);
+    int64_t elapsed = monotonic_ns() - start;
+    if (elapsed >= BENCH_MIN_RUN_NS) {
+      break;
+    }
+    iterations *= elapsed < BENCH_MIN_RUN_NS / 16 ? 16 : 2;
+  }
+
+#ifdef BENCH_COUNTS_ALLOCS
+  size_t allocs = bench_allocs;
+#endif
+  uint64_t total = 0;
+  for (int i = 0; i < reps; i++) {
+    int64_t start = monotonic_ns();
+    uint64_t ops = c->run(c->arg, iterations, &sink);
+    int64_t elapsed = monotonic_ns() - start;
+    ns[i] = (double)elapsed / (double)ops;
+    total += ops;
+  }
+#ifdef BENCH_COUNTS_ALLOCS
+  r.allocs_per_op = (double)(bench_allocs - allocs) / (double)total;
+#else
+  (void)total;
+  r.allocs_per_op = -1.0;
+#endif
+
+  qsort(ns, (size_t)reps, sizeof(ns[0]), compare_double);
+  r.ns_median = ns[reps / 2];
+  r.ns_min = ns[0];
+  r.ns_max = ns[reps - 1];
+  bench_sink += sink;
+  return r;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,281 @@
+#include "bench.h"
+#include "clock_sync.h"
+#include "frame.h"
+#include "history.h"
+#include "user_directory.h"
+#include <stdio.h>
+#include <string.h>
+
+// deterministic checks for the pieces whose bugs only show up as slowly
+// wrong numbers: the RTO clamp and backoff, the offset filter, directory
+// expiry and the history index's backward-shift delete. nothing here reads
+// the clock, every time is passed in
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static int checks;
+static int failures;
+
+static const int64_t ms = 1000000;
+
+static void check(int ok, const char *what, int line);
+static void check_rto(void);
+static void check_offset(void);
+static void check_echo(void);
+static void record_fetch(void *arg, const uint8_t *ids, size_t count);
+static void check_directory(void);
+static void check_history(void);
+
+int bench_check(void) {
+  check_rto();
+  check_offset();
+  check_echo();
+  check_directory();
+  check_history();
+
+  printf("self-check: %d checks, %d failed\n", checks, failures);
+  return failures;
+}
+
+static void check(int ok, const char *what, int line) {
+  checks++;
+  if (!ok) {
+    failures++;
+    fprintf(stderr, "FAIL bench_check.c:%d: %s\n", line, what);
+  }
+}
+
+static void check_rto(void) {
+  clock_sync cs;
+
+  clock_sync_init(&cs);
+  CHECK(clock_sync_timeout_ms(&cs, 5000) == 5000);
+  CHECK(clock_sync_srtt_ms(&cs, 7) == 7);
+
+  // 10 ms: srtt 10, rttvar 5, 10 + 4 * 5 = 30 ms is under the 1 s floor
+  clock_sync_rtt(&cs, 10 * ms);
+  CHECK(clock_sync_srtt_ms(&cs, 0) == 10);
+  CHECK(clock_sync_timeout_ms(&cs, 0) == CLOCK_SYNC_RTO_MIN_MS);
+
+  // a negative round trip is a clock bug, not a sample
+  clock_sync_rtt(&cs, -1);
+  CHECK(cs.rtt_samples == 1);
+
+  // 2 s on a fresh estimate: srtt 2000, rttvar 1000, rto 6000
+  clock_sync_init(&cs);
+  clock_sync_rtt(&cs, 2000 * ms);
+  CHECK(clock_sync_timeout_ms(&cs, 0) == 6000);
+
+  // second sample 1 s: rttvar 1000 + (1000 - 1000) / 4, srtt 2000 - 125
+  clock_sync_rtt(&cs, 1000 * ms);
+  CHECK(clock_sync_srtt_ms(&cs, 0) == 1875);
+  CHECK(clock_sync_timeout_ms(&cs, 0) == 1875 + 4000);
+
+  // backoff doubles and stops at the ceiling
+  clock_sync_backoff(&cs);
+  CHECK(clock_sync_timeout_ms(&cs, 0) == 2 * 5875);
+  for (int i = 0; i < 8; i++) {
+    clock_sync_backoff(&cs);
+  }
+  CHECK(clock_sync_timeout_ms(&cs, 0) == CLOCK_SYNC_RTO_MAX_MS);
+
+  // the next good sample recomputes it from srtt and rttvar
+  clock_sync_rtt(&cs, 1875 * ms);
+  CHECK(clock_sync_timeout_ms(&cs, 0) < CLOCK_SYNC_RTO_MAX_MS);
+}
+
+static void check_offset(void) {
+  clock_sync cs;
+
+  clock_sync_init(&cs);
+  int64_t t0 = cs.base_ns;
+
+  // 10 ms round trip, the node stamped 105 ms in: 100 ms ahead of us
+  clock_sync_server_time(&cs, t0, t0 + (10 * ms), cs.base_ms + 105);
+  CHECK(cs.offset_ns == 100 * ms);
+
+  // a slow answer disagrees, the faster sample still wins
+  clock_sync_server_time(&cs, t0, t0 + (200 * ms), cs.base_ms + 600);
+  CHECK(cs.offset_ns == 100 * ms);
+
+  // a faster one takes over
+  clock_sync_server_time(&cs, t0, t0 + (2 * ms), cs.base_ms + 51);
+  CHECK(cs.offset_ns == 50 * ms);
+
+  // no server stamp, or a reply before the request: not a sample
+  size_t count = cs.filter_count;
+  clock_sync_server_time(&cs, t0, t0 + ms, 0);
+  clock_sync_server_time(&cs, t0, t0 - ms, cs.base_ms + 1);
+  CHECK(cs.filter_count == count);
+
+  // the fast sample ages out after CLOCK_SYNC_FILTER slower ones
+  for (int i = 0; i < CLOCK_SYNC_FILTER; i++) {
+    clock_sync_server_time(&cs, t0, t0 + (20 * ms), cs.base_ms + 30);
+  }
+  CHECK(cs.offset_ns == 20 * ms);
+  CHECK(cs.filter_count == CLOCK_SYNC_FILTER);
+}
+
+static void check_echo(void) {
+  clock_sync cs;
+  frame_decoder dec;
+  big_send_message_t echo;
+
+  clock_sync_init(&cs);
+  frame_decoder_init(&dec, (uint8_t *)&echo, sizeof(echo));
+  memset(&echo, 0, sizeof(echo));
+  dec.hdr.type = TYPE_SEND_MESSAGE_RESPONSE;
+  dec.hdr.status = STATUS_OK;
+  dec.body_have = sizeof(echo);
+
+  // an echo of our own stamp carries our clock, not the node's
+  uint64_t stamp = clock_sync_stamp(&cs);
+  echo.timestamp = frame_hton64(stamp);
+  CHECK(clock_sync_stamp_of(&cs, &dec) == 0);
+
+  echo.timestamp = frame_hton64(stamp + 7000);
+  CHECK(clock_sync_stamp_of(&cs, &dec) == stamp + 7000);
+
+  dec.hdr.status = STATUS_FORBIDDEN;
+  CHECK(clock_sync_stamp_of(&cs, &dec) == 0);
+  dec.hdr.status = STATUS_OK;
+  dec.hdr.type = TYPE_GET_MESSAGE_RESPONSE;
+  CHECK(clock_sync_stamp_of(&cs, &dec) == 0);
+  dec.hdr.type = TYPE_SEND_MESSAGE_RESPONSE;
+  dec.body_have = sizeof(echo) - 1;
+  CHECK(clock_sync_stamp_of(&cs, &dec) == 0);
+}
+
+typedef struct
+{
+    int calls;
+    size_t count;
+    uint8_t ids[USER_DIRECTORY_BATCH];
+} fetch_log;
+
+static void record_fetch(void *arg, const uint8_t *ids, size_t count) {
+  fetch_log *log = arg;
+
+  log->calls++;
+  log->count = count;
+  memcpy(log->ids, ids, count);
+}
+
+static void check_directory(void) {
+  user_directory d;
+  fetch_log log = {0};
+  const int64_t ttl = 1000;
+  int64_t now = 0;
+
+  user_directory_init(&d, ttl, record_fetch, &log);
+  user_directory_learn(&d, 1, "me", sizeof("me"), 1, now);
+  CHECK(strcmp(user_directory_lookup(&d, 1, now), "me") == 0);
+
+  // a burst from one unknown sender is one id in one fetch
+  CHECK(user_directory_lookup(&d, 7, now) == NULL);
+  CHECK(user_directory_lookup(&d, 7, now) == NULL);
+  CHECK(user_directory_lookup(&d, 9, now) == NULL);
+  user_directory_flush(&d);
+  CHECK(log.calls == 1 && log.count == 2);
+  CHECK(log.ids[0] == 7 && log.ids[1] == 9);
+
+  // in flight: not asked again, and nothing to flush
+  user_directory_lookup(&d, 7, now + 1);
+  user_directory_flush(&d);
+  CHECK(log.calls == 1);
+
+  // the answer lists 7 only, 9 was asked about and is absent
+  const uint8_t listed[] = {7};
+  user_directory_members(&d, listed, 1, now);
+  CHECK(user_directory_state(&d, 7) == USER_MEMBER);
+  CHECK(user_directory_state(&d, 9) == USER_ABSENT);
+  CHECK(user_directory_state(&d, 42) == USER_EMPTY);
+
+  // trusted until the TTL runs out, then asked again
+  user_directory_lookup(&d, 7, now + ttl - 1);
+  user_directory_flush(&d);
+  CHECK(log.calls == 1);
+  user_directory_lookup(&d, 7, now + ttl);
+  user_directory_flush(&d);
+  CHECK(log.calls == 2 && log.count == 1 && log.ids[0] == 7);
+
+  // an unanswered fetch is retried once its deadline passes
+  now += ttl;
+  user_directory_lookup(&d, 7, now + USER_DIRECTORY_RETRY_MS - 1);
+  user_directory_flush(&d);
+  CHECK(log.calls == 2);
+  user_directory_lookup(&d, 7, now + USER_DIRECTORY_RETRY_MS);
+  user_directory_flush(&d);
+  CHECK(log.calls == 3);
+
+  // a version bump makes everything stale except our own pinned name
+  user_directory_members(&d, listed, 1, now);
+  user_directory_invalidate(&d);
+  CHECK(user_directory_state(&d, 7) == USER_EMPTY);
+  CHECK(user_directory_state(&d, 1) == USER_KNOWN);
+  CHECK(strcmp(user_directory_lookup(&d, 1, now + (100 * ttl)), "me") == 0);
+  user_directory_lookup(&d, 7, now);
+  user_directory_flush(&d);
+  CHECK(log.calls == 4);
+}
+
+static void check_history(void) {
+  history_store h;
+  const size_t cap = 8;
+  uint64_t keys[64];
+  uint64_t seed = 1;
+
+  if (history_init(&h, cap) == -1) {
+    CHECK(!"history_init");
+    return;
+  }
+
+  CHECK(history_insert(&h, 0, 1, 100, "a", 1) == 1);
+  CHECK(history_insert(&h, 0, 1, 100, "a", 1) == 0);
+  CHECK(history_insert(&h, 0, 2, 100, "b", 1) == 1);
+  CHECK(history_lookup(&h, 0, 1, 100) != NULL);
+  CHECK(history_lookup(&h, 1, 1, 100) == NULL);
+  history_destroy(&h);
+
+  // a small index wraps and collides often: every eviction goes through
+  // the backward shift, and a broken shift loses a live key or keeps a
+  // dead one
+  if (history_init(&h, cap) == -1) {
+    CHECK(!"history_init");
+    return;
+  }
+  size_t n = sizeof(keys) / sizeof(keys[0]);
+  for (size_t i = 0; i < n; i++) {
+    seed = (seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+    keys[i] = seed >> 40U;
+
+    int stored = history_insert(&h, (uint8_t)(keys[i] & 3U), 0, keys[i], "x",
+                                1);
+    if (!stored) {
+      // a repeat of a key still held, keep the table honest about it
+      keys[i] = UINT64_MAX;
+      continue;
+    }
+
+    int lost = 0;
+    int kept = 0;
+    uint64_t first = history_first_seq(&h);
+    for (size_t j = 0; j <= i; j++) {
+      if (keys[j] == UINT64_MAX) {
+        continue;
+      }
+      const history_entry *e =
+          history_lookup(&h, (uint8_t)(keys[j] & 3U), 0, keys[j]);
+      int live = 0;
+      for (uint64_t seq = first; seq < h.next_seq; seq++) {
+        const history_entry *at = history_at(&h, seq);
+        live |= at->timestamp == keys[j];
+      }
+      lost += live && e == NULL;
+      kept += !live && e != NULL;
+    }
+    CHECK(lost == 0 && kept == 0);
+  }
+  CHECK(h.next_seq - history_first_seq(&h) == cap);
+  history_destroy(&h);
+}
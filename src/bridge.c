@@ -0,0 +1,231 @@
+#include "bridge.h"
+#include "network_funcs.h"
+#include "session.h"
+#include "utils.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum
+{
+    BRIDGE_LINE_LENGTH = 1024
+};
+
+// stdin is read as it arrives and split here, a half typed line must not
+// hold up the sessions
+typedef struct
+{
+    char buf[BRIDGE_LINE_LENGTH];
+    size_t len;
+    int overlong; // dropping the rest of a line that did not fit
+} bridge_input;
+
+static volatile sig_atomic_t bridge_stop = 0;
+
+static void on_stop_signal(int sig);
+static size_t load_accounts(session_loop *loop, FILE *fp,
+                            const struct sockaddr_in *manager);
+static size_t count_accounts(FILE *fp);
+static void on_message(void *arg, const session *s, uint8_t channel_id,
+                       uint8_t sender_id, uint64_t timestamp,
+                       const char *text, size_t length);
+static void handle_stdin_line(session_loop *loop, char *line);
+static int read_stdin(session_loop *loop, bridge_input *in);
+
+void bridge_run(client_context *ctx) {
+  session_loop loop;
+  bridge_input in = {0};
+  struct sigaction sa;
+
+  FILE *fp = fopen(ctx->accounts_path, "r");
+  if (fp == NULL) {
+    perror(ctx->accounts_path);
+    ctx->exit_code = EXIT_FAILURE;
+    return;
+  }
+
+  if (convert_address(ctx) != 0) {
+    fclose(fp);
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Invalid Manager IP format.\n";
+    return;
+  }
+  struct sockaddr_in manager;
+  memcpy(&manager, &ctx->addr, sizeof(manager));
+  manager.sin_port = htons(ctx->manager_port);
+
+  size_t capacity = count_accounts(fp);
+  if (capacity == 0 || capacity > BRIDGE_MAX_ACCOUNTS ||
+      session_loop_init(&loop, capacity, on_message, NULL) == -1) {
+    fprintf(stderr, "Error: %s must list 1-%d accounts.\n",
+            ctx->accounts_path, BRIDGE_MAX_ACCOUNTS);
+    fclose(fp);
+    ctx->exit_code = EXIT_FAILURE;
+    return;
+  }
+
+  size_t loaded = load_accounts(&loop, fp, &manager);
+  fclose(fp);
+  fprintf(stderr, "Bridging %zu accounts via %s:%u\n", loaded,
+          ctx->manager_ip, ctx->manager_port);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int stdin_open = 1;
+  int shutting_down = 0;
+  while (1) {
+    int ready = 0;
+
+    if (bridge_stop && !shutting_down) {
+      fprintf(stderr, "Logging out %zu accounts...\n", loop.count);
+      session_loop_shutdown(&loop);
+      shutting_down = 1;
+    }
+
+    size_t alive =
+        session_loop_run_once(&loop, stdin_open ? STDIN_FILENO : -1, &ready);
+    if (shutting_down && alive == 0) {
+      break;
+    }
+
+    if (ready && !shutting_down && read_stdin(&loop, &in) == -1) {
+      stdin_open = 0;
+    }
+  }
+
+  session_loop_destroy(&loop);
+}
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  bridge_stop = 1;
+}
+
+static size_t count_accounts(FILE *fp) {
+  char line[BRIDGE_LINE_LENGTH];
+  size_t n = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (line[0] != '#' && line[0] != '\n') {
+      n++;
+    }
+  }
+  rewind(fp);
+  return n;
+}
+
+static size_t load_accounts(session_loop *loop, FILE *fp,
+                            const struct sockaddr_in *manager) {
+  char line[BRIDGE_LINE_LENGTH];
+  size_t n = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *save = NULL;
+    char *user = strtok_r(line, " \t\r\n", &save);
+    char *pass = strtok_r(NULL, " \t\r\n", &save);
+
+    if (user == NULL || user[0] == '#') {
+      continue;
+    }
+    if (pass == NULL) {
+      fprintf(stderr, "Skipping account '%s': no password.\n", user);
+      continue;
+    }
+    if (session_loop_add(loop, user, pass, manager) != NULL) {
+      n++;
+    }
+  }
+  return n;
+}
+
+static void on_message(void *arg, const session *s, uint8_t channel_id,
+                       uint8_t sender_id, uint64_t timestamp,
+                       const char *text, size_t length) {
+  (void)arg;
+  printf("%.*s\t%u\t%u\t%llu\t%.*s\n", (int)sizeof(s->auth.username),
+         s->auth.username, channel_id, sender_id,
+         (unsigned long long)timestamp, (int)length, text);
+  fflush(stdout);
+}
+
+// "account text..."
+static void handle_stdin_line(session_loop *loop, char *line) {
+  char *space = strchr(line, ' ');
+
+  if (line[0] == '\0') {
+    return;
+  }
+  if (space == NULL) {
+    fprintf(stderr, "Usage: <account> <message>\n");
+    return;
+  }
+  *space = '\0';
+
+  session *s = session_loop_find(loop, line);
+  if (s == NULL) {
+    fprintf(stderr, "Unknown account '%s'.\n", line);
+    return;
+  }
+  if (session_send_message(loop, s, space + 1, strlen(space + 1)) == -1) {
+    fprintf(stderr, "Account '%s' is not ready to send.\n", line);
+  }
+}
+
+// one read per wakeup, poll said it will not block. -1 once stdin is done
+static int read_stdin(session_loop *loop, bridge_input *in) {
+  // keep one byte for the terminator
+  ssize_t n =
+      read(STDIN_FILENO, in->buf + in->len, sizeof(in->buf) - 1 - in->len);
+
+  if (n == -1) {
+    if (errno == EINTR || errno == EAGAIN) {
+      return 0;
+    }
+    perror("stdin");
+    return -1;
+  }
+  if (n == 0) {
+    // a last line without a newline still counts
+    if (in->len > 0 && !in->overlong) {
+      in->buf[in->len] = '\0';
+      handle_stdin_line(loop, in->buf);
+    }
+    in->len = 0;
+    return -1;
+  }
+  in->len += (size_t)n;
+
+  char *start = in->buf;
+  char *nl;
+  while ((nl = memchr(start, '\n', in->len - (size_t)(start - in->buf))) !=
+         NULL) {
+    *nl = '\0';
+    if (nl > start && nl[-1] == '\r') {
+      nl[-1] = '\0';
+    }
+    if (!in->overlong) {
+      handle_stdin_line(loop, start);
+    }
+    in->overlong = 0;
+    start = nl + 1;
+  }
+  in->len -= (size_t)(start - in->buf);
+  memmove(in->buf, start, in->len);
+
+  if (in->len == sizeof(in->buf) - 1 || (in->len > 0 && in->overlong)) {
+    if (!in->overlong) {
+      fprintf(stderr, "Line longer than %d bytes dropped.\n",
+              BRIDGE_LINE_LENGTH - 1);
+    }
+    in->overlong = 1;
+    in->len = 0;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+// header in front of every slab so the chain can be walked on destroy
+typedef struct slab
+{
+    struct slab *next;
+    max_align_t align;
+} slab;
+
+static int pool_grow(buffer_pool *pool);
+
+void buffer_pool_init(buffer_pool *pool, size_t block_size) {
+  memset(pool, 0, sizeof(*pool));
+
+  // every block has to be able to hold the free-list link
+  if (block_size < sizeof(void *)) {
+    block_size = sizeof(void *);
+  }
+  // keep blocks aligned for whatever the caller casts them to
+  size_t align = sizeof(max_align_t);
+  pool->block_size = (block_size + align - 1) / align * align;
+}
+
+void buffer_pool_destroy(buffer_pool *pool) {
+  slab *s = pool->slabs;
+
+  while (s != NULL) {
+    slab *next = s->next;
+    free(s);
+    s = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+  pool->in_use = 0;
+  pool->total = 0;
+}
+
+void *buffer_pool_get(buffer_pool *pool) {
+  if (pool->free_list == NULL && pool_grow(pool) == -1) {
+    return NULL;
+  }
+
+  void *block = pool->free_list;
+  memcpy(&pool->free_list, block, sizeof(void *));
+  pool->in_use++;
+  return block;
+}
+
+void buffer_pool_put(buffer_pool *pool, void *block) {
+  if (block == NULL) {
+    return;
+  }
+  memcpy(block, &pool->free_list, sizeof(void *));
+  pool->free_list = block;
+  pool->in_use--;
+}
+
+static int pool_grow(buffer_pool *pool) {
+  slab *s = malloc(offsetof(slab, align) +
+                   (pool->block_size * BUFFER_POOL_SLAB_BLOCKS));
+
+  if (s == NULL) {
+    return -1;
+  }
+  s->next = pool->slabs;
+  pool->slabs = s;
+
+  unsigned char *base = (unsigned char *)&s->align;
+  for (size_t i = 0; i < BUFFER_POOL_SLAB_BLOCKS; i++) {
+    void *block = base + (i * pool->block_size);
+    memcpy(block, &pool->free_list, sizeof(void *));
+    pool->free_list = block;
+  }
+  pool->total += BUFFER_POOL_SLAB_BLOCKS;
+  return 0;
+}
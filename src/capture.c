@@ -0,0 +1,240 @@
+#include "capture.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// producers append into `fill` under the lock, the writer swaps it with its
+// own buffer and does the disk write outside the lock. a producer only waits
+// when the writer is a whole buffer behind
+typedef struct
+{
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // fill has data, or stopping
+    pthread_cond_t drained; // fill was handed to the writer
+    uint8_t *fill;
+    uint8_t *spare;
+    size_t fill_len;
+    int stopping;
+    int64_t start_ns;
+} capture_writer;
+
+atomic_int capture_active;
+
+// the lock and conditions are never torn down, see capture_stop
+static capture_writer writer = {.fd = -1,
+                                .lock = PTHREAD_MUTEX_INITIALIZER,
+                                .ready = PTHREAD_COND_INITIALIZER,
+                                .drained = PTHREAD_COND_INITIALIZER};
+static int exit_hooked;
+
+static void append(capture_direction direction, uint32_t conn,
+                   const big_header_t *hdr, const void *body, size_t length);
+static void *writer_main(void *arg);
+
+int capture_start(const char *path) {
+  capture_file_header fh = {0};
+
+  if (atomic_load(&capture_active)) {
+    return 0;
+  }
+
+  // the trace holds login bodies, keep it private
+  writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (writer.fd == -1) {
+    fprintf(stderr, "capture: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fh.magic = CAPTURE_MAGIC;
+  fh.version = CAPTURE_VERSION;
+  fh.start_wall_ms = wall_clock_ms();
+  if (frame_write_all(writer.fd, &fh, sizeof(fh)) == -1) {
+    fprintf(stderr, "capture: write failed: %s\n", strerror(errno));
+    close(writer.fd);
+    writer.fd = -1;
+    return -1;
+  }
+
+  // a second capture after capture_stop reuses the buffers
+  if (writer.fill == NULL) {
+    writer.fill = malloc(CAPTURE_BUFFER_SIZE);
+  }
+  if (writer.spare == NULL) {
+    writer.spare = malloc(CAPTURE_BUFFER_SIZE);
+  }
+  if (writer.fill == NULL || writer.spare == NULL) {
+    fputs("capture: out of memory\n", stderr);
+    close(writer.fd);
+    writer.fd = -1;
+    return -1;
+  }
+  writer.fill_len = 0;
+  writer.stopping = 0;
+  writer.start_ns = monotonic_ns();
+
+  if (spawn_thread(&writer.thread, writer_main, NULL) != 0) {
+    fputs("capture: cannot start writer thread\n", stderr);
+    close(writer.fd);
+    writer.fd = -1;
+    return -1;
+  }
+
+  // every exit path goes through exit(), so that is where the tail is flushed
+  if (!exit_hooked) {
+    atexit(capture_stop);
+    exit_hooked = 1;
+  }
+
+  atomic_store(&capture_active, 1);
+  return 0;
+}
+
+void capture_stop(void) {
+  if (!atomic_exchange(&capture_active, 0)) {
+    return;
+  }
+
+  // this runs from atexit while other threads may still be inside
+  // capture_frame. once stopping is set under the lock every later append
+  // bails out, but one may be about to take the lock, so the lock and the
+  // buffers stay alive for good
+  pthread_mutex_lock(&writer.lock);
+  writer.stopping = 1;
+  pthread_cond_signal(&writer.ready);
+  pthread_cond_broadcast(&writer.drained);
+  pthread_mutex_unlock(&writer.lock);
+  pthread_join(writer.thread, NULL);
+
+  close(writer.fd);
+  writer.fd = -1;
+}
+
+void capture_frame(capture_direction direction, int fd,
+                   const big_header_t *hdr, const void *body, size_t length) {
+  if (!atomic_load_explicit(&capture_active, memory_order_relaxed)) {
+    return;
+  }
+  append(direction, conn_id_of(fd), hdr, body, length);
+}
+
+void capture_decoded(int fd, const frame_decoder *dec) {
+  big_header_t wire = dec->hdr;
+
+  if (!atomic_load_explicit(&capture_active, memory_order_relaxed)) {
+    return;
+  }
+
+  // the decoder keeps body in host order, put it back the way it arrived
+  wire.body = htonl(dec->hdr.body);
+  capture_frame(CAPTURE_RECEIVED, fd, &wire, dec->body, dec->body_have);
+}
+
+void capture_connect(int fd) {
+  const big_header_t none = {0};
+  capture_peer peer = {0};
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  if (!atomic_load_explicit(&capture_active, memory_order_relaxed)) {
+    return;
+  }
+
+  // replay needs to tell the manager's connections from the node's
+  if (getpeername(fd, (struct sockaddr *)&addr, &len) == 0 &&
+      addr.sin_family == AF_INET) {
+    memcpy(&peer.ip, &addr.sin_addr.s_addr, sizeof(peer.ip));
+    peer.port = addr.sin_port;
+  }
+  append(CAPTURE_CONNECT, conn_id_of(fd), &none, &peer, sizeof(peer));
+}
+
+void capture_close(int fd) {
+  const big_header_t none = {0};
+
+  if (!atomic_load_explicit(&capture_active, memory_order_relaxed)) {
+    return;
+  }
+  append(CAPTURE_CLOSE, conn_id_of(fd), &none, NULL, 0);
+}
+
+static void append(capture_direction direction, uint32_t conn,
+                   const big_header_t *hdr, const void *body, size_t length) {
+  capture_record rec;
+  const size_t room = CAPTURE_BUFFER_SIZE - sizeof(rec) - sizeof(*hdr);
+
+  if (length > room) {
+    length = room;
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.t_ns = (uint64_t)(monotonic_ns() - writer.start_ns);
+  rec.direction = (uint8_t)direction;
+  rec.conn = conn;
+  rec.length = (uint32_t)length;
+
+  size_t need = sizeof(rec) + sizeof(*hdr) + length;
+
+  pthread_mutex_lock(&writer.lock);
+  while (!writer.stopping && writer.fill_len + need > CAPTURE_BUFFER_SIZE) {
+    pthread_cond_wait(&writer.drained, &writer.lock);
+  }
+  if (writer.stopping) {
+    pthread_mutex_unlock(&writer.lock);
+    return;
+  }
+
+  uint8_t *p = writer.fill + writer.fill_len;
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), hdr, sizeof(*hdr));
+  if (length > 0) {
+    memcpy(p + sizeof(rec) + sizeof(*hdr), body, length);
+  }
+
+  // only the first record of a batch needs to wake the writer
+  if (writer.fill_len == 0) {
+    pthread_cond_signal(&writer.ready);
+  }
+  writer.fill_len += need;
+  pthread_mutex_unlock(&writer.lock);
+}
+
+static void *writer_main(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&writer.lock);
+  for (;;) {
+    while (!writer.stopping && writer.fill_len == 0) {
+      pthread_cond_wait(&writer.ready, &writer.lock);
+    }
+    if (writer.fill_len == 0) {
+      // stopping and nothing left
+      break;
+    }
+
+    uint8_t *batch = writer.fill;
+    size_t len = writer.fill_len;
+
+    writer.fill = writer.spare;
+    writer.spare = batch;
+    writer.fill_len = 0;
+    pthread_cond_broadcast(&writer.drained);
+    pthread_mutex_unlock(&writer.lock);
+
+    if (frame_write_all(writer.fd, batch, len) == -1) {
+      fprintf(stderr, "capture: write failed: %s\n", strerror(errno));
+    }
+
+    pthread_mutex_lock(&writer.lock);
+  }
+  pthread_mutex_unlock(&writer.lock);
+  return NULL;
+}
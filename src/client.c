@@ -1,9 +1,18 @@
+#include "bridge.h"
+#include "capture.h"
 #include "client.h"
+#include "client_daemon.h"
+#include "messaging.h"
+#include "metrics.h"
 #include "network_funcs.h"
+#include "replay.h"
+#include "script.h"
+#include "trace.h"
 #include "utils.h"
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +24,8 @@ static void handle_arguments(client_context *ctx);
 static int run_discovery_phase(client_context *ctx);
 static int run_account_creation_phase(client_context *ctx);
 static int run_login_phase(client_context *ctx);
+static int run_messaging_phase(client_context *ctx);
+static int run_daemon_phase(client_context *ctx);
 static int run_logout_phase(client_context *ctx);
 
 int main(int argc, char **argv) {
@@ -24,9 +35,56 @@ int main(int argc, char **argv) {
   ctx.argc = argc;
   ctx.argv = argv;
 
+  // a dropped connection should surface as EPIPE, not kill the process
+  signal(SIGPIPE, SIG_IGN);
+
+  // unbuffered stdin so poll() on the fd never misses a line stdio has
+  // already slurped into its buffer
+  setvbuf(stdin, NULL, _IONBF, 0);
+
   parse_arguments(&ctx);
   handle_arguments(&ctx);
 
+  if (ctx.capture_path != NULL && capture_start(ctx.capture_path) == -1) {
+    ctx.exit_code = EXIT_FAILURE;
+    quit(&ctx);
+  }
+  if (ctx.trace_path != NULL && trace_start(ctx.trace_path) == -1) {
+    ctx.exit_code = EXIT_FAILURE;
+    quit(&ctx);
+  }
+  if (ctx.metrics_spec != NULL && metrics_start(ctx.metrics_spec) == -1) {
+    ctx.exit_code = EXIT_FAILURE;
+    quit(&ctx);
+  }
+
+  // drive a recorded session against the node instead of a live one
+  if (ctx.mode == MODE_REPLAY) {
+    replay_run(&ctx);
+    quit(&ctx);
+  }
+
+  // front-ends piggyback on a running daemon's session
+  if (ctx.mode == MODE_ATTACH) {
+    client_daemon_attach(&ctx);
+    quit(&ctx);
+  }
+
+  // commands from a file or pipe instead of prompts
+  if (ctx.mode == MODE_SCRIPT) {
+    script_run(&ctx);
+    quit(&ctx);
+  }
+
+  // every account runs its own phases inside the bridge's event loop
+  if (ctx.mode == MODE_BRIDGE) {
+    bridge_run(&ctx);
+    quit(&ctx);
+  }
+
+  // from here on this process is one connection in the sessions gauge
+  metrics_set_state(-1, (int)ctx.state);
+
   // find the fucking server
   run_discovery_phase(&ctx);
 
@@ -39,7 +97,11 @@ int main(int argc, char **argv) {
   // TO-DO
   //  run_channel_phase(&ctx);
 
-  // run_messaging_phase(&ctx);
+  if (ctx.mode == MODE_DAEMON) {
+    run_daemon_phase(&ctx);
+  } else {
+    run_messaging_phase(&ctx);
+  }
 
   run_logout_phase(&ctx);
 
@@ -56,6 +118,8 @@ static client_context init_context(void) {
   ctx.state = STATE_DISCONNECTED;
   ctx.active_sock_fd = -1;
   ctx.manager_port = 0;
+  ctx.mode = MODE_INTERACTIVE;
+  ctx.replay_speed = 1.0;
 
   return ctx;
 }
@@ -63,7 +127,7 @@ static client_context init_context(void) {
 // parse them boys
 static void parse_arguments(client_context *ctx) {
   int opt;
-  const char *optstring = ":m:p:h";
+  const char *optstring = ":m:p:d:a:b:w:t:M:r:x:s:W:h";
   opterr = 0;
 
   while ((opt = getopt(ctx->argc, ctx->argv, optstring)) != -1) {
@@ -91,6 +155,97 @@ static void parse_arguments(client_context *ctx) {
         ctx->manager_port = (uint16_t)port;
       }
       break;
+    // hold the session for local front-ends
+    case 'd':
+    // be one of those front-ends
+    case 'a':
+      if (optarg) {
+        // the name ends up in /tmp and /dev/shm paths
+        if (optarg[0] == '\0' || strchr(optarg, '/') != NULL ||
+            strstr(optarg, "..") != NULL) {
+          fprintf(stderr, "Error: Invalid daemon name '%s'.\n", optarg);
+          ctx->exit_code = EXIT_FAILURE;
+          print_usage(ctx);
+          quit(ctx);
+        }
+        ctx->mode = opt == 'd' ? MODE_DAEMON : MODE_ATTACH;
+        snprintf(ctx->daemon_name, sizeof(ctx->daemon_name), "%s", optarg);
+      }
+      break;
+    // many accounts, one process
+    case 'b':
+      if (optarg) {
+        ctx->mode = MODE_BRIDGE;
+        ctx->accounts_path = optarg;
+      }
+      break;
+    // record every frame to a trace
+    case 'w':
+      if (optarg) {
+        ctx->capture_path = optarg;
+      }
+      break;
+    // record state changes, frames and queue depths for trace2json
+    case 't':
+      if (optarg) {
+        ctx->trace_path = optarg;
+      }
+      break;
+    // publish counters for prometheus or a textfile collector
+    case 'M':
+      if (optarg) {
+        ctx->metrics_spec = optarg;
+      }
+      break;
+    // send a trace's frames again
+    case 'r':
+      if (optarg) {
+        ctx->mode = MODE_REPLAY;
+        ctx->replay_path = optarg;
+      }
+      break;
+    case 'x':
+      if (optarg && strcmp(optarg, "max") == 0) {
+        ctx->replay_speed = 0.0;
+      } else if (optarg) {
+        char *endptr;
+        errno = 0;
+        double speed = strtod(optarg, &endptr);
+
+        if (errno != 0 || *endptr != '\0' || !(speed > 0)) {
+          fprintf(stderr, "Error: Invalid speed '%s'. Use a factor or max.\n",
+                  optarg);
+          ctx->exit_code = EXIT_FAILURE;
+          print_usage(ctx);
+          quit(ctx);
+        }
+        ctx->replay_speed = speed;
+      }
+      break;
+    // run commands from a file, or stdin for "-"
+    case 's':
+      if (optarg) {
+        ctx->mode = MODE_SCRIPT;
+        ctx->script_path = optarg;
+      }
+      break;
+    case 'W':
+      if (optarg) {
+        char *endptr;
+        errno = 0;
+        unsigned long window = strtoul(optarg, &endptr, PORT_BASE);
+
+        if (errno != 0 || *endptr != '\0' || window == 0 ||
+            window > SCRIPT_MAX_WINDOW) {
+          fprintf(stderr, "Error: Invalid window '%s'. Range: 1-%d.\n",
+                  optarg, SCRIPT_MAX_WINDOW);
+          ctx->exit_code = EXIT_FAILURE;
+          print_usage(ctx);
+          quit(ctx);
+        }
+        ctx->script_window = window;
+      }
+      break;
     case 'h':
       printf("Usage: %s -m <manager_ip> -p <manager_port>\n", ctx->argv[0]);
       ctx->exit_code = EXIT_SUCCESS;
@@ -114,6 +269,11 @@ static void parse_arguments(client_context *ctx) {
 }
 
 static void handle_arguments(client_context *ctx) {
+  if (ctx->mode == MODE_ATTACH) {
+    // no node connection of our own
+    return;
+  }
+
   if (ctx->manager_ip[0] == '\0') {
     fprintf(stderr, "Error: Manager IP (-m) must be specified.\n");
     ctx->exit_code = EXIT_FAILURE;
@@ -134,12 +294,17 @@ static void handle_arguments(client_context *ctx) {
   //     print_usage(ctx);
   //   }
 
+  // script results own stdout
+  if (ctx->mode == MODE_SCRIPT) {
+    return;
+  }
+
   printf("client is ready for discovery via %s:%u\n", ctx->manager_ip,
          ctx->manager_port);
 }
 
 static int run_discovery_phase(client_context *ctx) {
-  ctx->state = STATE_DISCOVERING;
+  client_set_state(ctx, STATE_DISCOVERING);
 
   network_execute_discovery(ctx);
 
@@ -147,7 +312,7 @@ static int run_discovery_phase(client_context *ctx) {
 }
 
 static int run_account_creation_phase(client_context *ctx) {
-  ctx->state = STATE_CONNECTING_TO_SERVER;
+  client_set_state(ctx, STATE_CONNECTING_TO_SERVER);
 
   printf("\n[Account Creation]\n");
   // disable to prevent double account setup loop
@@ -175,12 +340,12 @@ static int run_account_creation_phase(client_context *ctx) {
   // call network layer to do the handshake
   network_execute_account_creation(ctx);
 
-  ctx->state = STATE_LOGGED_IN;
+  client_set_state(ctx, STATE_LOGGED_IN);
   return 0;
 }
 
 static int run_login_phase(client_context *ctx) {
-  ctx->state = STATE_LOGGED_IN;
+  client_set_state(ctx, STATE_LOGGED_IN);
   network_execute_login(ctx);
   return 0;
 }
@@ -189,12 +354,20 @@ static int run_login_phase(client_context *ctx) {
 
 // }
 
-// static int run_messaging_phase(client_context *ctx) {
+static int run_messaging_phase(client_context *ctx) {
+  client_set_state(ctx, STATE_MESSAGING);
+  network_execute_messaging_loop(ctx);
+  return 0;
+}
 
-// }
+static int run_daemon_phase(client_context *ctx) {
+  client_set_state(ctx, STATE_MESSAGING);
+  client_daemon_run(ctx);
+  return 0;
+}
 
 static int run_logout_phase(client_context *ctx) {
-  ctx->state = STATE_EXITING;
+  client_set_state(ctx, STATE_EXITING);
   network_execute_logout(ctx);
   return 0;
 }
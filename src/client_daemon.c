@@ -0,0 +1,426 @@
+#ifdef __linux__
+#define _GNU_SOURCE // accept4
+#endif
+#include "client_daemon.h"
+#include "frame.h"
+#include "net_thread.h"
+#include "network_funcs.h"
+#include "shm_ring.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum
+{
+    CONTROL_LINE_LENGTH = NET_TEXT_LENGTH + 16,
+    ATTACH_POLL_MS = 20
+};
+
+// one connected front-end on the control socket
+typedef struct
+{
+    int fd;
+    size_t len;
+    char buf[CONTROL_LINE_LENGTH];
+} control_client;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void on_stop_signal(int sig);
+static int control_listen(const char *path);
+static void control_accept(int listen_fd, control_client *clients);
+static int control_read(net_thread *nt, client_context *ctx,
+                        control_client *c);
+static void control_line(net_thread *nt, client_context *ctx,
+                         control_client *c, const char *line);
+static void control_reply(const control_client *c, const char *msg);
+static int publish_events(net_thread *nt, shm_ring *ring);
+static void print_ring(shm_ring *ring);
+
+void client_daemon_socket_path(char *dest, size_t size, const char *name) {
+  snprintf(dest, size, "/tmp/bigchat-%s.sock", name);
+}
+
+void client_daemon_run(client_context *ctx) {
+  char path[DAEMON_SOCKET_PATH_LENGTH];
+  control_client clients[DAEMON_MAX_CLIENTS];
+  shm_ring ring;
+  net_thread nt;
+  struct sigaction sa;
+
+  printf("\n--- Phase 4: Daemon '%s' ---\n", ctx->daemon_name);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  // no SA_RESTART: poll has to come back with EINTR
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (convert_address(ctx) != 0) {
+    fprintf(stderr, "Invalid Server IP format.\n");
+    return;
+  }
+
+  if (shm_ring_create(&ring, ctx->daemon_name) == -1) {
+    fprintf(stderr, "Fatal: Could not create message ring.\n");
+    return;
+  }
+
+  client_daemon_socket_path(path, sizeof(path), ctx->daemon_name);
+  int listen_fd = control_listen(path);
+  if (listen_fd == -1) {
+    shm_ring_close(&ring);
+    return;
+  }
+
+  if (net_thread_start(&nt, ctx) == -1) {
+    fprintf(stderr, "Fatal: Could not start network thread.\n");
+    close(listen_fd);
+    unlink(path);
+    shm_ring_close(&ring);
+    return;
+  }
+
+  for (size_t i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+    clients[i].len = 0;
+  }
+
+  printf("Publishing to shm %s, commands on %s\n", ring.name, path);
+  fflush(stdout);
+
+  while (!daemon_stop) {
+    struct pollfd pfds[DAEMON_MAX_CLIENTS + 2];
+
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = net_thread_event_fd(&nt);
+    pfds[1].events = POLLIN;
+    for (size_t i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      pfds[i + 2].fd = clients[i].fd;
+      pfds[i + 2].events = POLLIN;
+    }
+
+    if (poll(pfds, DAEMON_MAX_CLIENTS + 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      net_thread_clear_event_fd(&nt);
+      if (publish_events(&nt, &ring) == -1) {
+        break;
+      }
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      control_accept(listen_fd, clients);
+    }
+
+    for (size_t i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      if (clients[i].fd >= 0 &&
+          (pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) &&
+          control_read(&nt, ctx, &clients[i]) == -1) {
+        close(clients[i].fd);
+        clients[i].fd = -1;
+        clients[i].len = 0;
+      }
+    }
+  }
+
+  printf("Daemon '%s' shutting down.\n", ctx->daemon_name);
+
+  net_thread_stop(&nt);
+  for (size_t i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    if (clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+  close(listen_fd);
+  unlink(path);
+  shm_ring_close(&ring);
+}
+
+void client_daemon_attach(client_context *ctx) {
+  char path[DAEMON_SOCKET_PATH_LENGTH];
+  struct sockaddr_un addr;
+  shm_ring ring;
+
+  if (shm_ring_attach(&ring, ctx->daemon_name) == -1) {
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Fatal: Could not attach to daemon ring.\n";
+    return;
+  }
+
+  // the control socket is optional, without it we are a read-only tap
+  client_daemon_socket_path(path, sizeof(path), ctx->daemon_name);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (ctl_fd != -1 &&
+      connect(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(ctl_fd);
+    ctl_fd = -1;
+  }
+
+  fprintf(stderr, "Attached to daemon '%s'%s\n", ctx->daemon_name,
+          ctl_fd == -1 ? " (read-only)" : "");
+
+  int stdin_open = 1;
+  while (1) {
+    struct pollfd pfds[2] = {
+        {.fd = stdin_open ? STDIN_FILENO : -1, .events = POLLIN, .revents = 0},
+        {.fd = ctl_fd, .events = POLLIN, .revents = 0}};
+
+    // the ring has no doorbell, so re-check it on a short tick
+    if (poll(pfds, 2, ATTACH_POLL_MS) == -1 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+
+    print_ring(&ring);
+
+    if (pfds[0].revents & (POLLIN | POLLHUP)) {
+      char line[CONTROL_LINE_LENGTH];
+
+      get_user_input(line, sizeof(line) - 1, NULL);
+      if (feof(stdin)) {
+        stdin_open = 0;
+      }
+      if (line[0] != '\0' && ctl_fd != -1) {
+        size_t len = strlen(line);
+        line[len] = '\n';
+        if (frame_write_all(ctl_fd, line, len + 1) == -1) {
+          fprintf(stderr, "Daemon control socket closed.\n");
+          break;
+        }
+      }
+    }
+
+    if (pfds[1].revents & (POLLIN | POLLHUP)) {
+      char reply[CONTROL_LINE_LENGTH];
+      ssize_t n = read(ctl_fd, reply, sizeof(reply));
+
+      if (n <= 0) {
+        fprintf(stderr, "Daemon went away.\n");
+        break;
+      }
+      fwrite(reply, 1, (size_t)n, stderr);
+    }
+  }
+
+  if (ctl_fd != -1) {
+    close(ctl_fd);
+  }
+  shm_ring_close(&ring);
+}
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  daemon_stop = 1;
+}
+
+static int control_listen(const char *path) {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  // anyone who can connect can send as the account, so owner only from the
+  // start. a leftover socket is replaced, anything else at the path is not
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  mode_t old_mask = umask(077);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+
+  if (rc == -1 || listen(fd, DAEMON_MAX_CLIENTS) == -1) {
+    perror("bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// front-ends are non-blocking: replies must never stall the poll loop
+static void control_accept(int listen_fd, control_client *clients) {
+#ifdef __linux__
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  // NOLINTNEXTLINE(android-cloexec-accept)
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd != -1) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+#endif
+
+  if (fd == -1) {
+    return;
+  }
+
+  for (size_t i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    if (clients[i].fd == -1) {
+      clients[i].fd = fd;
+      clients[i].len = 0;
+      return;
+    }
+  }
+
+  // full house
+  close(fd);
+}
+
+// returns -1 when the front-end hung up
+static int control_read(net_thread *nt, client_context *ctx,
+                        control_client *c) {
+  ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+
+  if (n <= 0) {
+    return (n == -1 && (errno == EINTR || errno == EAGAIN ||
+                        errno == EWOULDBLOCK))
+               ? 0
+               : -1;
+  }
+  c->len += (size_t)n;
+
+  // run every complete line, keep the tail for the next read
+  char *start = c->buf;
+  char *nl;
+  while ((nl = memchr(start, '\n', c->len - (size_t)(start - c->buf))) !=
+         NULL) {
+    *nl = '\0';
+    control_line(nt, ctx, c, start);
+    start = nl + 1;
+  }
+
+  c->len -= (size_t)(start - c->buf);
+  memmove(c->buf, start, c->len);
+
+  if (c->len == sizeof(c->buf)) {
+    control_reply(c, "err line too long\n");
+    c->len = 0;
+  }
+  return 0;
+}
+
+static void control_line(net_thread *nt, client_context *ctx,
+                         control_client *c, const char *line) {
+  net_command cmd = {0};
+
+  if (strncmp(line, "send ", strlen("send ")) == 0) {
+    cmd.type = NET_CMD_SEND_MESSAGE;
+    cmd.channel_id = ctx->channel_id;
+    snprintf(cmd.text, sizeof(cmd.text), "%s", line + strlen("send "));
+    cmd.length = (uint16_t)strlen(cmd.text);
+  } else if (strncmp(line, "join ", strlen("join ")) == 0) {
+    char *endptr;
+    unsigned long id = strtoul(line + strlen("join "), &endptr, PORT_BASE);
+
+    if (*endptr != '\0' || id > UINT8_MAX) {
+      control_reply(c, "err invalid channel id\n");
+      return;
+    }
+    ctx->channel_id = (uint8_t)id;
+    cmd.type = NET_CMD_JOIN;
+    cmd.channel_id = ctx->channel_id;
+  } else if (strcmp(line, "fetch") == 0) {
+    cmd.type = NET_CMD_FETCH;
+  } else {
+    control_reply(c, "err unknown command\n");
+    return;
+  }
+
+  if (net_thread_submit(nt, &cmd) == -1) {
+    control_reply(c, "err queue full\n");
+    return;
+  }
+  control_reply(c, "ok\n");
+}
+
+static void control_reply(const control_client *c, const char *msg) {
+  // a front-end that stops reading replies only loses replies: once its
+  // buffer is full they are dropped rather than waited on. no SIGPIPE if
+  // it has gone, the next read notices
+  ssize_t n = send(c->fd, msg, strlen(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+  (void)n;
+}
+
+// returns -1 once the network thread has gone away
+static int publish_events(net_thread *nt, shm_ring *ring) {
+  net_event evt;
+  int rc = 0;
+
+  while (net_thread_next_event(nt, &evt) == 0) {
+    switch (evt.type) {
+    case NET_EVT_MESSAGE:
+      shm_ring_publish(ring, evt.channel_id, evt.sender_id, evt.timestamp,
+                       evt.text, evt.length);
+      break;
+    case NET_EVT_ERROR:
+      fprintf(stderr, "%.*s\n", (int)evt.length, evt.text);
+      break;
+    case NET_EVT_DISCONNECTED:
+      rc = -1;
+      break;
+    default:
+      break;
+    }
+  }
+  return rc;
+}
+
+static void print_ring(shm_ring *ring) {
+  const shm_ring_slot *slot;
+  uint64_t lost;
+
+  while ((slot = shm_ring_begin(ring, &lost)) != NULL) {
+    char text[SHM_RING_TEXT_LENGTH];
+    uint8_t channel_id = slot->channel_id;
+    uint8_t sender_id = slot->sender_id;
+    uint16_t length = slot->length;
+
+    if (length > sizeof(text)) {
+      length = sizeof(text);
+    }
+    memcpy(text, slot->text, length);
+
+    // only trust what we copied if the writer did not lap us meanwhile
+    if (shm_ring_end(ring, slot) == 0) {
+      printf("[#%u] user %u: %.*s\n", channel_id, sender_id, (int)length,
+             text);
+    } else {
+      lost++;
+    }
+    if (lost > 0) {
+      fprintf(stderr, "(%llu messages lost)\n", (unsigned long long)lost);
+    }
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,117 @@
+#include "clock_sync.h"
+#include "utils.h"
+#include <string.h>
+
+static void set_rto(clock_sync *cs, int64_t rto_ns);
+
+void clock_sync_init(clock_sync *cs) {
+  memset(cs, 0, sizeof(*cs));
+
+  // read back to back, the gap is below the ms the protocol can carry
+  cs->base_ns = monotonic_ns();
+  cs->base_ms = wall_clock_ms();
+  cs->rto_ns = (int64_t)CLOCK_SYNC_RTO_INITIAL_MS * 1000000;
+}
+
+void clock_sync_rtt(clock_sync *cs, int64_t rtt_ns) {
+  if (rtt_ns < 0) {
+    return;
+  }
+
+  // RFC 6298 2.2 and 2.3, alpha 1/8 and beta 1/4
+  if (cs->rtt_samples == 0) {
+    cs->srtt_ns = rtt_ns;
+    cs->rttvar_ns = rtt_ns / 2;
+  } else {
+    int64_t err = cs->srtt_ns - rtt_ns;
+
+    cs->rttvar_ns += ((err < 0 ? -err : err) - cs->rttvar_ns) / 4;
+    cs->srtt_ns += (rtt_ns - cs->srtt_ns) / 8;
+  }
+  cs->rtt_samples++;
+
+  int64_t var = 4 * cs->rttvar_ns;
+  set_rto(cs, cs->srtt_ns +
+                  (var > CLOCK_SYNC_GRANULARITY_NS ? var
+                                                   : CLOCK_SYNC_GRANULARITY_NS));
+}
+
+void clock_sync_server_time(clock_sync *cs, int64_t sent_ns,
+                            int64_t received_ns, uint64_t server_ms) {
+  int64_t rtt_ns = received_ns - sent_ns;
+
+  if (rtt_ns < 0 || server_ms == 0) {
+    return;
+  }
+  clock_sync_rtt(cs, rtt_ns);
+
+  // the server stamped somewhere between send and receive, call it the
+  // middle. local time is base + monotonic, the same scale we stamp with
+  int64_t mid_ns = sent_ns + (rtt_ns / 2) - cs->base_ns;
+  int64_t server_ns = ((int64_t)server_ms - (int64_t)cs->base_ms) * 1000000;
+  clock_sample *sample = &cs->filter[cs->filter_next];
+
+  sample->rtt_ns = rtt_ns;
+  sample->offset_ns = server_ns - mid_ns;
+  cs->filter_next = (cs->filter_next + 1) % CLOCK_SYNC_FILTER;
+  if (cs->filter_count < CLOCK_SYNC_FILTER) {
+    cs->filter_count++;
+  }
+
+  // a slow answer says little about when the server stamped it
+  const clock_sample *best = &cs->filter[0];
+  for (size_t i = 1; i < cs->filter_count; i++) {
+    if (cs->filter[i].rtt_ns < best->rtt_ns) {
+      best = &cs->filter[i];
+    }
+  }
+  cs->offset_ns = best->offset_ns;
+}
+
+uint64_t clock_sync_stamp_of(const clock_sync *cs, const frame_decoder *dec) {
+  big_send_message_t echo;
+
+  if (dec->hdr.type != TYPE_SEND_MESSAGE_RESPONSE ||
+      dec->hdr.status != STATUS_OK || dec->body_have < sizeof(echo)) {
+    return 0;
+  }
+  memcpy(&echo, dec->body, sizeof(echo));
+
+  uint64_t stamp = frame_ntoh64(echo.timestamp);
+  return stamp == cs->last_stamp_ms ? 0 : stamp;
+}
+
+void clock_sync_backoff(clock_sync *cs) { set_rto(cs, cs->rto_ns * 2); }
+
+uint64_t clock_sync_now_ms(const clock_sync *cs) {
+  int64_t since_ns = monotonic_ns() - cs->base_ns + cs->offset_ns;
+
+  return (uint64_t)((int64_t)cs->base_ms + (since_ns / 1000000));
+}
+
+uint64_t clock_sync_stamp(clock_sync *cs) {
+  cs->last_stamp_ms = clock_sync_now_ms(cs);
+  return cs->last_stamp_ms;
+}
+
+int64_t clock_sync_timeout_ms(const clock_sync *cs, int64_t fallback_ms) {
+  if (cs->rtt_samples == 0) {
+    return fallback_ms;
+  }
+  return cs->rto_ns / 1000000;
+}
+
+int64_t clock_sync_srtt_ms(const clock_sync *cs, int64_t fallback_ms) {
+  if (cs->rtt_samples == 0) {
+    return fallback_ms;
+  }
+  return cs->srtt_ns / 1000000;
+}
+
+// RFC 6298 2.4 and 2.5
+static void set_rto(clock_sync *cs, int64_t rto_ns) {
+  const int64_t min_ns = (int64_t)CLOCK_SYNC_RTO_MIN_MS * 1000000;
+  const int64_t max_ns = (int64_t)CLOCK_SYNC_RTO_MAX_MS * 1000000;
+
+  cs->rto_ns = rto_ns < min_ns ? min_ns : rto_ns > max_ns ? max_ns : rto_ns;
+}
@@ -0,0 +1,770 @@
+#include "fault_proxy.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// a local TCP proxy that sits between the client and a manager/node and
+// makes the byte stream as hostile as TCP is allowed to be: frames split at
+// random offsets, several frames in one segment, latency, jitter, a
+// bandwidth cap and connection resets. a script can change any of it while
+// traffic is flowing, e.g.
+//
+//   # ms   knob          value
+//   0      split         3
+//   5000   delay         200
+//   5000   jitter        50
+//   10000  reset
+//   15000  rate          2048
+//   30000  quit
+
+enum
+{
+    PROXY_IOV_MAX = 64,
+    PROXY_PORT_BASE = 10
+};
+
+static volatile sig_atomic_t proxy_stop = 0;
+
+static void on_stop_signal(int sig);
+static void usage(const char *argv0);
+static int parse_u32(const char *text, uint32_t *out);
+static int parse_port(const char *text, uint16_t *out);
+static int load_script(fault_proxy *p, const char *path);
+static int set_fault(proxy_faults *f, const char *name, uint32_t value);
+static void run_script(fault_proxy *p, int64_t now);
+static int open_listener(fault_proxy *p);
+static void accept_pair(fault_proxy *p, int64_t now);
+static int set_nonblocking(int fd);
+static void read_side(fault_proxy *p, proxy_pair *pair, int d, int64_t now);
+static void enqueue(fault_proxy *p, proxy_direction *dir, const uint8_t *buf,
+                    size_t len, int64_t now);
+static int flush_side(fault_proxy *p, proxy_pair *pair, int d, int64_t now);
+static int64_t next_wakeup(const fault_proxy *p, int64_t now);
+static void close_pair(fault_proxy *p, size_t index, int reset);
+static void print_stats(fault_proxy *p, int64_t now);
+static uint32_t next_random(fault_proxy *p, uint32_t bound);
+static int64_t now_ms(void);
+
+int main(int argc, char **argv) {
+  fault_proxy p;
+  struct sigaction sa;
+  const char *script = NULL;
+  uint16_t listen_port = 0;
+  uint16_t target_port = 0;
+  const char *listen_ip = "127.0.0.1";
+  const char *target_ip = "127.0.0.1";
+  int opt;
+
+  memset(&p, 0, sizeof(p));
+  p.listen_fd = -1;
+  p.seed = (uint64_t)time(NULL);
+
+  opterr = 0;
+  while ((opt = getopt(argc, argv, ":l:L:t:p:k:g:c:d:j:b:R:s:S:vh")) != -1) {
+    int bad = 0;
+    switch (opt) {
+    case 'l':
+      bad = parse_port(optarg, &listen_port);
+      break;
+    case 'L':
+      listen_ip = optarg;
+      break;
+    case 't':
+      target_ip = optarg;
+      break;
+    case 'p':
+      bad = parse_port(optarg, &target_port);
+      break;
+    case 'k':
+      bad = parse_u32(optarg, &p.faults.split);
+      break;
+    case 'g':
+      bad = parse_u32(optarg, &p.faults.gap_ms);
+      break;
+    case 'c':
+      bad = parse_u32(optarg, &p.faults.coalesce_ms);
+      break;
+    case 'd':
+      bad = parse_u32(optarg, &p.faults.delay_ms);
+      break;
+    case 'j':
+      bad = parse_u32(optarg, &p.faults.jitter_ms);
+      break;
+    case 'b':
+      bad = parse_u32(optarg, &p.faults.rate);
+      break;
+    case 'R':
+      bad = parse_u32(optarg, &p.faults.reset_chance);
+      break;
+    case 's':
+      script = optarg;
+      break;
+    case 'S': {
+      uint32_t seed;
+      bad = parse_u32(optarg, &seed);
+      p.seed = seed;
+      break;
+    }
+    case 'v':
+      p.stats = 1;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return EXIT_SUCCESS;
+    case ':':
+      fprintf(stderr, "Error: Option '-%c' requires an argument.\n", optopt);
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    default:
+      fprintf(stderr, "Error: Unknown option '-%c'.\n", optopt);
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (bad) {
+      fprintf(stderr, "Error: Invalid value '%s' for -%c.\n", optarg, opt);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (listen_port == 0 || target_port == 0) {
+    fprintf(stderr, "Error: -l and -p must be specified.\n");
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  p.listen_addr.sin_family = AF_INET;
+  p.listen_addr.sin_port = htons(listen_port);
+  p.target.sin_family = AF_INET;
+  p.target.sin_port = htons(target_port);
+  if (inet_pton(AF_INET, listen_ip, &p.listen_addr.sin_addr) != 1 ||
+      inet_pton(AF_INET, target_ip, &p.target.sin_addr) != 1) {
+    fprintf(stderr, "Error: Addresses must be IPv4.\n");
+    return EXIT_FAILURE;
+  }
+  if (p.seed == 0) {
+    p.seed = 1; // xorshift never leaves zero
+  }
+
+  if ((script != NULL && load_script(&p, script) == -1) ||
+      open_listener(&p) == -1) {
+    free(p.steps);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  fprintf(stderr, "fault_proxy: %s:%u -> %s:%u\n", listen_ip, listen_port,
+          target_ip, target_port);
+
+  p.start = now_ms();
+  p.next_stats = p.start + PROXY_STATS_INTERVAL_MS;
+
+  struct pollfd pfds[1 + (2 * PROXY_MAX_PAIRS)];
+  while (!proxy_stop) {
+    int64_t now = now_ms();
+
+    run_script(&p, now);
+    if (p.stats && now >= p.next_stats) {
+      print_stats(&p, now);
+      p.next_stats += PROXY_STATS_INTERVAL_MS;
+    }
+
+    // push out everything that is due, this may close pairs
+    for (size_t i = 0; i < p.pair_count;) {
+      proxy_pair *pair = &p.pairs[i];
+      if (flush_side(&p, pair, 0, now) == -1 ||
+          flush_side(&p, pair, 1, now) == -1 ||
+          (pair->dir[0].eof == 2 && pair->dir[1].eof == 2)) {
+        // failed, or both sides hung up and everything was delivered
+        close_pair(&p, i, 0);
+        continue;
+      }
+      i++;
+    }
+
+    // pfds[1 + 2i + d] is pair i's fd[d]. a side is only read while the
+    // direction it feeds has room, and only polled for writing after a
+    // write to it would have blocked
+    nfds_t n = 1;
+    pfds[0].fd = p.pair_count < PROXY_MAX_PAIRS ? p.listen_fd : -1;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    for (size_t i = 0; i < p.pair_count; i++) {
+      for (int d = 0; d < 2; d++) {
+        const proxy_direction *in = &p.pairs[i].dir[d];
+        const proxy_direction *out = &p.pairs[i].dir[1 - d];
+        pfds[n].fd = p.pairs[i].fd[d];
+        pfds[n].events = 0;
+        pfds[n].revents = 0;
+        if (!in->eof && in->queued < PROXY_MAX_QUEUED) {
+          pfds[n].events |= POLLIN;
+        }
+        if (out->blocked) {
+          pfds[n].events |= POLLOUT;
+        }
+        // POLLHUP cannot be masked: a side that hung up while its data
+        // waits out a delay would wake poll on every pass. leave it out
+        // until the close has been passed on
+        if (in->eof == 1 && pfds[n].events == 0) {
+          pfds[n].fd = -1;
+        }
+        n++;
+      }
+    }
+
+    int64_t wake = next_wakeup(&p, now);
+    int timeout = wake < 0 ? -1 : (int)(wake - now);
+    if (poll(pfds, n, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+
+    now = now_ms();
+    // walk backwards so close_pair's swap-with-last only moves pairs that
+    // were already handled
+    for (size_t i = p.pair_count; i-- > 0;) {
+      size_t before = p.pair_count;
+      for (int d = 0; d < 2 && p.pair_count == before; d++) {
+        short revents = pfds[1 + (2 * i) + (size_t)d].revents;
+        // a hang up makes the next write fail instead of wait
+        if (revents & (POLLOUT | POLLHUP | POLLERR)) {
+          p.pairs[i].dir[1 - d].blocked = 0;
+        }
+        if ((revents & (POLLHUP | POLLERR)) && p.pairs[i].dir[d].eof == 2) {
+          // already forwarded its close and now it is gone for good
+          close_pair(&p, i, 0);
+        } else if (revents & (POLLIN | POLLHUP | POLLERR)) {
+          read_side(&p, &p.pairs[i], d, now);
+        }
+      }
+    }
+    if (pfds[0].revents & POLLIN) {
+      accept_pair(&p, now);
+    }
+  }
+
+  while (p.pair_count > 0) {
+    close_pair(&p, p.pair_count - 1, 0);
+  }
+  print_stats(&p, now_ms());
+  close(p.listen_fd);
+  free(p.steps);
+  return EXIT_SUCCESS;
+}
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  proxy_stop = 1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s -l <listen_port> -p <target_port> [-L <listen_ip>] "
+          "[-t <target_ip>] [options]\n",
+          argv0);
+  fputs("\nOptions: \n", stderr);
+  fputs("  -k <bytes> Split reads into random pieces of 1..bytes\n", stderr);
+  fputs("  -g <ms> Pause between the pieces of a split read\n", stderr);
+  fputs("  -c <ms> Hold data this long so frames are coalesced\n", stderr);
+  fputs("  -d <ms> Added latency\n", stderr);
+  fputs("  -j <ms> Random extra latency, 0..ms\n", stderr);
+  fputs("  -b <bytes/s> Bandwidth cap per direction\n", stderr);
+  fputs("  -R <n> Reset a connection on n out of 1000 reads\n", stderr);
+  fputs("  -s <script> Timed changes, \"<ms> <knob> [value]\" per line\n",
+        stderr);
+  fputs("              knobs: split gap coalesce delay jitter rate\n", stderr);
+  fputs("              reset_chance, plus reset, stats and quit\n", stderr);
+  fputs("  -S <seed> Seed the random faults for a repeatable run\n", stderr);
+  fputs("  -v Print throughput every second\n", stderr);
+  fputs(" -h Display this help and exit\n", stderr);
+}
+
+static int parse_u32(const char *text, uint32_t *out) {
+  char *endptr;
+  errno = 0;
+  unsigned long value = strtoul(text, &endptr, PROXY_PORT_BASE);
+
+  if (errno != 0 || *endptr != '\0' || text[0] == '-' ||
+      value > UINT32_MAX) {
+    return -1;
+  }
+  *out = (uint32_t)value;
+  return 0;
+}
+
+static int parse_port(const char *text, uint16_t *out) {
+  uint32_t value;
+
+  if (parse_u32(text, &value) == -1 || value == 0 || value > UINT16_MAX) {
+    return -1;
+  }
+  *out = (uint16_t)value;
+  return 0;
+}
+
+static int load_script(fault_proxy *p, const char *path) {
+  char line[PROXY_SCRIPT_LINE];
+  size_t cap = 0;
+  unsigned lineno = 0;
+  proxy_faults scratch = {0};
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char name[32];
+    long long at;
+    unsigned long value = 0;
+    lineno++;
+
+    char *hash = strchr(line, '#');
+    if (hash != NULL) {
+      *hash = '\0';
+    }
+    int fields = sscanf(line, "%lld %31s %lu", &at, name, &value);
+    if (fields <= 0) {
+      continue; // blank or comment
+    }
+
+    int action = strcmp(name, "reset") == 0 || strcmp(name, "stats") == 0 ||
+                 strcmp(name, "quit") == 0;
+    if (fields < 2 || at < 0 || value > UINT32_MAX ||
+        (!action &&
+         (fields < 3 || set_fault(&scratch, name, (uint32_t)value) == -1)) ||
+        (p->step_count > 0 && at < p->steps[p->step_count - 1].at_ms)) {
+      fprintf(stderr, "%s:%u: expected \"<ms> <knob> [value]\" in time order\n",
+              path, lineno);
+      fclose(fp);
+      return -1;
+    }
+
+    if (p->step_count == cap) {
+      size_t grown = cap == 0 ? 16 : cap * 2;
+      proxy_step *steps = realloc(p->steps, grown * sizeof(*steps));
+      if (steps == NULL) {
+        fputs("fault_proxy: out of memory\n", stderr);
+        fclose(fp);
+        return -1;
+      }
+      p->steps = steps;
+      cap = grown;
+    }
+
+    proxy_step *step = &p->steps[p->step_count++];
+    step->at_ms = at;
+    snprintf(step->name, sizeof(step->name), "%s", name);
+    step->value = (uint32_t)value;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+static int set_fault(proxy_faults *f, const char *name, uint32_t value) {
+  if (strcmp(name, "split") == 0) {
+    f->split = value;
+  } else if (strcmp(name, "gap") == 0) {
+    f->gap_ms = value;
+  } else if (strcmp(name, "coalesce") == 0) {
+    f->coalesce_ms = value;
+  } else if (strcmp(name, "delay") == 0) {
+    f->delay_ms = value;
+  } else if (strcmp(name, "jitter") == 0) {
+    f->jitter_ms = value;
+  } else if (strcmp(name, "rate") == 0) {
+    f->rate = value;
+  } else if (strcmp(name, "reset_chance") == 0) {
+    f->reset_chance = value;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static void run_script(fault_proxy *p, int64_t now) {
+  while (p->next_step < p->step_count &&
+         p->start + p->steps[p->next_step].at_ms <= now) {
+    const proxy_step *step = &p->steps[p->next_step++];
+
+    fprintf(stderr, "[%lld ms] %s", (long long)step->at_ms, step->name);
+    if (strcmp(step->name, "reset") == 0) {
+      fprintf(stderr, " (%zu connections)\n", p->pair_count);
+      while (p->pair_count > 0) {
+        close_pair(p, p->pair_count - 1, 1);
+      }
+    } else if (strcmp(step->name, "stats") == 0) {
+      fputc('\n', stderr);
+      print_stats(p, now);
+    } else if (strcmp(step->name, "quit") == 0) {
+      fputc('\n', stderr);
+      proxy_stop = 1;
+    } else {
+      fprintf(stderr, " = %u\n", step->value);
+      set_fault(&p->faults, step->name, step->value);
+    }
+  }
+}
+
+static int open_listener(fault_proxy *p) {
+  int one = 1;
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  p->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (p->listen_fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(p->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(p->listen_fd, (struct sockaddr *)&p->listen_addr,
+           sizeof(p->listen_addr)) == -1 ||
+      listen(p->listen_fd, SOMAXCONN) == -1 ||
+      set_nonblocking(p->listen_fd) == -1) {
+    perror("listen");
+    close(p->listen_fd);
+    p->listen_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+static void accept_pair(fault_proxy *p, int64_t now) {
+  int one = 1;
+
+  // NOLINTNEXTLINE(android-cloexec-accept)
+  int client = accept(p->listen_fd, NULL, NULL);
+  if (client == -1) {
+    return;
+  }
+
+  // the upstream connect is blocking, the target is expected to be local
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  if (server == -1 || connect(server, (struct sockaddr *)&p->target,
+                              sizeof(p->target)) == -1) {
+    fprintf(stderr, "fault_proxy: upstream connect failed: %s\n",
+            strerror(errno));
+    if (server != -1) {
+      close(server);
+    }
+    close(client);
+    return;
+  }
+
+  if (set_nonblocking(client) == -1 || set_nonblocking(server) == -1) {
+    close(server);
+    close(client);
+    return;
+  }
+  // otherwise Nagle glues the split pieces back together
+  setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  proxy_pair *pair = &p->pairs[p->pair_count++];
+  memset(pair, 0, sizeof(*pair));
+  pair->fd[0] = client;
+  pair->fd[1] = server;
+  for (int d = 0; d < 2; d++) {
+    pair->dir[d].refilled_at = now;
+    pair->dir[d].last_release = now;
+  }
+  p->accepted++;
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void read_side(fault_proxy *p, proxy_pair *pair, int d, int64_t now) {
+  uint8_t buf[PROXY_READ_CHUNK];
+  proxy_direction *dir = &pair->dir[d];
+
+  if (dir->eof) {
+    return;
+  }
+
+  ssize_t n = read(pair->fd[d], buf, sizeof(buf));
+  if (n == -1) {
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+      // treat like a close, whatever is queued still goes out
+      dir->eof = 1;
+    }
+    return;
+  }
+  if (n == 0) {
+    dir->eof = 1;
+    return;
+  }
+
+  if (p->faults.reset_chance > 0 &&
+      next_random(p, 1000) < p->faults.reset_chance) {
+    for (size_t i = 0; i < p->pair_count; i++) {
+      if (&p->pairs[i] == pair) {
+        close_pair(p, i, 1);
+        return;
+      }
+    }
+  }
+
+  enqueue(p, dir, buf, (size_t)n, now);
+}
+
+static void enqueue(fault_proxy *p, proxy_direction *dir, const uint8_t *buf,
+                    size_t len, int64_t now) {
+  const proxy_faults *f = &p->faults;
+  int64_t release = now + f->delay_ms;
+
+  if (f->jitter_ms > 0) {
+    release += next_random(p, f->jitter_ms + 1);
+  }
+  if (f->coalesce_ms > 0) {
+    // everything read inside one window goes out together
+    if (dir->coalesce_until <= now) {
+      dir->coalesce_until = now + f->coalesce_ms;
+    }
+    if (release < dir->coalesce_until) {
+      release = dir->coalesce_until;
+    }
+  }
+
+  size_t off = 0;
+  while (off < len) {
+    size_t piece = len - off;
+    if (f->split > 0) {
+      size_t cut = 1 + next_random(p, f->split);
+      piece = piece < cut ? piece : cut;
+    }
+
+    // tcp is in order, so no segment may overtake the one before it
+    if (release < dir->last_release) {
+      release = dir->last_release;
+    }
+
+    proxy_segment *seg = malloc(sizeof(*seg) + piece);
+    if (seg == NULL) {
+      fputs("fault_proxy: out of memory, dropping data\n", stderr);
+      return;
+    }
+    seg->next = NULL;
+    seg->release_at = release;
+    seg->len = piece;
+    seg->off = 0;
+    memcpy(seg->data, buf + off, piece);
+
+    if (dir->tail == NULL) {
+      dir->head = seg;
+    } else {
+      dir->tail->next = seg;
+    }
+    dir->tail = seg;
+    dir->queued += piece;
+    dir->last_release = release;
+
+    off += piece;
+    release += f->gap_ms;
+  }
+}
+
+// write what is due from dir[d] to the other side. -1 closes the pair
+static int flush_side(fault_proxy *p, proxy_pair *pair, int d, int64_t now) {
+  proxy_direction *dir = &pair->dir[d];
+  const proxy_faults *f = &p->faults;
+  int dest = pair->fd[1 - d];
+
+  while (!dir->blocked && dir->head != NULL && dir->head->release_at <= now) {
+    size_t budget = SIZE_MAX;
+
+    if (f->rate > 0) {
+      // token bucket with at most 20ms of burst
+      double burst = f->rate / 50.0 > 1.0 ? f->rate / 50.0 : 1.0;
+      dir->tokens += (double)(now - dir->refilled_at) * f->rate / 1000.0;
+      dir->tokens = dir->tokens > burst ? burst : dir->tokens;
+      dir->refilled_at = now;
+      if (dir->tokens < 1.0) {
+        return 0;
+      }
+      budget = (size_t)dir->tokens;
+    }
+
+    // without coalescing every segment is its own write, which is what
+    // makes the splits visible on the other end
+    struct iovec iov[PROXY_IOV_MAX];
+    int iovcnt = 0;
+    size_t want = 0;
+    for (proxy_segment *seg = dir->head;
+         seg != NULL && seg->release_at <= now && iovcnt < PROXY_IOV_MAX &&
+         want < budget;
+         seg = seg->next) {
+      size_t chunk = seg->len - seg->off;
+      if (chunk > budget - want) {
+        chunk = budget - want;
+      }
+      iov[iovcnt].iov_base = seg->data + seg->off;
+      iov[iovcnt].iov_len = chunk;
+      iovcnt++;
+      want += chunk;
+      if (f->coalesce_ms == 0) {
+        break;
+      }
+    }
+
+    ssize_t n = writev(dest, iov, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        dir->blocked = 1;
+        return 0;
+      }
+      return -1;
+    }
+
+    size_t done = (size_t)n;
+    dir->blocked = 0;
+    dir->queued -= done;
+    p->total_bytes += done;
+    if (f->rate > 0) {
+      dir->tokens -= (double)done;
+    }
+    while (done > 0) {
+      proxy_segment *seg = dir->head;
+      size_t chunk = seg->len - seg->off;
+      if (done < chunk) {
+        seg->off += done;
+        break;
+      }
+      done -= chunk;
+      dir->head = seg->next;
+      if (dir->head == NULL) {
+        dir->tail = NULL;
+      }
+      free(seg);
+    }
+  }
+
+  // pass the half close on once the queue is empty
+  if (dir->eof == 1 && dir->head == NULL) {
+    shutdown(dest, SHUT_WR);
+    dir->eof = 2;
+  }
+  return 0;
+}
+
+// earliest time something has to happen without a socket event, -1 = never
+static int64_t next_wakeup(const fault_proxy *p, int64_t now) {
+  int64_t wake = -1;
+
+  if (p->next_step < p->step_count) {
+    wake = p->start + p->steps[p->next_step].at_ms;
+  }
+  if (p->stats && (wake < 0 || p->next_stats < wake)) {
+    wake = p->next_stats;
+  }
+
+  for (size_t i = 0; i < p->pair_count; i++) {
+    for (int d = 0; d < 2; d++) {
+      const proxy_direction *dir = &p->pairs[i].dir[d];
+      if (dir->head == NULL) {
+        continue;
+      }
+      int64_t at = dir->head->release_at;
+      if (at <= now) {
+        // due but waiting on the rate limiter (POLLOUT covers the rest)
+        at = p->faults.rate > 0 ? now + 1 : -1;
+      }
+      if (at >= 0 && (wake < 0 || at < wake)) {
+        wake = at;
+      }
+    }
+  }
+
+  if (wake >= 0 && wake < now) {
+    wake = now;
+  }
+  return wake;
+}
+
+static void close_pair(fault_proxy *p, size_t index, int reset) {
+  proxy_pair *pair = &p->pairs[index];
+
+  for (int d = 0; d < 2; d++) {
+    if (reset) {
+      // zero linger turns close into an RST
+      struct linger lg = {.l_onoff = 1, .l_linger = 0};
+      setsockopt(pair->fd[d], SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(pair->fd[d]);
+
+    proxy_segment *seg = pair->dir[d].head;
+    while (seg != NULL) {
+      proxy_segment *next = seg->next;
+      free(seg);
+      seg = next;
+    }
+  }
+  if (reset) {
+    p->resets++;
+  }
+
+  p->pair_count--;
+  if (index != p->pair_count) {
+    p->pairs[index] = p->pairs[p->pair_count];
+  }
+}
+
+static void print_stats(fault_proxy *p, int64_t now) {
+  int64_t elapsed = now - p->start;
+  uint64_t delta = p->total_bytes - p->last_total;
+
+  fprintf(stderr,
+          "[%lld ms] connections %zu open, %llu accepted, %llu reset; "
+          "%llu bytes total, %llu since last\n",
+          (long long)elapsed, p->pair_count, (unsigned long long)p->accepted,
+          (unsigned long long)p->resets, (unsigned long long)p->total_bytes,
+          (unsigned long long)delta);
+  p->last_total = p->total_bytes;
+}
+
+// xorshift64*, repeatable for a given -S
+static uint32_t next_random(fault_proxy *p, uint32_t bound) {
+  p->seed ^= p->seed >> 12U;
+  p->seed ^= p->seed << 25U;
+  p->seed ^= p->seed >> 27U;
+  uint64_t r = p->seed * 2685821657736338717ULL;
+
+  return bound == 0 ? 0 : (uint32_t)((r >> 32U) % bound);
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
@@ -0,0 +1,351 @@
+#include "frame.h"
+#include "capture.h"
+#include "metrics.h"
+#include "trace.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int wait_fd(int fd, short events);
+
+void frame_header_init(big_header_t *hdr, uint8_t type, uint8_t status,
+                       uint32_t body_len) {
+  hdr->version = BIG_CHAT_VERSION;
+  hdr->type = type;
+  hdr->status = status;
+  hdr->reserved = 0;
+  hdr->body = htonl(body_len);
+}
+
+uint64_t frame_hton64(uint64_t value) {
+  uint32_t hi = htonl((uint32_t)(value >> 32U));
+  uint32_t lo = htonl((uint32_t)(value & UINT32_MAX));
+  uint64_t out;
+  uint8_t *p = (uint8_t *)&out;
+
+  // hi word goes first on the wire
+  memcpy(p, &hi, sizeof(hi));
+  memcpy(p + sizeof(hi), &lo, sizeof(lo));
+  return out;
+}
+
+uint64_t frame_ntoh64(uint64_t value) {
+  uint32_t hi;
+  uint32_t lo;
+  const uint8_t *p = (const uint8_t *)&value;
+
+  memcpy(&hi, p, sizeof(hi));
+  memcpy(&lo, p + sizeof(hi), sizeof(lo));
+  return ((uint64_t)ntohl(hi) << 32U) | ntohl(lo);
+}
+
+// block until fd is ready, used when the socket is non-blocking
+static int wait_fd(int fd, short events) {
+  struct pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+
+  while (poll(&pfd, 1, -1) == -1) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int frame_write_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (wait_fd(fd, POLLOUT) == -1) {
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+int frame_read_all(int fd, void *buf, size_t len) {
+  uint8_t *p = buf;
+
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n == 0) {
+      // peer closed mid-frame
+      errno = ECONNRESET;
+      return -1;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (wait_fd(fd, POLLIN) == -1) {
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+int frame_send(int fd, uint8_t type, uint8_t status, const void *body,
+               uint32_t body_len) {
+  big_header_t hdr;
+  struct iovec iov[2];
+  int iovcnt = 1;
+  size_t left = sizeof(hdr) + body_len;
+
+  frame_header_init(&hdr, type, status, body_len);
+
+  // header and body go out in one syscall when the socket allows it
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  if (body_len > 0) {
+    iov[1].iov_base = (void *)(uintptr_t)body;
+    iov[1].iov_len = body_len;
+    iovcnt = 2;
+  }
+
+  struct iovec *cur = iov;
+  while (left > 0) {
+    ssize_t n = writev(fd, cur, iovcnt);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (wait_fd(fd, POLLOUT) == -1) {
+          return -1;
+        }
+        continue;
+      }
+      return -1;
+    }
+
+    // short write, skip what went out and retry with the rest
+    size_t done = (size_t)n;
+    left -= done;
+    while (iovcnt > 0 && done >= cur->iov_len) {
+      done -= cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (uint8_t *)cur->iov_base + done;
+      cur->iov_len -= done;
+    }
+  }
+
+  trace_record(TRACE_FRAME_SENT, fd, type, status, body_len);
+  metrics_frame_sent(type, body_len);
+  capture_frame(CAPTURE_SENT, fd, &hdr, body, body_len);
+  return 0;
+}
+
+void frame_create_account_body(big_create_account_req_t *body,
+                               const big_auth_t *auth) {
+  memset(body, 0, sizeof(*body));
+  body->authentication = *auth;
+  body->client_id = 0; // the node picks one
+}
+
+int frame_login_logout_body(big_login_logout_req_t *body,
+                            const big_auth_t *auth, int fd,
+                            uint8_t status_flag) {
+  struct sockaddr_in local_addr;
+  socklen_t addr_len = sizeof(local_addr);
+
+  memset(body, 0, sizeof(*body));
+  body->authentication = *auth;
+  body->status = status_flag;
+  if (getsockname(fd, (struct sockaddr *)&local_addr, &addr_len) == -1) {
+    return -1;
+  }
+  // already network byte order
+  memcpy(&body->client_ip, &local_addr.sin_addr.s_addr,
+         sizeof(ipv4_address_t));
+  return 0;
+}
+
+void frame_get_message_body(big_get_message_t *body, const big_auth_t *auth,
+                            uint64_t since_ms, uint8_t channel_id) {
+  memset(body, 0, sizeof(*body));
+  body->authentication = *auth;
+  body->timestamp = frame_hton64(since_ms);
+  body->channel_id = channel_id;
+}
+
+void frame_send_message_body(big_send_message_t *body, const big_auth_t *auth,
+                             uint64_t timestamp_ms, uint8_t channel_id,
+                             uint16_t length) {
+  memset(body, 0, sizeof(*body));
+  body->authentication = *auth;
+  body->timestamp = frame_hton64(timestamp_ms);
+  body->message_length = htons(length);
+  body->channel_id = channel_id;
+}
+
+uint8_t frame_validate_body(const big_header_t *hdr, const uint8_t *body,
+                            size_t have) {
+  size_t len = hdr->body;
+  size_t fixed;
+  size_t extra;
+
+  if (hdr->version != BIG_CHAT_VERSION) {
+    return STATUS_INVALID_VERSION;
+  }
+  // an error response carries at most an explanation
+  if (hdr->status != STATUS_OK) {
+    return STATUS_OK;
+  }
+
+  switch (hdr->type) {
+  // fixed size bodies
+  case TYPE_DISCOVERY_REQUEST:
+    return len == 0 || len == sizeof(big_discovery_res_t) ? STATUS_OK
+                                                          : STATUS_INVALID_SIZE;
+  case TYPE_DISCOVERY_RESPONSE:
+    return len == sizeof(big_discovery_res_t) ? STATUS_OK : STATUS_INVALID_SIZE;
+  case TYPE_ACCOUNT_CREATE_REQUEST:
+    return len == sizeof(big_create_account_req_t) ? STATUS_OK
+                                                    : STATUS_INVALID_SIZE;
+  case TYPE_ACCOUNT_CREATE_RESPONSE:
+    return len == 0 || len == sizeof(big_create_account_req_t)
+               ? STATUS_OK
+               : STATUS_INVALID_SIZE;
+  case TYPE_LOGIN_OR_LOGOUT_REQUEST:
+    if (len != sizeof(big_login_logout_req_t)) {
+      return STATUS_INVALID_SIZE;
+    }
+    if (have < len) {
+      return STATUS_MALFORMED_REQUEST;
+    }
+    // 1 = login, 0 = logout
+    return body[offsetof(big_login_logout_req_t, status)] <= 1
+               ? STATUS_OK
+               : STATUS_MALFORMED_REQUEST;
+  case TYPE_LOGIN_OR_LOGOUT_RESPONSE:
+  case TYPE_SEND_MESSAGE_RESPONSE:
+    return STATUS_OK;
+
+  // a fixed part followed by as many bytes as its count field says
+  case TYPE_GET_CHANNEL_INFO_REQUEST:
+  case TYPE_GET_CHANNEL_INFO_RESPONSE:
+    fixed = sizeof(big_channel_info_t);
+    if (len < fixed || have < fixed) {
+      break;
+    }
+    extra = body[offsetof(big_channel_info_t, user_id_length)];
+    return len == fixed + extra ? STATUS_OK : STATUS_INVALID_SIZE;
+  case TYPE_LIST_ALL_CHANNELS_REQUEST:
+  case TYPE_LIST_ALL_CHANNELS_RESPONSE:
+    fixed = sizeof(big_channel_list_t);
+    if (len < fixed || have < fixed) {
+      break;
+    }
+    extra = body[offsetof(big_channel_list_t, channel_id_length)];
+    return len == fixed + extra ? STATUS_OK : STATUS_INVALID_SIZE;
+  case TYPE_SEND_MESSAGE_REQUEST: {
+    uint16_t text_len;
+    fixed = sizeof(big_send_message_t);
+    if (len < fixed || have < fixed) {
+      break;
+    }
+    memcpy(&text_len, body + offsetof(big_send_message_t, message_length),
+           sizeof(text_len));
+    return len == fixed + ntohs(text_len) ? STATUS_OK : STATUS_INVALID_SIZE;
+  }
+  case TYPE_GET_MESSAGE_REQUEST:
+  case TYPE_GET_MESSAGE_RESPONSE: {
+    uint16_t text_len;
+    fixed = sizeof(big_get_message_t);
+    if (len < fixed || have < fixed) {
+      break;
+    }
+    memcpy(&text_len, body + offsetof(big_get_message_t, message_length),
+           sizeof(text_len));
+    return len == fixed + ntohs(text_len) ? STATUS_OK : STATUS_INVALID_SIZE;
+  }
+  default:
+    return STATUS_INVALID_TYPE;
+  }
+
+  // fixed part missing, or cut off before we could read the count
+  return len < fixed ? STATUS_INVALID_SIZE : STATUS_MALFORMED_REQUEST;
+}
+
+void frame_decoder_init(frame_decoder *dec, uint8_t *body, size_t body_cap) {
+  dec->body = body;
+  dec->body_cap = body_cap;
+  frame_decoder_reset(dec);
+}
+
+void frame_decoder_reset(frame_decoder *dec) {
+  memset(&dec->hdr, 0, sizeof(dec->hdr));
+  dec->hdr_have = 0;
+  dec->body_have = 0;
+  dec->body_skip = 0;
+}
+
+frame_result frame_decoder_push(frame_decoder *dec, const uint8_t *data,
+                                size_t len, size_t *used) {
+  size_t taken = 0;
+
+  // collect the fixed header first
+  if (dec->hdr_have < sizeof(big_header_t)) {
+    size_t want = sizeof(big_header_t) - dec->hdr_have;
+    size_t n = len < want ? len : want;
+
+    memcpy((uint8_t *)&dec->hdr + dec->hdr_have, data, n);
+    dec->hdr_have += n;
+    taken += n;
+
+    if (dec->hdr_have < sizeof(big_header_t)) {
+      *used = taken;
+      return FRAME_NEED_MORE;
+    }
+
+    dec->hdr.body = ntohl(dec->hdr.body);
+    if (dec->hdr.version != BIG_CHAT_VERSION) {
+      *used = taken;
+      return FRAME_ERROR;
+    }
+  }
+
+  // then the body, keeping what fits and dropping the rest
+  size_t left = len - taken;
+  size_t want = dec->hdr.body - dec->body_have - dec->body_skip;
+  size_t n = left < want ? left : want;
+  size_t room = dec->body_cap - dec->body_have;
+  size_t keep = n < room ? n : room;
+
+  if (keep > 0) {
+    memcpy(dec->body + dec->body_have, data + taken, keep);
+    dec->body_have += keep;
+  }
+  dec->body_skip += n - keep;
+  taken += n;
+
+  *used = taken;
+  return dec->body_have + dec->body_skip == dec->hdr.body ? FRAME_COMPLETE
+                                                          : FRAME_NEED_MORE;
+}
@@ -0,0 +1,156 @@
+#include "history.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t key_hash(uint8_t channel_id, uint8_t sender_id,
+                         uint64_t timestamp);
+static int key_matches(const history_entry *e, uint8_t channel_id,
+                       uint8_t sender_id, uint64_t timestamp);
+static size_t find_slot(const history_store *h, uint8_t channel_id,
+                        uint8_t sender_id, uint64_t timestamp);
+static void index_remove(history_store *h, size_t slot);
+
+int history_init(history_store *h, size_t capacity) {
+  size_t cap = 1;
+
+  while (cap < capacity) {
+    cap <<= 1U;
+  }
+
+  h->entries = calloc(cap, sizeof(history_entry));
+  // index at twice the ring size keeps probe chains short
+  h->index = calloc(cap * 2, sizeof(uint64_t));
+  if (h->entries == NULL || h->index == NULL) {
+    free(h->entries);
+    free(h->index);
+    h->entries = NULL;
+    h->index = NULL;
+    return -1;
+  }
+
+  h->mask = cap - 1;
+  h->index_mask = (cap * 2) - 1;
+  h->next_seq = 0;
+  return 0;
+}
+
+void history_destroy(history_store *h) {
+  free(h->entries);
+  free(h->index);
+  h->entries = NULL;
+  h->index = NULL;
+}
+
+int history_insert(history_store *h, uint8_t channel_id, uint8_t sender_id,
+                   uint64_t timestamp, const char *text, size_t length) {
+  size_t slot = find_slot(h, channel_id, sender_id, timestamp);
+
+  if (h->index[slot] != 0) {
+    return 0;
+  }
+
+  // ring full: drop the oldest entry from the index before reusing it
+  if (h->next_seq > h->mask) {
+    const history_entry *old = &h->entries[(h->next_seq - h->mask - 1) & h->mask];
+    size_t old_slot =
+        find_slot(h, old->channel_id, old->sender_id, old->timestamp);
+
+    if (h->index[old_slot] != 0) {
+      index_remove(h, old_slot);
+    }
+    // the shift may have moved our empty slot
+    slot = find_slot(h, channel_id, sender_id, timestamp);
+  }
+
+  history_entry *e = &h->entries[h->next_seq & h->mask];
+  if (length > HISTORY_TEXT_LENGTH) {
+    length = HISTORY_TEXT_LENGTH;
+  }
+  e->timestamp = timestamp;
+  e->channel_id = channel_id;
+  e->sender_id = sender_id;
+  e->length = (uint16_t)length;
+  memcpy(e->text, text, length);
+
+  h->index[slot] = h->next_seq + 1;
+  h->next_seq++;
+  return 1;
+}
+
+const history_entry *history_lookup(const history_store *h,
+                                    uint8_t channel_id, uint8_t sender_id,
+                                    uint64_t timestamp) {
+  size_t slot = find_slot(h, channel_id, sender_id, timestamp);
+
+  if (h->index[slot] == 0) {
+    return NULL;
+  }
+  return &h->entries[(h->index[slot] - 1) & h->mask];
+}
+
+uint64_t history_first_seq(const history_store *h) {
+  return h->next_seq > h->mask ? h->next_seq - h->mask - 1 : 0;
+}
+
+const history_entry *history_at(const history_store *h, uint64_t seq) {
+  if (seq < history_first_seq(h) || seq >= h->next_seq) {
+    return NULL;
+  }
+  return &h->entries[seq & h->mask];
+}
+
+static uint64_t key_hash(uint8_t channel_id, uint8_t sender_id,
+                         uint64_t timestamp) {
+  uint64_t x = timestamp ^ ((uint64_t)channel_id << 56U) ^
+               ((uint64_t)sender_id << 48U);
+
+  // splitmix64 finaliser
+  x ^= x >> 30U;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27U;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31U;
+  return x;
+}
+
+static int key_matches(const history_entry *e, uint8_t channel_id,
+                       uint8_t sender_id, uint64_t timestamp) {
+  return e->timestamp == timestamp && e->channel_id == channel_id &&
+         e->sender_id == sender_id;
+}
+
+// slot holding the key, or the empty slot where it would go
+static size_t find_slot(const history_store *h, uint8_t channel_id,
+                        uint8_t sender_id, uint64_t timestamp) {
+  size_t slot = key_hash(channel_id, sender_id, timestamp) & h->index_mask;
+
+  while (h->index[slot] != 0) {
+    const history_entry *e = &h->entries[(h->index[slot] - 1) & h->mask];
+    if (key_matches(e, channel_id, sender_id, timestamp)) {
+      return slot;
+    }
+    slot = (slot + 1) & h->index_mask;
+  }
+  return slot;
+}
+
+// backward-shift deletion keeps linear probing chains intact without
+// tombstones
+static void index_remove(history_store *h, size_t slot) {
+  size_t hole = slot;
+  size_t next = (slot + 1) & h->index_mask;
+
+  while (h->index[next] != 0) {
+    const history_entry *e = &h->entries[(h->index[next] - 1) & h->mask];
+    size_t home = key_hash(e->channel_id, e->sender_id, e->timestamp) &
+                  h->index_mask;
+
+    // move next into the hole unless its home lies cyclically in (hole, next]
+    if (((next - home) & h->index_mask) >= ((next - hole) & h->index_mask)) {
+      h->index[hole] = h->index[next];
+      hole = next;
+    }
+    next = (next + 1) & h->index_mask;
+  }
+  h->index[hole] = 0;
+}
@@ -1,6 +1,263 @@
 #include "messaging.h"
+#include "history.h"
+#include "net_thread.h"
+#include "network_funcs.h"
+#include "render.h"
+#include "user_directory.h"
+#include "utils.h"
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum
+{
+    INPUT_LINE_LENGTH = NET_TEXT_LENGTH,
+    NOTICE_LENGTH = 128
+};
+
+// everything the ui thread owns while messaging
+typedef struct
+{
+    client_context *ctx;
+    net_thread nt;
+    history_store history;
+    renderer view;
+    user_directory users;
+    const char *link;
+    char notice[NOTICE_LENGTH];
+} messaging_ui;
+
+static int handle_input_line(messaging_ui *ui, const char *line);
+static int drain_events(messaging_ui *ui);
+static void apply_event(messaging_ui *ui, const net_event *evt);
+static void update_status(messaging_ui *ui);
+static void request_users(void *arg, const uint8_t *ids, size_t count);
+
+// ui thread: owns stdin and stdout, talks to the network thread only
+// through its queues so typing and delivery never wait on each other
+void network_execute_messaging_loop(client_context *ctx) {
+  messaging_ui ui;
+
+  memset(&ui, 0, sizeof(ui));
+  ui.ctx = ctx;
+  ui.link = "connecting";
+
+  printf("\n--- Phase 4: Messaging (channel %u) ---\n", ctx->channel_id);
+  printf("Type a message and press enter. Commands: /join <id>, /fetch, "
+         "/quit\n");
+  fflush(stdout);
+
+  if (convert_address(ctx) != 0) {
+    fprintf(stderr, "Invalid Server IP format.\n");
+    return;
+  }
+
+  if (history_init(&ui.history, HISTORY_DEFAULT_CAPACITY) == -1) {
+    fprintf(stderr, "Fatal: Out of memory.\n");
+    return;
+  }
+
+  if (render_init(&ui.view, STDOUT_FILENO, &ui.history, RENDER_DEFAULT_FPS) ==
+      -1) {
+    fprintf(stderr, "Fatal: Out of memory.\n");
+    history_destroy(&ui.history);
+    return;
+  }
+  render_set_prompt(&ui.view, "> ");
+
+  // our own name comes from the account response, everyone else is looked
+  // up on first sight
+  user_directory_init(&ui.users, USER_DIRECTORY_TTL_MS, request_users, &ui);
+  user_directory_learn(&ui.users, ctx->account_id, ctx->username,
+                       sizeof(ctx->username), 1, monotonic_ms());
+  render_set_users(&ui.view, &ui.users);
+
+  if (net_thread_start(&ui.nt, ctx) == -1) {
+    fprintf(stderr, "Fatal: Could not start network thread.\n");
+    render_destroy(&ui.view);
+    history_destroy(&ui.history);
+    return;
+  }
+
+  update_status(&ui);
+
+  int running = 1;
+  while (running) {
+    struct pollfd pfds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN, .revents = 0},
+        {.fd = net_thread_event_fd(&ui.nt), .events = POLLIN, .revents = 0}};
+
+    // wake up for the next frame if one is waiting on the rate cap
+    if (poll(pfds, 2, render_timeout_ms(&ui.view)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      break;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      net_thread_clear_event_fd(&ui.nt);
+      if (drain_events(&ui) == -1) {
+        running = 0;
+      }
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP)) {
+      char line[INPUT_LINE_LENGTH];
+
+      if (feof(stdin)) {
+        break;
+      }
+      get_user_input(line, sizeof(line), NULL);
+      if (feof(stdin) && line[0] == '\0') {
+        break;
+      }
+
+      // the echoed newline scrolled the terminal
+      render_invalidate(&ui.view);
+      if (handle_input_line(&ui, line) == -1) {
+        running = 0;
+      }
+    }
+
+    render_flush(&ui.view);
+    // every unknown sender drawn this frame, in one request
+    user_directory_flush(&ui.users);
+  }
+
+  net_thread_stop(&ui.nt);
+
+  render_mark_dirty(&ui.view);
+  render_flush_now(&ui.view);
+  render_destroy(&ui.view);
+  history_destroy(&ui.history);
+}
+
+static int handle_input_line(messaging_ui *ui, const char *line) {
+  net_command cmd = {0};
+
+  if (line[0] == '\0') {
+    return 0;
+  }
+
+  if (strcmp(line, "/quit") == 0) {
+    return -1;
+  }
+
+  if (strcmp(line, "/fetch") == 0) {
+    cmd.type = NET_CMD_FETCH;
+  } else if (strncmp(line, "/join ", strlen("/join ")) == 0) {
+    char *endptr;
+    unsigned long id = strtoul(line + strlen("/join "), &endptr, PORT_BASE);
+
+    if (*endptr != '\0' || id > UINT8_MAX) {
+      snprintf(ui->notice, sizeof(ui->notice), "invalid channel id");
+      update_status(ui);
+      return 0;
+    }
+    ui->ctx->channel_id = (uint8_t)id;
+    user_directory_invalidate(&ui->users);
+    cmd.type = NET_CMD_JOIN;
+    cmd.channel_id = ui->ctx->channel_id;
+  } else {
+    cmd.type = NET_CMD_SEND_MESSAGE;
+    cmd.channel_id = ui->ctx->channel_id;
+    snprintf(cmd.text, sizeof(cmd.text), "%s", line);
+    cmd.length = (uint16_t)strlen(cmd.text);
+  }
+
+  if (net_thread_submit(&ui->nt, &cmd) == -1) {
+    snprintf(ui->notice, sizeof(ui->notice), "outgoing queue full");
+  } else {
+    ui->notice[0] = '\0';
+  }
+  update_status(ui);
+  return 0;
+}
+
+// returns -1 once the network thread has gone away
+static int drain_events(messaging_ui *ui) {
+  net_event evt;
+  int rc = 0;
+
+  while (net_thread_next_event(&ui->nt, &evt) == 0) {
+    apply_event(ui, &evt);
+    if (evt.type == NET_EVT_DISCONNECTED) {
+      rc = -1;
+    }
+  }
+  update_status(ui);
+  return rc;
+}
+
+static void apply_event(messaging_ui *ui, const net_event *evt) {
+  switch (evt->type) {
+  case NET_EVT_CONNECTED:
+    ui->link = "connected";
+    break;
+  case NET_EVT_MESSAGE:
+    if (history_insert(&ui->history, evt->channel_id, evt->sender_id,
+                       evt->timestamp, evt->text, evt->length)) {
+      render_mark_dirty(&ui->view);
+    }
+    break;
+  case NET_EVT_MEMBERS:
+    // an answer for a channel we have since left says nothing useful
+    if (evt->channel_id == ui->ctx->channel_id) {
+      user_directory_members(&ui->users, (const uint8_t *)evt->text,
+                             evt->length, monotonic_ms());
+      render_mark_dirty(&ui->view);
+    }
+    break;
+  case NET_EVT_RESPONSE:
+    // a refused lookup is remembered like an empty one, so the ids are not
+    // asked for again until the TTL runs out
+    if (evt->msg_type == TYPE_GET_CHANNEL_INFO_RESPONSE) {
+      user_directory_members(&ui->users, NULL, 0, monotonic_ms());
+      break;
+    }
+    if (evt->status != STATUS_OK) {
+      snprintf(ui->notice, sizeof(ui->notice),
+               "server error 0x%02X (type 0x%02X)", evt->status,
+               evt->msg_type);
+    }
+    break;
+  case NET_EVT_ERROR:
+    snprintf(ui->notice, sizeof(ui->notice), "%.*s", (int)evt->length,
+             evt->text);
+    break;
+  case NET_EVT_DISCONNECTED:
+    ui->link = "disconnected";
+    break;
+  default:
+    break;
+  }
+}
+
+static void update_status(messaging_ui *ui) {
+  render_set_status(&ui->view, "BIGChat | %s | #%u | %s%s%s",
+                    ui->ctx->username, ui->ctx->channel_id, ui->link,
+                    ui->notice[0] ? " | " : "", ui->notice);
+  render_set_status_detail(&ui->view, "%llu msgs",
+                           (unsigned long long)ui->history.next_seq);
+}
+
+// the protocol has no user lookup, so every batch becomes one channel info
+// request for the current channel. it lists ids, not names: the answer
+// can only tell the view who is still in the channel
+static void request_users(void *arg, const uint8_t *ids, size_t count) {
+  messaging_ui *ui = arg;
+  net_command cmd = {0};
+
+  (void)ids;
+  (void)count;
+  cmd.type = NET_CMD_CHANNEL_INFO;
+  cmd.channel_id = ui->ctx->channel_id;
 
-static void send_chat_message
\ No newline at end of file
+  // a full queue leaves the ids in flight until their retry deadline
+  net_thread_submit(&ui->nt, &cmd);
+}
@@ -0,0 +1,490 @@
+#include "metrics.h"
+#include "frame.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum
+{
+    METRICS_PATH_LENGTH = 4096
+};
+
+metrics_registry metrics;
+
+// upper bounds in microseconds, the last bucket is +Inf
+static const uint64_t rtt_bounds_us[METRICS_RTT_BUCKETS - 1] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000};
+
+static metrics_sink sink;
+static char sink_path[METRICS_PATH_LENGTH];
+static int listen_fd = -1;
+static pthread_t exporter;
+static atomic_int exporter_stop;
+static int running;
+static int exit_hooked;
+
+static int open_unix(const char *path);
+static int open_http(const char *port_str);
+static void *exporter_main(void *arg);
+static void serve_client(int fd, char *out);
+static int write_file(char *out);
+static size_t render(char *out, size_t size);
+static size_t put(char *out, size_t size, size_t off, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+static const char *state_label(int state);
+static const char *status_label(int status);
+
+int metrics_start(const char *spec) {
+  if (running) {
+    return 0;
+  }
+
+  if (strncmp(spec, "unix:", 5) == 0) {
+    sink = METRICS_SINK_UNIX;
+    listen_fd = open_unix(spec + 5);
+  } else if (strncmp(spec, "http:", 5) == 0) {
+    sink = METRICS_SINK_HTTP;
+    listen_fd = open_http(spec + 5);
+  } else if (strncmp(spec, "file:", 5) == 0 && spec[5] != '\0' &&
+             strlen(spec + 5) < sizeof(sink_path) - 4) {
+    sink = METRICS_SINK_FILE;
+    snprintf(sink_path, sizeof(sink_path), "%s", spec + 5);
+  } else {
+    fprintf(stderr,
+            "metrics: '%s' is not unix:<path>, http:<port> or file:<path>\n",
+            spec);
+    return -1;
+  }
+
+  if (sink != METRICS_SINK_FILE && listen_fd == -1) {
+    return -1;
+  }
+
+  atomic_store(&exporter_stop, 0);
+  if (spawn_thread(&exporter, exporter_main, NULL) != 0) {
+    fputs("metrics: cannot start exporter thread\n", stderr);
+    if (listen_fd != -1) {
+      close(listen_fd);
+      listen_fd = -1;
+    }
+    return -1;
+  }
+  running = 1;
+
+  if (!exit_hooked) {
+    atexit(metrics_stop);
+    exit_hooked = 1;
+  }
+  return 0;
+}
+
+void metrics_stop(void) {
+  if (!running) {
+    return;
+  }
+  running = 0;
+
+  // file mode writes a last snapshot on its way out
+  atomic_store(&exporter_stop, 1);
+  pthread_join(exporter, NULL);
+
+  if (listen_fd != -1) {
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  if (sink == METRICS_SINK_UNIX) {
+    unlink(sink_path);
+  }
+}
+
+void metrics_rtt(int64_t ns) {
+  uint64_t us = ns > 0 ? (uint64_t)ns / 1000U : 0;
+  size_t b = 0;
+
+  while (b < METRICS_RTT_BUCKETS - 1 && us > rtt_bounds_us[b]) {
+    b++;
+  }
+  metrics_add(&metrics.rtt_buckets[b], 1);
+  metrics_add(&metrics.rtt_count, 1);
+  metrics_add(&metrics.rtt_sum_us, us);
+  atomic_store_explicit(&metrics.rtt_last_us, us, memory_order_relaxed);
+}
+
+static int open_unix(const char *path) {
+  struct sockaddr_un addr;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path[0] == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "metrics: bad socket path '%s'\n", path);
+    return -1;
+  }
+  memcpy(addr.sun_path, path, strlen(path));
+  snprintf(sink_path, sizeof(sink_path), "%s", path);
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "metrics: socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // a stale socket from a crashed run would make bind fail, but only a
+  // socket is ours to remove. owner only from the moment it exists
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  mode_t old_mask = umask(077);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+
+  if (rc == -1 || listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "metrics: cannot listen on %s: %s\n", path,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int open_http(const char *port_str) {
+  struct sockaddr_in addr;
+  char *endptr;
+  int one = 1;
+
+  errno = 0;
+  unsigned long port = strtoul(port_str, &endptr, PORT_BASE);
+  if (errno != 0 || *endptr != '\0' || port == 0 || port > UINT16_MAX) {
+    fprintf(stderr, "metrics: invalid port '%s'\n", port_str);
+    return -1;
+  }
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "metrics: socket: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  // scrapers on other hosts go through a local agent or a tunnel
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, SOMAXCONN) == -1) {
+    fprintf(stderr, "metrics: cannot listen on port %lu: %s\n", port,
+            strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *exporter_main(void *arg) {
+  char *out = malloc(METRICS_RESPONSE_SIZE);
+  int64_t next_write = 0;
+
+  (void)arg;
+  if (out == NULL) {
+    fputs("metrics: out of memory\n", stderr);
+    return NULL;
+  }
+
+  while (!atomic_load(&exporter_stop)) {
+    if (sink == METRICS_SINK_FILE) {
+      if (monotonic_ms() >= next_write) {
+        write_file(out);
+        next_write = monotonic_ms() + METRICS_FILE_INTERVAL_MS;
+      }
+      poll(NULL, 0, METRICS_POLL_MS);
+      continue;
+    }
+
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, METRICS_POLL_MS) <= 0) {
+      continue;
+    }
+    // NOLINTNEXTLINE(android-cloexec-accept)
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd != -1) {
+      serve_client(fd, out);
+      close(fd);
+    }
+  }
+
+  if (sink == METRICS_SINK_FILE) {
+    write_file(out);
+  }
+  free(out);
+  return NULL;
+}
+
+// just enough http for prometheus and curl: read the request head, answer
+// any GET with the current values and close
+static void serve_client(int fd, char *out) {
+  char req[METRICS_REQUEST_SIZE];
+  size_t have = 0;
+  char head[128];
+
+  while (have < sizeof(req) - 1) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) <= 0) {
+      return;
+    }
+    ssize_t n = read(fd, req + have, sizeof(req) - 1 - have);
+    if (n <= 0) {
+      return;
+    }
+    have += (size_t)n;
+    req[have] = '\0';
+    if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL) {
+      break;
+    }
+  }
+
+  if (strncmp(req, "GET ", 4) != 0) {
+    const char *bad = "HTTP/1.0 405 Method Not Allowed\r\n"
+                      "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    frame_write_all(fd, bad, strlen(bad));
+    return;
+  }
+
+  size_t len = render(out, METRICS_RESPONSE_SIZE);
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                          len);
+  if (frame_write_all(fd, head, (size_t)head_len) == 0) {
+    frame_write_all(fd, out, len);
+  }
+}
+
+// write next to the target and rename, so a collector never reads half a
+// file
+static int write_file(char *out) {
+  char tmp[sizeof(sink_path) + 8];
+  size_t len = render(out, METRICS_RESPONSE_SIZE);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", sink_path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "metrics: cannot open %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  if (frame_write_all(fd, out, len) == -1) {
+    fprintf(stderr, "metrics: write failed: %s\n", strerror(errno));
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  close(fd);
+  if (rename(tmp, sink_path) == -1) {
+    fprintf(stderr, "metrics: cannot replace %s: %s\n", sink_path,
+            strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+#define LOAD(x) ((unsigned long long)atomic_load_explicit(&(x), \
+                                                          memory_order_relaxed))
+
+static size_t render(char *out, size_t size) {
+  static const struct
+  {
+      const char *name;
+      const char *help;
+      atomic_uint_fast64_t *value;
+  } counters[] = {
+      {"big_client_frames_sent_total", "Frames written to the server.",
+       &metrics.frames_sent},
+      {"big_client_frames_received_total", "Frames read from the server.",
+       &metrics.frames_received},
+      {"big_client_bytes_sent_total", "Frame bytes written, headers included.",
+       &metrics.bytes_sent},
+      {"big_client_bytes_received_total",
+       "Frame bytes read, headers included.", &metrics.bytes_received},
+      {"big_client_messages_sent_total", "Chat messages sent.",
+       &metrics.messages_sent},
+      {"big_client_messages_received_total", "Chat messages delivered.",
+       &metrics.messages_received},
+      {"big_client_connects_total", "TCP connections established.",
+       &metrics.connects},
+      {"big_client_reconnects_total",
+       "Connection failures that scheduled a retry.", &metrics.reconnects},
+      {"big_client_events_dropped_total",
+       "Network events dropped because the ui fell behind.",
+       &metrics.events_dropped}};
+  size_t off = 0;
+
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+    off = put(out, size, off, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+              counters[i].name, counters[i].help, counters[i].name,
+              counters[i].name, LOAD(*counters[i].value));
+  }
+
+  off = put(out, size, off,
+            "# HELP big_client_responses_total Responses by status code.\n"
+            "# TYPE big_client_responses_total counter\n");
+  for (int code = 0; code < METRICS_STATUS_CODES; code++) {
+    unsigned long long n = LOAD(metrics.responses[code]);
+    const char *label = status_label(code);
+
+    // known codes always, so rate() has a series to work with
+    if (n > 0 || strcmp(label, "unknown") != 0) {
+      off = put(out, size, off,
+                "big_client_responses_total{code=\"0x%02X\",status=\"%s\"} "
+                "%llu\n",
+                code, label, n);
+    }
+  }
+
+  off = put(out, size, off,
+            "# HELP big_client_sessions Connections in each client state.\n"
+            "# TYPE big_client_sessions gauge\n");
+  for (int state = 0; state < METRICS_STATE_COUNT; state++) {
+    off = put(out, size, off, "big_client_sessions{state=\"%s\"} %d\n",
+              state_label(state),
+              atomic_load_explicit(&metrics.sessions[state],
+                                   memory_order_relaxed));
+  }
+
+  off = put(out, size, off,
+            "# HELP big_client_queue_depth Items waiting in the network "
+            "thread queues.\n"
+            "# TYPE big_client_queue_depth gauge\n"
+            "big_client_queue_depth{queue=\"commands\"} %u\n"
+            "big_client_queue_depth{queue=\"events\"} %u\n",
+            atomic_load_explicit(
+                &metrics.queue_depth[METRICS_QUEUE_NET_COMMANDS],
+                memory_order_relaxed),
+            atomic_load_explicit(&metrics.queue_depth[METRICS_QUEUE_NET_EVENTS],
+                                 memory_order_relaxed));
+
+  // buckets are cumulative in the exposition format
+  unsigned long long cumulative = 0;
+  off = put(out, size, off,
+            "# HELP big_client_rtt_seconds Request to response round trip.\n"
+            "# TYPE big_client_rtt_seconds histogram\n");
+  for (size_t b = 0; b < METRICS_RTT_BUCKETS; b++) {
+    cumulative += LOAD(metrics.rtt_buckets[b]);
+    if (b < METRICS_RTT_BUCKETS - 1) {
+      off = put(out, size, off,
+                "big_client_rtt_seconds_bucket{le=\"%g\"} %llu\n",
+                (double)rtt_bounds_us[b] / 1e6, cumulative);
+    } else {
+      off = put(out, size, off,
+                "big_client_rtt_seconds_bucket{le=\"+Inf\"} %llu\n",
+                cumulative);
+    }
+  }
+  off = put(out, size, off,
+            "big_client_rtt_seconds_sum %.6f\n"
+            "big_client_rtt_seconds_count %llu\n"
+            "# HELP big_client_rtt_last_seconds Most recent round trip.\n"
+            "# TYPE big_client_rtt_last_seconds gauge\n"
+            "big_client_rtt_last_seconds %.6f\n",
+            (double)LOAD(metrics.rtt_sum_us) / 1e6, LOAD(metrics.rtt_count),
+            (double)LOAD(metrics.rtt_last_us) / 1e6);
+
+  // put() stops at the first line that did not fit
+  return off >= size ? strlen(out) : off;
+}
+
+#undef LOAD
+
+static size_t put(char *out, size_t size, size_t off, const char *fmt, ...) {
+  va_list ap;
+
+  if (off >= size) {
+    return off;
+  }
+  va_start(ap, fmt);
+  int n = vsnprintf(out + off, size - off, fmt, ap);
+  va_end(ap);
+
+  // a truncated line is dropped rather than sent half written
+  if (n < 0 || (size_t)n >= size - off) {
+    out[off] = '\0';
+    return size;
+  }
+  return off + (size_t)n;
+}
+
+static const char *state_label(int state) {
+  switch (state) {
+  case STATE_DISCONNECTED:
+    return "disconnected";
+  case STATE_DISCOVERING:
+    return "discovering";
+  case STATE_CONNECTING_TO_SERVER:
+    return "connecting";
+  case STATE_AWAITING_USER_INFO:
+    return "logging_in";
+  case STATE_LOGGED_IN:
+    return "logged_in";
+  case STATE_MESSAGING:
+    return "messaging";
+  case STATE_EXITING:
+    return "exiting";
+  default:
+    return "unknown";
+  }
+}
+
+static const char *status_label(int status) {
+  switch (status) {
+  case STATUS_OK:
+    return "ok";
+  case STATUS_INVALID_VERSION:
+    return "invalid_version";
+  case STATUS_INVALID_TYPE:
+    return "invalid_type";
+  case STATUS_INVALID_SIZE:
+    return "invalid_size";
+  case STATUS_MALFORMED_REQUEST:
+    return "malformed_request";
+  case STATUS_INVALID_CREDENTIALS:
+    return "invalid_credentials";
+  case STATUS_NOT_FOUND:
+    return "not_found";
+  case STATUS_ALREADY_EXISTS:
+    return "already_exists";
+  case STATUS_NOT_REGISTERED:
+    return "not_registered";
+  case STATUS_FORBIDDEN:
+    return "forbidden";
+  case STATUS_NOT_CHANNEL_MEMBER:
+    return "not_channel_member";
+  case STATUS_INTERNAL_ERROR:
+    return "internal_error";
+  case STATUS_SERVICE_UNAVAILABLE:
+    return "service_unavailable";
+  case STATUS_RESOURCE_EXHAUSTED:
+    return "resource_exhausted";
+  case STATUS_MESSAGE_TOO_LARGE:
+    return "message_too_large";
+  case STATUS_TIMEOUT:
+    return "timeout";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,546 @@
+#include "net_thread.h"
+#include "capture.h"
+#include "frame.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+  #include <sys/eventfd.h>
+#endif
+
+enum
+{
+    RX_CHUNK = 4096
+};
+
+static int wakeup_open(net_wakeup *w);
+static void wakeup_close(net_wakeup *w);
+static void wakeup_notify(const net_wakeup *w);
+static void wakeup_drain(const net_wakeup *w);
+
+static void *net_thread_main(void *arg);
+static int net_connect(net_thread *nt);
+static void push_event(net_thread *nt, const net_event *evt);
+static void push_error(net_thread *nt, const char *msg);
+static void *finish(net_thread *nt);
+static int handle_commands(net_thread *nt);
+static int send_chat(net_thread *nt, const net_command *cmd);
+static int send_fetch(net_thread *nt);
+static int send_channel_info(net_thread *nt, uint8_t channel_id);
+static void note_request(net_thread *nt);
+static void handle_frame(net_thread *nt, const frame_decoder *dec);
+static void handle_members(net_thread *nt, const frame_decoder *dec);
+
+int net_thread_start(net_thread *nt, const client_context *ctx) {
+  memset(nt, 0, sizeof(*nt));
+  nt->sock_fd = -1;
+  nt->cmd_wake.read_fd = nt->cmd_wake.write_fd = -1;
+  nt->evt_wake.read_fd = nt->evt_wake.write_fd = -1;
+
+  nt->addr = ctx->addr;
+  nt->port = ctx->manager_port;
+  nt->channel_id = ctx->channel_id;
+  memcpy(nt->auth.username, ctx->username, sizeof(nt->auth.username));
+  memcpy(nt->auth.password, ctx->password, sizeof(nt->auth.password));
+  atomic_init(&nt->running, 1);
+  atomic_init(&nt->exited, 0);
+  atomic_init(&nt->events_dropped, 0);
+
+  if (spsc_queue_init(&nt->commands, NET_QUEUE_SLOTS, sizeof(net_command)) ==
+      -1) {
+    return -1;
+  }
+  if (spsc_queue_init(&nt->events, NET_QUEUE_SLOTS, sizeof(net_event)) ==
+      -1) {
+    spsc_queue_destroy(&nt->commands);
+    return -1;
+  }
+
+  if (wakeup_open(&nt->cmd_wake) == -1 || wakeup_open(&nt->evt_wake) == -1) {
+    wakeup_close(&nt->cmd_wake);
+    spsc_queue_destroy(&nt->events);
+    spsc_queue_destroy(&nt->commands);
+    return -1;
+  }
+
+  if (spawn_thread(&nt->thread, net_thread_main, nt) != 0) {
+    wakeup_close(&nt->evt_wake);
+    wakeup_close(&nt->cmd_wake);
+    spsc_queue_destroy(&nt->events);
+    spsc_queue_destroy(&nt->commands);
+    return -1;
+  }
+
+  return 0;
+}
+
+void net_thread_stop(net_thread *nt) {
+  net_command cmd = {0};
+
+  // ask nicely, then make sure the loop notices even if the queue was full
+  cmd.type = NET_CMD_SHUTDOWN;
+  net_thread_submit(nt, &cmd);
+  atomic_store(&nt->running, 0);
+  wakeup_notify(&nt->cmd_wake);
+
+  pthread_join(nt->thread, NULL);
+
+  wakeup_close(&nt->evt_wake);
+  wakeup_close(&nt->cmd_wake);
+  spsc_queue_destroy(&nt->events);
+  spsc_queue_destroy(&nt->commands);
+}
+
+int net_thread_submit(net_thread *nt, const net_command *cmd) {
+  if (spsc_queue_push(&nt->commands, cmd) == -1) {
+    return -1;
+  }
+  trace_record(TRACE_QUEUE_DEPTH, TRACE_QUEUE_NET_COMMANDS, 0, 0,
+               (uint32_t)spsc_queue_depth(&nt->commands));
+  metrics_set_queue(METRICS_QUEUE_NET_COMMANDS,
+                    spsc_queue_depth(&nt->commands));
+  wakeup_notify(&nt->cmd_wake);
+  return 0;
+}
+
+int net_thread_next_event(net_thread *nt, net_event *evt) {
+  if (spsc_queue_pop(&nt->events, evt) == -1) {
+    // exited is stored after the last push, look again once it is seen
+    if (!atomic_load_explicit(&nt->exited, memory_order_acquire) ||
+        spsc_queue_pop(&nt->events, evt) == -1) {
+      if (nt->disconnect_seen ||
+          !atomic_load_explicit(&nt->exited, memory_order_acquire)) {
+        return -1;
+      }
+      memset(evt, 0, sizeof(*evt));
+      evt->type = NET_EVT_DISCONNECTED;
+    }
+  }
+  if (evt->type == NET_EVT_DISCONNECTED) {
+    nt->disconnect_seen = 1;
+  }
+  metrics_set_queue(METRICS_QUEUE_NET_EVENTS, spsc_queue_depth(&nt->events));
+  return 0;
+}
+
+int net_thread_event_fd(const net_thread *nt) { return nt->evt_wake.read_fd; }
+
+void net_thread_clear_event_fd(const net_thread *nt) {
+  wakeup_drain(&nt->evt_wake);
+}
+
+static int wakeup_open(net_wakeup *w) {
+#ifdef __linux__
+  w->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  w->write_fd = w->read_fd;
+  return w->read_fd == -1 ? -1 : 0;
+#else
+  int fds[2];
+
+  if (pipe(fds) == -1) {
+    return -1;
+  }
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(fds[i], F_GETFL);
+    fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  w->read_fd = fds[0];
+  w->write_fd = fds[1];
+  return 0;
+#endif
+}
+
+static void wakeup_close(net_wakeup *w) {
+  if (w->write_fd >= 0 && w->write_fd != w->read_fd) {
+    close(w->write_fd);
+  }
+  if (w->read_fd >= 0) {
+    close(w->read_fd);
+  }
+  w->read_fd = w->write_fd = -1;
+}
+
+static void wakeup_notify(const net_wakeup *w) {
+  // EAGAIN means a wakeup is already pending, which is all we need
+#ifdef __linux__
+  uint64_t one = 1;
+  ssize_t n = write(w->write_fd, &one, sizeof(one));
+#else
+  uint8_t one = 1;
+  ssize_t n = write(w->write_fd, &one, sizeof(one));
+#endif
+  (void)n;
+}
+
+static void wakeup_drain(const net_wakeup *w) {
+  uint8_t junk[64];
+
+  while (read(w->read_fd, junk, sizeof(junk)) > 0) {
+#ifdef __linux__
+    break; // an eventfd read resets the counter in one go
+#endif
+  }
+}
+
+static void *net_thread_main(void *arg) {
+  net_thread *nt = arg;
+  net_event evt = {0};
+  uint8_t chunk[RX_CHUNK];
+  frame_decoder dec;
+  uint8_t *body = malloc(sizeof(big_get_message_t) + MESSAGE_MAX_LENGTH);
+
+  if (body == NULL) {
+    push_error(nt, "Out of memory in network thread.");
+    return finish(nt);
+  }
+  frame_decoder_init(&dec, body, sizeof(big_get_message_t) + MESSAGE_MAX_LENGTH);
+  clock_sync_init(&nt->clock);
+
+  if (net_connect(nt) == -1) {
+    free(body);
+    return finish(nt);
+  }
+
+  evt.type = NET_EVT_CONNECTED;
+  push_event(nt, &evt);
+
+  int64_t next_fetch = monotonic_ms();
+
+  while (atomic_load_explicit(&nt->running, memory_order_relaxed)) {
+    struct pollfd pfds[2] = {
+        {.fd = nt->sock_fd, .events = POLLIN, .revents = 0},
+        {.fd = nt->cmd_wake.read_fd, .events = POLLIN, .revents = 0}};
+    int64_t now = monotonic_ms();
+    int timeout = next_fetch > now ? (int)(next_fetch - now) : 0;
+
+    if (poll(pfds, 2, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      push_error(nt, "poll failed in network thread.");
+      break;
+    }
+
+    if (pfds[1].revents & POLLIN) {
+      wakeup_drain(&nt->cmd_wake);
+      if (handle_commands(nt) == -1) {
+        break;
+      }
+    }
+
+    if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(nt->sock_fd, chunk, sizeof(chunk));
+
+      if (n == 0) {
+        push_error(nt, "Server closed the connection.");
+        break;
+      }
+      if (n == -1) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+          continue;
+        }
+        push_error(nt, strerror(errno));
+        break;
+      }
+
+      // one read can carry several frames, or a fraction of one
+      size_t off = 0;
+      frame_result res = FRAME_NEED_MORE;
+      while (off < (size_t)n) {
+        size_t used = 0;
+        res = frame_decoder_push(&dec, chunk + off, (size_t)n - off, &used);
+        off += used;
+        if (res == FRAME_ERROR) {
+          break;
+        }
+        if (res == FRAME_COMPLETE) {
+          trace_record(TRACE_FRAME_RECEIVED, nt->sock_fd, dec.hdr.type,
+                       dec.hdr.status, dec.hdr.body);
+          metrics_frame_received(dec.hdr.status, dec.hdr.body);
+          capture_decoded(nt->sock_fd, &dec);
+          handle_frame(nt, &dec);
+          frame_decoder_reset(&dec);
+        }
+      }
+      if (res == FRAME_ERROR) {
+        push_error(nt, "Protocol Error: malformed frame from server.");
+        break;
+      }
+    }
+
+    if (monotonic_ms() >= next_fetch) {
+      if (!nt->fetch_outstanding && send_fetch(nt) == -1) {
+        push_error(nt, "Network Error: Failed to send fetch request.");
+        break;
+      }
+      // on a link slower than the interval, polling faster only queues
+      int64_t srtt = clock_sync_srtt_ms(&nt->clock, 0);
+      next_fetch = monotonic_ms() +
+                   (srtt > NET_FETCH_INTERVAL_MS ? srtt : NET_FETCH_INTERVAL_MS);
+    }
+  }
+
+  trace_record(TRACE_CLOSE, nt->sock_fd, 0, 0, 0);
+  capture_close(nt->sock_fd);
+  conn_id_close(nt->sock_fd);
+  close(nt->sock_fd);
+  nt->sock_fd = -1;
+  free(body);
+  return finish(nt);
+}
+
+static int net_connect(net_thread *nt) {
+  struct sockaddr_in *ipv4_ptr = (struct sockaddr_in *)&nt->addr;
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  nt->sock_fd = socket(nt->addr.ss_family, SOCK_STREAM, 0);
+  if (nt->sock_fd == -1) {
+    push_error(nt, strerror(errno));
+    return -1;
+  }
+
+  ipv4_ptr->sin_port = htons(nt->port);
+  if (connect(nt->sock_fd, (struct sockaddr *)ipv4_ptr,
+              sizeof(struct sockaddr_in)) == -1) {
+    push_error(nt, strerror(errno));
+    close(nt->sock_fd);
+    nt->sock_fd = -1;
+    return -1;
+  }
+
+  conn_id_open(nt->sock_fd);
+  trace_record(TRACE_CONNECT, nt->sock_fd, 0, 0, nt->port);
+  capture_connect(nt->sock_fd);
+  metrics_add(&metrics.connects, 1);
+
+  // reads are driven by poll, writes fall back to poll on EAGAIN
+  int flags = fcntl(nt->sock_fd, F_GETFL);
+  fcntl(nt->sock_fd, F_SETFL, flags | O_NONBLOCK);
+  return 0;
+}
+
+static void push_event(net_thread *nt, const net_event *evt) {
+  // never wait on the ui: if it has fallen this far behind, drop and count
+  if (spsc_queue_push(&nt->events, evt) == -1) {
+    atomic_fetch_add_explicit(&nt->events_dropped, 1, memory_order_relaxed);
+    metrics_add(&metrics.events_dropped, 1);
+    return;
+  }
+  trace_record(TRACE_QUEUE_DEPTH, TRACE_QUEUE_NET_EVENTS, 0, 0,
+               (uint32_t)spsc_queue_depth(&nt->events));
+  metrics_set_queue(METRICS_QUEUE_NET_EVENTS, spsc_queue_depth(&nt->events));
+  wakeup_notify(&nt->evt_wake);
+}
+
+static void push_error(net_thread *nt, const char *msg) {
+  net_event evt = {0};
+
+  evt.type = NET_EVT_ERROR;
+  snprintf(evt.text, sizeof(evt.text), "%s", msg);
+  evt.length = (uint16_t)strlen(evt.text);
+  push_event(nt, &evt);
+}
+
+// the ui must hear about this even with a full queue: push_event may drop
+// it, so also raise exited and always poke the wakeup fd
+static void *finish(net_thread *nt) {
+  net_event evt = {0};
+
+  evt.type = NET_EVT_DISCONNECTED;
+  push_event(nt, &evt);
+  atomic_store_explicit(&nt->exited, 1, memory_order_release);
+  wakeup_notify(&nt->evt_wake);
+  return NULL;
+}
+
+static int handle_commands(net_thread *nt) {
+  net_command cmd;
+
+  while (spsc_queue_pop(&nt->commands, &cmd) == 0) {
+    metrics_set_queue(METRICS_QUEUE_NET_COMMANDS,
+                      spsc_queue_depth(&nt->commands));
+    switch (cmd.type) {
+    case NET_CMD_SEND_MESSAGE:
+      if (send_chat(nt, &cmd) == -1) {
+        push_error(nt, "Network Error: Failed to send message.");
+        return -1;
+      }
+      break;
+    case NET_CMD_FETCH:
+      if (send_fetch(nt) == -1) {
+        push_error(nt, "Network Error: Failed to send fetch request.");
+        return -1;
+      }
+      break;
+    case NET_CMD_JOIN:
+      nt->channel_id = cmd.channel_id;
+      nt->last_timestamp = 0;
+      break;
+    case NET_CMD_CHANNEL_INFO:
+      if (send_channel_info(nt, cmd.channel_id) == -1) {
+        push_error(nt, "Network Error: Failed to send channel info request.");
+        return -1;
+      }
+      break;
+    case NET_CMD_SHUTDOWN:
+    default:
+      atomic_store(&nt->running, 0);
+      return 0;
+    }
+  }
+  return 0;
+}
+
+static int send_chat(net_thread *nt, const net_command *cmd) {
+  uint8_t buf[sizeof(big_send_message_t) + NET_TEXT_LENGTH];
+  big_send_message_t *body = (big_send_message_t *)buf;
+  uint16_t len = cmd->length < NET_TEXT_LENGTH ? cmd->length : NET_TEXT_LENGTH;
+
+  frame_send_message_body(body, &nt->auth, clock_sync_stamp(&nt->clock),
+                          nt->channel_id, len);
+  memcpy(buf + sizeof(*body), cmd->text, len);
+
+  if (frame_send(nt->sock_fd, TYPE_SEND_MESSAGE_REQUEST, 0, buf,
+                 (uint32_t)(sizeof(*body) + len)) == -1) {
+    return -1;
+  }
+  note_request(nt);
+  return 0;
+}
+
+// ask for anything newer than the last message we have seen
+static int send_fetch(net_thread *nt) {
+  big_get_message_t body;
+
+  frame_get_message_body(&body, &nt->auth, nt->last_timestamp,
+                         nt->channel_id);
+  if (frame_send(nt->sock_fd, TYPE_GET_MESSAGE_REQUEST, 0, &body,
+                 sizeof(body)) == -1) {
+    return -1;
+  }
+  note_request(nt);
+  nt->fetch_outstanding = 1;
+  return 0;
+}
+
+// the closest thing the protocol has to a user lookup: who is in a channel
+static int send_channel_info(net_thread *nt, uint8_t channel_id) {
+  big_channel_info_t body;
+
+  memset(&body, 0, sizeof(body));
+  body.authentication = nt->auth;
+  body.channel_id = channel_id;
+  body.user_id_length = 0;
+
+  if (frame_send(nt->sock_fd, TYPE_GET_CHANNEL_INFO_REQUEST, 0, &body,
+                 sizeof(body)) == -1) {
+    return -1;
+  }
+  note_request(nt);
+  return 0;
+}
+
+static void note_request(net_thread *nt) {
+  nt->in_flight++;
+  nt->sent_ns = monotonic_ns();
+}
+
+static void handle_frame(net_thread *nt, const frame_decoder *dec) {
+  net_event evt = {0};
+
+  evt.msg_type = dec->hdr.type;
+  evt.status = dec->hdr.status;
+
+  // responses come back in order, so with one request in flight this is
+  // the answer to the newest send
+  if (nt->in_flight == 1) {
+    int64_t received_ns = monotonic_ns();
+    uint64_t stamp = clock_sync_stamp_of(&nt->clock, dec);
+
+    metrics_rtt(received_ns - nt->sent_ns);
+    if (stamp != 0) {
+      clock_sync_server_time(&nt->clock, nt->sent_ns, received_ns, stamp);
+    } else {
+      clock_sync_rtt(&nt->clock, received_ns - nt->sent_ns);
+    }
+  }
+  if (nt->in_flight > 0) {
+    nt->in_flight--;
+  }
+
+  if (dec->hdr.type == TYPE_GET_CHANNEL_INFO_RESPONSE &&
+      dec->hdr.status == STATUS_OK) {
+    handle_members(nt, dec);
+    return;
+  }
+
+  if (dec->hdr.type != TYPE_GET_MESSAGE_RESPONSE) {
+    evt.type = NET_EVT_RESPONSE;
+    push_event(nt, &evt);
+    return;
+  }
+
+  nt->fetch_outstanding = 0;
+  if (dec->hdr.status != STATUS_OK ||
+      frame_validate_body(&dec->hdr, dec->body, dec->body_have) !=
+          STATUS_OK) {
+    return;
+  }
+
+  big_get_message_t msg;
+  memcpy(&msg, dec->body, sizeof(msg));
+
+  size_t text_len = ntohs(msg.message_length);
+  size_t avail = dec->body_have - sizeof(msg);
+  if (text_len > avail) {
+    text_len = avail;
+  }
+  if (text_len == 0) {
+    return;
+  }
+  if (text_len > NET_TEXT_LENGTH - 1) {
+    text_len = NET_TEXT_LENGTH - 1;
+  }
+
+  evt.type = NET_EVT_MESSAGE;
+  evt.channel_id = msg.channel_id;
+  evt.sender_id = msg.sender_id;
+  evt.timestamp = frame_ntoh64(msg.timestamp);
+  evt.length = (uint16_t)text_len;
+  memcpy(evt.text, dec->body + sizeof(msg), text_len);
+  metrics_add(&metrics.messages_received, 1);
+
+  if (evt.timestamp > nt->last_timestamp) {
+    nt->last_timestamp = evt.timestamp;
+  }
+  push_event(nt, &evt);
+}
+
+static void handle_members(net_thread *nt, const frame_decoder *dec) {
+  net_event evt = {0};
+  big_channel_info_t info;
+
+  if (frame_validate_body(&dec->hdr, dec->body, dec->body_have) !=
+      STATUS_OK) {
+    push_error(nt, "Protocol Error: malformed channel info.");
+    return;
+  }
+  memcpy(&info, dec->body, sizeof(info));
+
+  // at most 255 ids, always fits
+  evt.type = NET_EVT_MEMBERS;
+  evt.msg_type = dec->hdr.type;
+  evt.channel_id = info.channel_id;
+  evt.length = info.user_id_length;
+  memcpy(evt.text, dec->body + sizeof(info), info.user_id_length);
+  push_event(nt, &evt);
+}
@@ -1,6 +1,10 @@
 #include "network_funcs.h"
+#include "capture.h"
 #include "client.h"
+#include "frame.h"
+#include "metrics.h"
 #include "protocol.h"
+#include "trace.h"
 #include "utils.h"
 #include <arpa/inet.h>
 #include <errno.h>
@@ -12,6 +16,9 @@
 // helper for fatal errors
 static void fatal_error(client_context *ctx, char *msg);
 
+// every phase drops its connection the same way
+static void close_active_socket(client_context *ctx);
+
 // these two for network_execute_discovery
 static void send_discovery_request(client_context *ctx);
 static void recv_discovery_response(client_context *ctx,
@@ -21,6 +28,9 @@ static void recv_discovery_response(client_context *ctx,
 static void send_account_creation_request(client_context *ctx);
 static void recv_account_creation_response(client_context *ctx);
 
+// the wire form of ctx's username and password
+static void context_auth(const client_context *ctx, big_auth_t *auth);
+
 // helpers for login/logout
 static void send_login_logout_request(client_context *ctx, uint8_t status_flag);
 static void recv_login_logout_response(client_context *ctx);
@@ -76,9 +86,21 @@ void socket_connect(client_context *ctx, uint16_t port) {
     fatal_error(ctx, "Fatal: Could not connect to server.\n");
   }
 
+  conn_id_open(ctx->active_sock_fd);
+  trace_record(TRACE_CONNECT, ctx->active_sock_fd, 0, 0, port);
+  capture_connect(ctx->active_sock_fd);
+  metrics_add(&metrics.connects, 1);
   printf("Successfully connected to: %s:%u\n", addr_str, port);
 }
 
+static void close_active_socket(client_context *ctx) {
+  trace_record(TRACE_CLOSE, ctx->active_sock_fd, 0, 0, 0);
+  capture_close(ctx->active_sock_fd);
+  conn_id_close(ctx->active_sock_fd);
+  close(ctx->active_sock_fd);
+  ctx->active_sock_fd = -1;
+}
+
 void network_execute_discovery(client_context *ctx) {
   printf("\n--- Phase 1: Server Discovery ---\n");
 
@@ -119,11 +141,10 @@ void network_execute_discovery(client_context *ctx) {
   snprintf(ctx->manager_ip, sizeof(ctx->manager_ip), "%s", node_ip_str);
 
   // clean up manager socket
-  close(ctx->active_sock_fd);
-  ctx->active_sock_fd = -1;
+  close_active_socket(ctx);
 
   // update the state
-  ctx->state = STATE_AWAITING_USER_INFO;
+  client_set_state(ctx, STATE_AWAITING_USER_INFO);
 }
 
 void network_execute_account_creation(client_context *ctx) {
@@ -147,8 +168,7 @@ void network_execute_account_creation(client_context *ctx) {
 
   // cleanup (We close after transaction, or keep open?)
   //  close it to for now
-  close(ctx->active_sock_fd);
-  ctx->active_sock_fd = -1;
+  close_active_socket(ctx);
 
   printf("Registration Successful. Account created.\n");
 }
@@ -167,14 +187,13 @@ void network_execute_login(client_context *ctx) {
   recv_login_logout_response(ctx);
 
   // cleanup connection
-  close(ctx->active_sock_fd);
-  ctx->active_sock_fd = -1;
+  close_active_socket(ctx);
 
   printf("Login Successful.\n");
 }
 
 void network_execute_logout(client_context *ctx) {
-  printf("\n--- Phase 4: Logout ---\n");
+  printf("\n--- Phase 5: Logout ---\n");
 
   if (convert_address(ctx) != 0) {
     fatal_error(ctx, "Invalid Server IP format.\n");
@@ -187,8 +206,7 @@ void network_execute_logout(client_context *ctx) {
   recv_login_logout_response(ctx);
 
   // cleanup connection
-  close(ctx->active_sock_fd);
-  ctx->active_sock_fd = -1;
+  close_active_socket(ctx);
 
   printf("Logout Successful.\n");
 }
@@ -198,38 +216,29 @@ void network_execute_logout(client_context *ctx) {
 static void send_discovery_request(client_context *ctx) {
   big_discovery_res_t body = {0};
 
-  big_header_t req = {.version = BIG_CHAT_VERSION,
-                      .type = TYPE_DISCOVERY_REQUEST,
-                      .status = 0,
-                      .reserved = 0,
-                      .body = htonl(sizeof(body))};
-
-  // send header
-  if (send(ctx->active_sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
+  // header and body together, a short send is retried rather than fatal
+  if (frame_send(ctx->active_sock_fd, TYPE_DISCOVERY_REQUEST, 0, &body,
+                 sizeof(body)) == -1) {
     perror("send");
     fatal_error(ctx, "Network Error: Failed to send discovery request.\n");
   }
-  // send body
-  if (send(ctx->active_sock_fd, &body, sizeof(body), 0) != sizeof(body)) {
-    perror("send");
-    fatal_error(ctx, "Network Error: Failed to send discovery body.\n");
-  }
 }
 
 static void recv_discovery_response(client_context *ctx,
                                     big_discovery_res_t *dest) {
   big_header_t hdr;
 
-  // read header
-  ssize_t recvd = recv(ctx->active_sock_fd, &hdr, sizeof(hdr), MSG_WAITALL);
-
-  if (recvd == 0) {
-    fatal_error(ctx, "Server closed connection unexpectedly.\n");
-  }
-
-  if (recvd != sizeof(hdr)) {
+  // read header. MSG_WAITALL can still come back short when a signal lands,
+  // frame_read_all keeps going until the whole thing is in
+  if (frame_read_all(ctx->active_sock_fd, &hdr, sizeof(hdr)) == -1) {
+    if (errno == ECONNRESET) {
+      fatal_error(ctx, "Server closed connection unexpectedly.\n");
+    }
     fatal_error(ctx, "Failed to receive protocol header.\n");
   }
+  trace_record(TRACE_FRAME_RECEIVED, ctx->active_sock_fd, hdr.type, hdr.status,
+               ntohl(hdr.body));
+  metrics_frame_received(hdr.status, ntohl(hdr.body));
 
   // validate packet
   if (hdr.type != TYPE_DISCOVERY_RESPONSE) {
@@ -252,56 +261,38 @@ static void recv_discovery_response(client_context *ctx,
   }
 
   // read body into dest
-  recvd =
-      recv(ctx->active_sock_fd, dest, sizeof(big_discovery_res_t), MSG_WAITALL);
-
-  if (recvd != sizeof(big_discovery_res_t)) {
+  if (frame_read_all(ctx->active_sock_fd, dest, sizeof(*dest)) == -1) {
     fatal_error(ctx, "Failed to receive discovery body.\n");
   }
+  capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, dest,
+                sizeof(*dest));
 }
 
 static void send_account_creation_request(client_context *ctx) {
-  big_create_account_req_t body = {0};
-
-  strncpy(body.authentication.username, ctx->username,
-          sizeof(body.authentication.username));
-  strncpy(body.authentication.password, ctx->password,
-          sizeof(body.authentication.password));
-
-  body.client_id = 0; // 0 for new account?
-  // body.status = 0x01; // as per protocol // DG: disabling for now
-
-  big_header_t req = {
-      .version = BIG_CHAT_VERSION,
-      .type = TYPE_ACCOUNT_CREATE_REQUEST,
-      .status = 0,
-      .reserved = 0,
-      .body = htonl(sizeof(body)) // worry about endianness i think
-  };
-
-  // send header
-  if (send(ctx->active_sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-    fatal_error(ctx, "Network Error: Failed to send register header.\n");
-  }
+  big_create_account_req_t body;
+  big_auth_t auth;
+
+  context_auth(ctx, &auth);
+  frame_create_account_body(&body, &auth);
 
-  // send body
-  if (send(ctx->active_sock_fd, &body, sizeof(body), 0) != sizeof(body)) {
-    fatal_error(ctx, "Network Error: Failed to send register body.\n");
+  if (frame_send(ctx->active_sock_fd, TYPE_ACCOUNT_CREATE_REQUEST, 0, &body,
+                 sizeof(body)) == -1) {
+    fatal_error(ctx, "Network Error: Failed to send register request.\n");
   }
 }
 
 static void recv_account_creation_response(client_context *ctx) {
   big_header_t hdr;
 
-  ssize_t recvd = recv(ctx->active_sock_fd, &hdr, sizeof(hdr), MSG_WAITALL);
-
-  if (recvd <= 0) {
-    fatal_error(ctx, "Server disconnected during registration.\n");
-  }
-
-  if (recvd != sizeof(hdr)) {
+  if (frame_read_all(ctx->active_sock_fd, &hdr, sizeof(hdr)) == -1) {
+    if (errno == ECONNRESET) {
+      fatal_error(ctx, "Server disconnected during registration.\n");
+    }
     fatal_error(ctx, "Incomplete register response.\n");
   }
+  trace_record(TRACE_FRAME_RECEIVED, ctx->active_sock_fd, hdr.type, hdr.status,
+               ntohl(hdr.body));
+  metrics_frame_received(hdr.status, ntohl(hdr.body));
 
   if (hdr.type != TYPE_ACCOUNT_CREATE_RESPONSE) {
     fatal_error(ctx, "Protocol Error: Unexpected response type.\n");
@@ -332,13 +323,13 @@ static void recv_account_creation_response(client_context *ctx) {
   if (bsize == sizeof(big_create_account_req_t)) {
     big_create_account_req_t resp_body;
 
-    ssize_t recvd_body =
-        recv(ctx->active_sock_fd, &resp_body, sizeof(resp_body), MSG_WAITALL);
-
-    if (recvd_body != (ssize_t)sizeof(resp_body)) {
+    if (frame_read_all(ctx->active_sock_fd, &resp_body, sizeof(resp_body)) ==
+        -1) {
       fatal_error(ctx, "Failed to read registration response body.\n");
     }
 
+    capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, &resp_body,
+                  sizeof(resp_body));
     ctx->account_id = resp_body.client_id;
     printf("Assigned account ID: %u\n", ctx->account_id);
 
@@ -350,19 +341,24 @@ static void recv_account_creation_response(client_context *ctx) {
       return;
     }
 
-    // Cast bsize to size_t to match the function signature exactly
-    ssize_t recvd_body =
-        recv(ctx->active_sock_fd, junk, (size_t)bsize, MSG_WAITALL);
-
-    if (recvd_body != (ssize_t)bsize) {
+    if (frame_read_all(ctx->active_sock_fd, junk, (size_t)bsize) == -1) {
       free(junk);
       fatal_error(ctx, "Failed to read response body.\n");
       return;
     }
+    capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, junk, bsize);
     free(junk);
+  } else {
+    capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, NULL, 0);
   }
 }
 
+static void context_auth(const client_context *ctx, big_auth_t *auth) {
+  memset(auth, 0, sizeof(*auth));
+  strncpy(auth->username, ctx->username, sizeof(auth->username));
+  strncpy(auth->password, ctx->password, sizeof(auth->password));
+}
+
 static void fatal_error(client_context *ctx, char *msg) {
   ctx->exit_code = EXIT_FAILURE;
   ctx->exit_message = msg;
@@ -372,42 +368,18 @@ static void fatal_error(client_context *ctx, char *msg) {
 // get actual client IP from the connected socket
 static void send_login_logout_request(client_context *ctx,
                                       uint8_t status_flag) {
-  big_login_logout_req_t body = {0};
-
-  strncpy(body.authentication.username, ctx->username, USERNAME_LENGTH);
-  strncpy(body.authentication.password, ctx->password, PASSWORD_LENGTH);
-  body.status = status_flag;
+  big_login_logout_req_t body;
+  big_auth_t auth;
 
-  // strncpy(body.password, ctx->password,
-  //         sizeof(body.password)); // fix this retard @DSG
-  // body.account_id = ctx->account_id;
-  // body.status = status_flag;
-
-  struct sockaddr_in local_addr;
-  socklen_t addr_len = sizeof(local_addr);
-  if (getsockname(ctx->active_sock_fd, (struct sockaddr *)&local_addr,
-                  &addr_len) == -1) {
+  context_auth(ctx, &auth);
+  if (frame_login_logout_body(&body, &auth, ctx->active_sock_fd,
+                              status_flag) == -1) {
     fatal_error(ctx, "Failed to get local socket address.\n");
   }
 
-  memcpy(&body.client_ip, &local_addr.sin_addr.s_addr, sizeof(ipv4_address_t));
-
-  // body.client_ip = local_addr.sin_addr.s_addr; // already network byte order
-
-  big_header_t req = {.version = BIG_CHAT_VERSION,
-                      .type = TYPE_LOGIN_OR_LOGOUT_REQUEST,
-                      .status = 0,
-                      .reserved = 0,
-                      .body = htonl(sizeof(body))};
-
-  // send header
-  if (send(ctx->active_sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-    fatal_error(ctx, "Network Error: Failed to send login header.\n");
-  }
-
-  // send body
-  if (send(ctx->active_sock_fd, &body, sizeof(body), 0) != sizeof(body)) {
-    fatal_error(ctx, "Network Error: Failed to send login body.\n");
+  if (frame_send(ctx->active_sock_fd, TYPE_LOGIN_OR_LOGOUT_REQUEST, 0, &body,
+                 sizeof(body)) == -1) {
+    fatal_error(ctx, "Network Error: Failed to send login request.\n");
   }
 }
 
@@ -415,15 +387,15 @@ static void send_login_logout_request(client_context *ctx,
 static void recv_login_logout_response(client_context *ctx) {
   big_header_t hdr;
 
-  ssize_t recvd = recv(ctx->active_sock_fd, &hdr, sizeof(hdr), MSG_WAITALL);
-
-  if (recvd <= 0) {
-    fatal_error(ctx, "Server disconnected during login.\n");
-  }
-
-  if (recvd != sizeof(hdr)) {
+  if (frame_read_all(ctx->active_sock_fd, &hdr, sizeof(hdr)) == -1) {
+    if (errno == ECONNRESET) {
+      fatal_error(ctx, "Server disconnected during login.\n");
+    }
     fatal_error(ctx, "Incomplete login response.\n");
   }
+  trace_record(TRACE_FRAME_RECEIVED, ctx->active_sock_fd, hdr.type, hdr.status,
+               ntohl(hdr.body));
+  metrics_frame_received(hdr.status, ntohl(hdr.body));
 
   if (hdr.type != TYPE_LOGIN_OR_LOGOUT_RESPONSE) {
     fatal_error(ctx, "Protocol Error: Unexpected response type.\n");
@@ -444,14 +416,14 @@ static void recv_login_logout_response(client_context *ctx) {
       return;
     }
 
-    ssize_t recvd_body =
-        recv(ctx->active_sock_fd, junk, (size_t)bsize, MSG_WAITALL);
-
-    if (recvd_body != (ssize_t)bsize) {
+    if (frame_read_all(ctx->active_sock_fd, junk, (size_t)bsize) == -1) {
       free(junk);
       fatal_error(ctx, "Failed to read login response body.\n");
       return;
     }
+    capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, junk, bsize);
     free(junk);
+  } else {
+    capture_frame(CAPTURE_RECEIVED, ctx->active_sock_fd, &hdr, NULL, 0);
   }
 }
@@ -0,0 +1,379 @@
+#include "render.h"
+#include "frame.h"
+#include "utils.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+enum
+{
+    RENDER_INITIAL_BUFFER = 16384,
+    RENDER_FALLBACK_ROWS = 24,
+    RENDER_FALLBACK_COLS = 80
+};
+
+static int buffer_reserve(render_buffer *b, size_t extra);
+static void buffer_append(render_buffer *b, const char *s, size_t len);
+static void buffer_appendf(render_buffer *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void query_size(renderer *r);
+static uint64_t line_hash(const char *s, size_t len);
+static size_t format_entry(renderer *r, const history_entry *e, char *dest,
+                           size_t size);
+static void draw_row(renderer *r, int row, const char *s, size_t len,
+                     int reverse);
+static void scroll_timeline(renderer *r, int timeline_rows, uint64_t end);
+static void build_tty_frame(renderer *r);
+static void build_line_frame(renderer *r);
+static int draw_frame(renderer *r);
+
+int render_init(renderer *r, int fd, const history_store *history, int fps) {
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+  r->is_tty = isatty(fd);
+  r->history = history;
+  r->min_frame_ms = fps > 0 ? 1000 / fps : 0;
+  r->last_frame_ms = 0;
+  r->drawn_seq = history_first_seq(history);
+  r->full_redraw = 1;
+
+  if (buffer_reserve(&r->out, RENDER_INITIAL_BUFFER) == -1) {
+    return -1;
+  }
+  query_size(r);
+  return 0;
+}
+
+void render_destroy(renderer *r) {
+  if (r->is_tty) {
+    // leave the cursor below everything we drew
+    r->out.len = 0;
+    buffer_appendf(&r->out, "\x1b[%d;1H\r\n", r->rows);
+    frame_write_all(r->fd, r->out.data, r->out.len);
+  }
+  free(r->out.data);
+  r->out.data = NULL;
+}
+
+void render_set_status(renderer *r, const char *fmt, ...) {
+  char next[RENDER_LINE_LENGTH];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(next, sizeof(next), fmt, args);
+  va_end(args);
+
+  if (strcmp(next, r->status) != 0) {
+    memcpy(r->status, next, sizeof(next));
+    r->dirty = 1;
+  }
+}
+
+void render_set_status_detail(renderer *r, const char *fmt, ...) {
+  char next[RENDER_DETAIL_LENGTH];
+  va_list args;
+
+  va_start(args, fmt);
+  vsnprintf(next, sizeof(next), fmt, args);
+  va_end(args);
+
+  if (strcmp(next, r->status_detail) != 0) {
+    memcpy(r->status_detail, next, sizeof(next));
+    // nothing to redraw where it is not shown
+    r->dirty |= r->is_tty;
+  }
+}
+
+void render_set_prompt(renderer *r, const char *prompt) {
+  if (strcmp(prompt, r->prompt) != 0) {
+    snprintf(r->prompt, sizeof(r->prompt), "%s", prompt);
+    r->dirty = 1;
+  }
+}
+
+void render_set_users(renderer *r, user_directory *users) {
+  r->users = users;
+  r->dirty = 1;
+}
+
+void render_mark_dirty(renderer *r) { r->dirty = 1; }
+
+void render_invalidate(renderer *r) {
+  r->full_redraw = 1;
+  r->dirty = 1;
+}
+
+int render_timeout_ms(const renderer *r) {
+  if (!r->dirty) {
+    return -1;
+  }
+
+  int64_t wait = r->last_frame_ms + r->min_frame_ms - monotonic_ms();
+  return wait > 0 ? (int)wait : 0;
+}
+
+int render_flush(renderer *r) {
+  if (render_timeout_ms(r) != 0) {
+    return 0;
+  }
+  return draw_frame(r);
+}
+
+int render_flush_now(renderer *r) { return r->dirty ? draw_frame(r) : 0; }
+
+static int draw_frame(renderer *r) {
+  r->out.len = 0;
+  if (r->is_tty) {
+    build_tty_frame(r);
+  } else {
+    build_line_frame(r);
+  }
+
+  r->dirty = 0;
+  r->last_frame_ms = monotonic_ms();
+
+  // the whole frame in one syscall
+  if (r->out.len > 0 && frame_write_all(r->fd, r->out.data, r->out.len) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+static void build_tty_frame(renderer *r) {
+  char line[RENDER_LINE_LENGTH];
+  int timeline_rows = r->rows - 2;
+
+  if (r->full_redraw) {
+    query_size(r);
+    timeline_rows = r->rows - 2;
+    memset(r->drawn, 0, sizeof(r->drawn));
+    buffer_append(&r->out, "\x1b[2J", strlen("\x1b[2J"));
+  } else {
+    // keep the cursor where the user is typing
+    buffer_append(&r->out, "\x1b" "7", 2);
+  }
+
+  char status[sizeof(r->status) + sizeof(r->status_detail) + 3];
+  snprintf(status, sizeof(status), "%s%s%s", r->status,
+           r->status_detail[0] ? " | " : "", r->status_detail);
+  draw_row(r, 1, status, strlen(status), 1);
+
+  // newest message sits just above the input row
+  uint64_t first = history_first_seq(r->history);
+  uint64_t end = r->history->next_seq;
+  if (!r->full_redraw) {
+    scroll_timeline(r, timeline_rows, end);
+  }
+  r->drawn_seq = end;
+  uint64_t start = end - first > (uint64_t)timeline_rows
+                       ? end - (uint64_t)timeline_rows
+                       : first;
+  int row = 2 + timeline_rows - (int)(end - start);
+
+  for (int i = 2; i < row; i++) {
+    draw_row(r, i, "", 0, 0);
+  }
+  for (uint64_t seq = start; seq < end; seq++, row++) {
+    size_t len =
+        format_entry(r, history_at(r->history, seq), line, sizeof(line));
+    draw_row(r, row, line, len, 0);
+  }
+
+  draw_row(r, r->rows, r->prompt, strlen(r->prompt), 0);
+
+  if (r->full_redraw) {
+    buffer_appendf(&r->out, "\x1b[%d;%zuH", r->rows, strlen(r->prompt) + 1);
+    r->full_redraw = 0;
+  } else {
+    buffer_append(&r->out, "\x1b" "8", 2);
+  }
+}
+
+// new rows push the timeline up: let the terminal scroll its region so only
+// the new rows have to be written out
+static void scroll_timeline(renderer *r, int timeline_rows, uint64_t end) {
+  uint64_t added = end - r->drawn_seq;
+
+  if (added == 0 || added >= (uint64_t)timeline_rows) {
+    return;
+  }
+
+  int n = (int)added;
+  buffer_appendf(&r->out, "\x1b[2;%dr\x1b[%dS\x1b[r", r->rows - 1, n);
+
+  // what was on row i + n is now on row i
+  for (int row = 2; row <= r->rows - 1; row++) {
+    r->drawn[row] = row + n <= r->rows - 1 ? r->drawn[row + n] : 0;
+  }
+}
+
+static void build_line_frame(renderer *r) {
+  char line[RENDER_LINE_LENGTH];
+  uint64_t first = history_first_seq(r->history);
+
+  if (r->drawn_seq < first) {
+    r->drawn_seq = first;
+  }
+
+  uint64_t h = line_hash(r->status, strlen(r->status));
+  if (h != r->drawn[0]) {
+    buffer_appendf(&r->out, "-- %s --\n", r->status);
+    r->drawn[0] = h;
+  }
+
+  for (; r->drawn_seq < r->history->next_seq; r->drawn_seq++) {
+    size_t len =
+        format_entry(r, history_at(r->history, r->drawn_seq), line,
+                     sizeof(line));
+    buffer_append(&r->out, line, len);
+    buffer_append(&r->out, "\n", 1);
+  }
+  r->full_redraw = 0;
+}
+
+// rewrite a screen row only when its content differs from the last frame
+static void draw_row(renderer *r, int row, const char *s, size_t len,
+                     int reverse) {
+  if (row < 1 || row > r->rows || row >= RENDER_MAX_ROWS) {
+    return;
+  }
+  if (len > (size_t)r->cols) {
+    len = (size_t)r->cols;
+  }
+
+  // reverse is folded in so a style change alone still redraws
+  uint64_t h = line_hash(s, len) ^ (uint64_t)reverse;
+  if (h == 0) {
+    h = 1; // 0 means "unknown"
+  }
+  if (r->drawn[row] == h) {
+    return;
+  }
+  r->drawn[row] = h;
+
+  buffer_appendf(&r->out, "\x1b[%d;1H", row);
+  if (reverse) {
+    buffer_append(&r->out, "\x1b[7m", strlen("\x1b[7m"));
+  }
+  buffer_append(&r->out, s, len);
+  buffer_append(&r->out, "\x1b[K", strlen("\x1b[K"));
+  if (reverse) {
+    buffer_append(&r->out, "\x1b[0m", strlen("\x1b[0m"));
+  }
+}
+
+static size_t format_entry(renderer *r, const history_entry *e, char *dest,
+                           size_t size) {
+  const char *name = NULL;
+  const char *where = "";
+  int n;
+
+  if (e == NULL) {
+    dest[0] = '\0';
+    return 0;
+  }
+
+  if (r->users != NULL) {
+    name = user_directory_lookup(r->users, e->sender_id, monotonic_ms());
+
+    // without a name, say at least whether they are still around
+    switch (user_directory_state(r->users, e->sender_id)) {
+    case USER_MEMBER:
+      where = " (here)";
+      break;
+    case USER_ABSENT:
+      where = " (gone)";
+      break;
+    default:
+      break;
+    }
+  }
+  if (name != NULL) {
+    n = snprintf(dest, size, "[#%u] %s: %.*s", e->channel_id, name,
+                 (int)e->length, e->text);
+  } else {
+    n = snprintf(dest, size, "[#%u] user %u%s: %.*s", e->channel_id,
+                 e->sender_id, where, (int)e->length, e->text);
+  }
+  if (n < 0) {
+    dest[0] = '\0';
+    return 0;
+  }
+
+  // text comes from other users: no escape sequences reach the terminal,
+  // and no line break splits an entry over two rows
+  size_t len = (size_t)n < size ? (size_t)n : size - 1;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)dest[i];
+    if (c < 0x20 || c == 0x7f) {
+      dest[i] = '?';
+    }
+  }
+  return len;
+}
+
+static void query_size(renderer *r) {
+  struct winsize ws;
+
+  r->rows = RENDER_FALLBACK_ROWS;
+  r->cols = RENDER_FALLBACK_COLS;
+  if (r->is_tty && ioctl(r->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 &&
+      ws.ws_col > 0) {
+    r->rows = ws.ws_row < RENDER_MAX_ROWS ? ws.ws_row : RENDER_MAX_ROWS - 1;
+    r->cols = ws.ws_col;
+  }
+}
+
+// FNV-1a, good enough to tell two rows apart
+static uint64_t line_hash(const char *s, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int buffer_reserve(render_buffer *b, size_t extra) {
+  if (b->len + extra <= b->cap) {
+    return 0;
+  }
+
+  size_t cap = b->cap ? b->cap : RENDER_INITIAL_BUFFER;
+  while (cap < b->len + extra) {
+    cap *= 2;
+  }
+
+  char *p = realloc(b->data, cap);
+  if (p == NULL) {
+    return -1;
+  }
+  b->data = p;
+  b->cap = cap;
+  return 0;
+}
+
+static void buffer_append(render_buffer *b, const char *s, size_t len) {
+  if (buffer_reserve(b, len) == -1) {
+    return;
+  }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+}
+
+static void buffer_appendf(render_buffer *b, const char *fmt, ...) {
+  char tmp[RENDER_LINE_LENGTH + 32];
+  va_list args;
+
+  va_start(args, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+  va_end(args);
+
+  if (n > 0) {
+    buffer_append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+  }
+}
@@ -0,0 +1,531 @@
+#include "replay.h"
+#include "capture.h"
+#include "frame.h"
+#include "network_funcs.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// one recorded frame, pointing into the mapping
+typedef struct
+{
+    int64_t t_ns;
+    uint8_t direction;
+    uint32_t conn;
+    const uint8_t *frame; // wire header + body, sent as is
+    size_t frame_len;
+} replay_frame;
+
+// a recorded connection and its replayed counterpart. sent_at is a FIFO of
+// send times still waiting for their response, the protocol answers in order
+typedef struct
+{
+    uint32_t id;
+    capture_peer peer; // where the recorded connection went
+    int manager;       // it started with discovery, the node never saw it
+    int fd;
+    frame_decoder dec;
+    int64_t *sent_at;
+    size_t head;
+    size_t tail;
+    size_t sends;
+    size_t opens;
+} replay_conn;
+
+typedef struct
+{
+    uint8_t *map;
+    size_t map_len;
+    replay_frame *frames;
+    size_t frame_count;
+    replay_conn *conns;
+    size_t conn_count;
+    struct pollfd *pfds;
+    replay_conn **owners;
+    struct sockaddr_in target;
+
+    int64_t *orig_latency;
+    size_t orig_count;
+    int64_t *latency;
+    size_t latency_count;
+
+    size_t sent;
+    size_t reconnects;
+    size_t manager_conns;
+    int64_t lag_total;
+    int64_t lag_max;
+} replay_state;
+
+static int load_trace(replay_state *st, const char *path);
+static replay_conn *find_conn(replay_state *st, uint32_t id);
+static int index_conns(replay_state *st);
+static void original_latencies(replay_state *st);
+static int conn_open(replay_state *st, replay_conn *c);
+static void conn_close(replay_conn *c);
+static int send_frame(replay_state *st, replay_conn *c, const replay_frame *f);
+static size_t outstanding(const replay_state *st);
+static void pump(replay_state *st, int timeout_ms);
+static void read_conn(replay_state *st, replay_conn *c);
+static void report(replay_state *st, int64_t span_ns, double speed);
+static void print_latency(const char *label, int64_t *samples, size_t count);
+static int compare_i64(const void *a, const void *b);
+static void free_state(replay_state *st);
+
+void replay_run(client_context *ctx) {
+  replay_state st;
+  double speed = ctx->replay_speed;
+
+  memset(&st, 0, sizeof(st));
+
+  if (convert_address(ctx) != 0) {
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Invalid Manager IP format.\n";
+    return;
+  }
+  memcpy(&st.target, &ctx->addr, sizeof(st.target));
+  st.target.sin_port = htons(ctx->manager_port);
+
+  if (load_trace(&st, ctx->replay_path) == -1 || index_conns(&st) == -1) {
+    free_state(&st);
+    ctx->exit_code = EXIT_FAILURE;
+    return;
+  }
+  original_latencies(&st);
+
+  if (speed > 0) {
+    printf("Replaying %zu frames over %zu connections at %gx against "
+           "%s:%u\n",
+           st.frame_count, st.conn_count - st.manager_conns, speed,
+           ctx->manager_ip, ctx->manager_port);
+  } else {
+    printf("Replaying %zu frames over %zu connections at max speed against "
+           "%s:%u\n",
+           st.frame_count, st.conn_count - st.manager_conns, ctx->manager_ip,
+           ctx->manager_port);
+  }
+  for (size_t i = 0; i < st.conn_count; i++) {
+    const replay_conn *c = &st.conns[i];
+    char addr[INET_ADDRSTRLEN];
+
+    if (c->manager) {
+      inet_ntop(AF_INET, &c->peer.ip, addr, sizeof(addr));
+      printf("Skipping %zu discovery connections (the first went to %s:%u)\n",
+             st.manager_conns, addr, ntohs(c->peer.port));
+      break;
+    }
+  }
+
+  int64_t first_ns = st.frame_count > 0 ? st.frames[0].t_ns : 0;
+  int64_t start = monotonic_ns();
+
+  for (size_t i = 0; i < st.frame_count; i++) {
+    const replay_frame *f = &st.frames[i];
+    replay_conn *c = find_conn(&st, f->conn);
+    if (f->direction != CAPTURE_SENT || c->manager) {
+      continue;
+    }
+
+    int64_t due = start;
+    if (speed > 0) {
+      due += (int64_t)((double)(f->t_ns - first_ns) / speed);
+    }
+
+    // keep reading responses while we wait for the frame's turn
+    int64_t now = monotonic_ns();
+    while (now < due) {
+      int64_t wait_ms = (due - now) / 1000000;
+      pump(&st, (int)(wait_ms > 0 ? wait_ms : 0));
+      now = monotonic_ns();
+    }
+    if (speed <= 0) {
+      pump(&st, 0);
+      now = monotonic_ns();
+    }
+
+    int64_t lag = now - due;
+    st.lag_total += lag;
+    if (lag > st.lag_max) {
+      st.lag_max = lag;
+    }
+
+    if (send_frame(&st, c, f) == -1) {
+      fprintf(stderr, "replay: dropping frame %zu: %s\n", i, strerror(errno));
+    }
+  }
+
+  // collect whatever is still in flight
+  int64_t drain_until = monotonic_ns() + ((int64_t)REPLAY_DRAIN_MS * 1000000);
+  while (outstanding(&st) > 0 && monotonic_ns() < drain_until) {
+    pump(&st, 50);
+  }
+
+  report(&st, monotonic_ns() - start, speed);
+  free_state(&st);
+}
+
+static int load_trace(replay_state *st, const char *path) {
+  struct stat sb;
+  capture_file_header fh;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "replay: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(fh)) {
+    fprintf(stderr, "replay: %s is not a capture file\n", path);
+    close(fd);
+    return -1;
+  }
+
+  st->map_len = (size_t)sb.st_size;
+  void *map = mmap(NULL, st->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  st->map = map;
+
+  memcpy(&fh, st->map, sizeof(fh));
+  if (fh.magic != CAPTURE_MAGIC || fh.version != CAPTURE_VERSION) {
+    fprintf(stderr, "replay: %s is not a capture file\n", path);
+    return -1;
+  }
+
+  // records are variable length, so walk them once to size the index
+  size_t count = 0;
+  size_t off = sizeof(fh);
+  while (off + sizeof(capture_record) + sizeof(big_header_t) <= st->map_len) {
+    capture_record rec;
+    memcpy(&rec, st->map + off, sizeof(rec));
+    size_t len = sizeof(rec) + sizeof(big_header_t) + rec.length;
+    if (off + len > st->map_len) {
+      break;
+    }
+    off += len;
+    count++;
+  }
+  if (off != st->map_len) {
+    fprintf(stderr, "replay: ignoring %zu trailing bytes\n",
+            st->map_len - off);
+  }
+
+  st->frames = calloc(count > 0 ? count : 1, sizeof(*st->frames));
+  if (st->frames == NULL) {
+    fputs("replay: out of memory\n", stderr);
+    return -1;
+  }
+
+  off = sizeof(fh);
+  for (size_t i = 0; i < count; i++) {
+    capture_record rec;
+    memcpy(&rec, st->map + off, sizeof(rec));
+    st->frames[i].t_ns = (int64_t)rec.t_ns;
+    st->frames[i].direction = rec.direction;
+    st->frames[i].conn = rec.conn;
+    st->frames[i].frame = st->map + off + sizeof(rec);
+    st->frames[i].frame_len = sizeof(big_header_t) + rec.length;
+    off += sizeof(rec) + st->frames[i].frame_len;
+  }
+  st->frame_count = count;
+
+  // the replay walks the mapping front to back
+  posix_madvise(st->map, st->map_len, POSIX_MADV_SEQUENTIAL);
+  return 0;
+}
+
+static replay_conn *find_conn(replay_state *st, uint32_t id) {
+  for (size_t i = 0; i < st->conn_count; i++) {
+    if (st->conns[i].id == id) {
+      return &st->conns[i];
+    }
+  }
+  return NULL;
+}
+
+static int index_conns(replay_state *st) {
+  st->conns = calloc(st->frame_count > 0 ? st->frame_count : 1,
+                     sizeof(*st->conns));
+  st->orig_latency = calloc(st->frame_count > 0 ? st->frame_count : 1,
+                            sizeof(*st->orig_latency));
+  st->latency = calloc(st->frame_count > 0 ? st->frame_count : 1,
+                       sizeof(*st->latency));
+  if (st->conns == NULL || st->orig_latency == NULL || st->latency == NULL) {
+    fputs("replay: out of memory\n", stderr);
+    return -1;
+  }
+
+  // connection ids are never reused within a trace, so each one is exactly
+  // one recorded socket
+  for (size_t i = 0; i < st->frame_count; i++) {
+    const replay_frame *f = &st->frames[i];
+    replay_conn *c = find_conn(st, f->conn);
+    if (c == NULL) {
+      c = &st->conns[st->conn_count++];
+      c->id = f->conn;
+      c->fd = -1;
+      // bodies are only timed, never looked at
+      frame_decoder_init(&c->dec, NULL, 0);
+    }
+    if (f->direction == CAPTURE_CONNECT &&
+        f->frame_len >= sizeof(big_header_t) + sizeof(c->peer)) {
+      memcpy(&c->peer, f->frame + sizeof(big_header_t), sizeof(c->peer));
+    }
+    if (f->direction == CAPTURE_SENT) {
+      const big_header_t *hdr = (const big_header_t *)f->frame;
+
+      // only the manager answers discovery, replaying it at a node is noise
+      if (c->sends == 0 && hdr->type == TYPE_DISCOVERY_REQUEST) {
+        c->manager = 1;
+        st->manager_conns++;
+      }
+      c->sends++;
+    }
+  }
+
+  st->pfds = calloc(st->conn_count > 0 ? st->conn_count : 1,
+                    sizeof(*st->pfds));
+  st->owners = calloc(st->conn_count > 0 ? st->conn_count : 1,
+                      sizeof(*st->owners));
+  if (st->pfds == NULL || st->owners == NULL) {
+    fputs("replay: out of memory\n", stderr);
+    return -1;
+  }
+
+  for (size_t i = 0; i < st->conn_count; i++) {
+    replay_conn *c = &st->conns[i];
+    c->sent_at = calloc(c->sends > 0 ? c->sends : 1, sizeof(*c->sent_at));
+    if (c->sent_at == NULL) {
+      fputs("replay: out of memory\n", stderr);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// pair every recorded response with the oldest unanswered request on the
+// same connection, the same way the replay is measured
+static void original_latencies(replay_state *st) {
+  for (size_t i = 0; i < st->frame_count; i++) {
+    const replay_frame *f = &st->frames[i];
+    replay_conn *c = find_conn(st, f->conn);
+
+    if (f->direction == CAPTURE_SENT) {
+      c->sent_at[c->tail++] = f->t_ns;
+    } else if (f->direction == CAPTURE_RECEIVED && !c->manager &&
+               c->head < c->tail) {
+      st->orig_latency[st->orig_count++] = f->t_ns - c->sent_at[c->head++];
+    }
+  }
+
+  for (size_t i = 0; i < st->conn_count; i++) {
+    st->conns[i].head = 0;
+    st->conns[i].tail = 0;
+  }
+}
+
+static int conn_open(replay_state *st, replay_conn *c) {
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd == -1) {
+    return -1;
+  }
+  if (connect(c->fd, (struct sockaddr *)&st->target, sizeof(st->target)) ==
+      -1) {
+    int saved = errno;
+    close(c->fd);
+    c->fd = -1;
+    errno = saved;
+    return -1;
+  }
+  frame_decoder_reset(&c->dec);
+  return 0;
+}
+
+static void conn_close(replay_conn *c) {
+  if (c->fd != -1) {
+    close(c->fd);
+    c->fd = -1;
+  }
+  // nothing still in flight can be answered any more
+  c->head = c->tail;
+}
+
+static int send_frame(replay_state *st, replay_conn *c, const replay_frame *f) {
+  // the node may have hung up (logout), try a fresh connection once
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (c->fd == -1) {
+      if (conn_open(st, c) == -1) {
+        return -1;
+      }
+      if (++c->opens > 1) {
+        st->reconnects++;
+      }
+    }
+
+    int64_t now = monotonic_ns();
+    if (frame_write_all(c->fd, f->frame, f->frame_len) == 0) {
+      c->sent_at[c->tail++] = now;
+      st->sent++;
+      return 0;
+    }
+    conn_close(c);
+  }
+  return -1;
+}
+
+static size_t outstanding(const replay_state *st) {
+  size_t total = 0;
+
+  for (size_t i = 0; i < st->conn_count; i++) {
+    total += st->conns[i].tail - st->conns[i].head;
+  }
+  return total;
+}
+
+static void pump(replay_state *st, int timeout_ms) {
+  struct pollfd *pfds = st->pfds;
+  nfds_t n = 0;
+
+  for (size_t i = 0; i < st->conn_count; i++) {
+    if (st->conns[i].fd != -1) {
+      pfds[n].fd = st->conns[i].fd;
+      pfds[n].events = POLLIN;
+      pfds[n].revents = 0;
+      st->owners[n] = &st->conns[i];
+      n++;
+    }
+  }
+
+  if (n == 0) {
+    if (timeout_ms > 0) {
+      struct timespec ts = {.tv_sec = timeout_ms / 1000,
+                            .tv_nsec = (long)(timeout_ms % 1000) * 1000000L};
+      nanosleep(&ts, NULL);
+    }
+    return;
+  }
+
+  if (poll(pfds, n, timeout_ms) <= 0) {
+    return;
+  }
+  for (nfds_t i = 0; i < n; i++) {
+    if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      read_conn(st, st->owners[i]);
+    }
+  }
+}
+
+static void read_conn(replay_state *st, replay_conn *c) {
+  uint8_t chunk[4096];
+
+  ssize_t n = read(c->fd, chunk, sizeof(chunk));
+  if (n == -1 && errno == EINTR) {
+    return;
+  }
+  if (n <= 0) {
+    conn_close(c);
+    return;
+  }
+
+  int64_t now = monotonic_ns();
+  size_t off = 0;
+  while (off < (size_t)n) {
+    size_t used = 0;
+    frame_result res =
+        frame_decoder_push(&c->dec, chunk + off, (size_t)n - off, &used);
+    off += used;
+    if (res == FRAME_ERROR) {
+      fprintf(stderr, "replay: malformed frame on connection %u\n", c->id);
+      conn_close(c);
+      return;
+    }
+    if (res == FRAME_COMPLETE) {
+      if (c->head < c->tail) {
+        st->latency[st->latency_count++] = now - c->sent_at[c->head++];
+      }
+      frame_decoder_reset(&c->dec);
+    }
+  }
+}
+
+static void report(replay_state *st, int64_t span_ns, double speed) {
+  int64_t orig_span = 0;
+  size_t orig_sent = 0;
+
+  if (st->frame_count > 0) {
+    orig_span = st->frames[st->frame_count - 1].t_ns - st->frames[0].t_ns;
+  }
+  for (size_t i = 0; i < st->conn_count; i++) {
+    orig_sent += st->conns[i].manager ? 0 : st->conns[i].sends;
+  }
+
+  printf("\nframes sent:     %zu / %zu (%zu reconnects)\n", st->sent,
+         orig_sent, st->reconnects);
+  printf("responses:       %zu replayed, %zu recorded\n", st->latency_count,
+         st->orig_count);
+  printf("span:            %.3f ms replayed, %.3f ms recorded",
+         (double)span_ns / 1e6, (double)orig_span / 1e6);
+  if (speed > 0) {
+    printf(" (%.3f ms expected)", (double)orig_span / speed / 1e6);
+  }
+  putchar('\n');
+  printf("send lag:        mean %.3f ms, max %.3f ms\n",
+         st->sent > 0 ? (double)st->lag_total / (double)st->sent / 1e6 : 0.0,
+         (double)st->lag_max / 1e6);
+  print_latency("latency (trace): ", st->orig_latency, st->orig_count);
+  print_latency("latency (replay):", st->latency, st->latency_count);
+}
+
+static void print_latency(const char *label, int64_t *samples, size_t count) {
+  int64_t sum = 0;
+
+  if (count == 0) {
+    printf("%s no responses\n", label);
+    return;
+  }
+
+  qsort(samples, count, sizeof(*samples), compare_i64);
+  for (size_t i = 0; i < count; i++) {
+    sum += samples[i];
+  }
+  printf("%s mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", label,
+         (double)sum / (double)count / 1e6,
+         (double)samples[count / 2] / 1e6,
+         (double)samples[(count * 99) / 100] / 1e6,
+         (double)samples[count - 1] / 1e6);
+}
+
+static int compare_i64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void free_state(replay_state *st) {
+  for (size_t i = 0; i < st->conn_count; i++) {
+    conn_close(&st->conns[i]);
+    free(st->conns[i].sent_at);
+  }
+  free(st->conns);
+  free(st->pfds);
+  free(st->owners);
+  free(st->frames);
+  free(st->orig_latency);
+  free(st->latency);
+  if (st->map != NULL) {
+    munmap(st->map, st->map_len);
+  }
+}
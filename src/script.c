@@ -0,0 +1,756 @@
+#include "script.h"
+#include "capture.h"
+#include "clock_sync.h"
+#include "frame.h"
+#include "metrics.h"
+#include "network_funcs.h"
+#include "trace.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum
+{
+    SCRIPT_READ_CHUNK = 4096,
+    // the biggest frame one line can turn into
+    SCRIPT_FRAME_MAX =
+        sizeof(big_header_t) + sizeof(big_send_message_t) + SCRIPT_LINE_LENGTH
+};
+
+// everything one script run owns
+typedef struct
+{
+    int in_fd;
+    int in_eof;
+    int skipping; // dropping the rest of an overlong line
+    unsigned line_no;
+    size_t in_off;
+    size_t in_end;
+    char in[SCRIPT_INPUT_SIZE];
+
+    int fd;
+    size_t out_off;
+    size_t out_end;
+    uint8_t out[SCRIPT_OUTPUT_SIZE];
+    frame_decoder dec;
+    uint8_t *body;
+    clock_sync clock;
+
+    // ring of 2 * window slots, indexed by monotonically increasing counters
+    script_slot *slots;
+    size_t cap;
+    size_t window;
+    uint64_t head;   // next slot to print
+    uint64_t answer; // next slot that may be waiting for a response
+    uint64_t tail;   // next free slot
+    size_t in_flight;
+    uint64_t fetch_barrier; // nothing is queued until answer gets here
+
+    big_auth_t auth; // set by login, used by everything after it
+    uint8_t channel_id;
+    uint64_t last_timestamp; // newest message a fetch returned
+    int failed;
+    int broken; // connection gone, nothing more is sent
+} script_state;
+
+static int discover(const client_context *ctx, struct sockaddr_in *node);
+static int connect_blocking(const struct sockaddr_in *to);
+static int fill_input(script_state *st);
+static int next_line(script_state *st, char *line, size_t size);
+static void run_line(script_state *st, char *line, int too_long);
+static script_slot *new_slot(script_state *st, script_command command);
+static void local_result(script_state *st, script_slot *slot, int ok,
+                         const char *detail);
+static int set_auth(big_auth_t *auth, const char *user, const char *pass);
+static int can_queue(const script_state *st);
+static void send_request(script_state *st, script_slot *slot, uint8_t type,
+                         const void *body, size_t len);
+static void flush_output(script_state *st);
+static void send_login_logout(script_state *st, script_slot *slot,
+                              uint8_t status_flag);
+static int read_responses(script_state *st, uint8_t *chunk);
+static script_slot *oldest_pending(script_state *st);
+static int64_t timeout_ns(const script_state *st);
+static void handle_response(script_state *st);
+static void fail_unanswered(script_state *st, const char *why);
+static void print_done(script_state *st);
+static script_command parse_command(const char *word);
+static const char *command_name(uint8_t command);
+
+void script_run(client_context *ctx) {
+  struct sockaddr_in node;
+  uint8_t chunk[SCRIPT_READ_CHUNK];
+  script_state *st = calloc(1, sizeof(*st));
+
+  if (st == NULL) {
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Fatal: Out of memory.\n";
+    return;
+  }
+  st->fd = -1;
+  st->window = ctx->script_window > 0 ? ctx->script_window
+                                      : SCRIPT_DEFAULT_WINDOW;
+  st->cap = st->window * 2;
+  st->slots = calloc(st->cap, sizeof(script_slot));
+  st->body = malloc(sizeof(big_get_message_t) + MESSAGE_MAX_LENGTH);
+  st->in_fd = strcmp(ctx->script_path, "-") == 0
+                  ? STDIN_FILENO
+                  : open(ctx->script_path, O_RDONLY | O_CLOEXEC);
+
+  if (st->slots == NULL || st->body == NULL) {
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Fatal: Out of memory.\n";
+    goto done;
+  }
+  if (st->in_fd == -1) {
+    perror(ctx->script_path);
+    ctx->exit_code = EXIT_FAILURE;
+    goto done;
+  }
+  if (convert_address(ctx) != 0) {
+    ctx->exit_code = EXIT_FAILURE;
+    ctx->exit_message = "Invalid Manager IP format.\n";
+    goto done;
+  }
+  if (discover(ctx, &node) == -1 || (st->fd = connect_blocking(&node)) == -1) {
+    ctx->exit_code = EXIT_FAILURE;
+    goto done;
+  }
+
+  // reads are driven by poll, frame_send waits out EAGAIN itself. pipelined
+  // requests are small and back to back, nagle would hold each one for the
+  // previous ack
+  int flags = fcntl(st->fd, F_GETFL);
+  int one = 1;
+  fcntl(st->fd, F_SETFL, flags | O_NONBLOCK);
+  setsockopt(st->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  clock_sync_init(&st->clock);
+  frame_decoder_init(&st->dec, st->body,
+                     sizeof(big_get_message_t) + MESSAGE_MAX_LENGTH);
+
+  for (;;) {
+    char line[SCRIPT_LINE_LENGTH];
+    int got;
+
+    // queue as much as the window, the ring and the output buffer allow
+    while (!st->broken && can_queue(st) &&
+           (got = next_line(st, line, sizeof(line))) != 0) {
+      run_line(st, line, got == 2);
+    }
+    print_done(st);
+
+    if (st->broken || (st->in_eof && st->in_off == st->in_end &&
+                       st->head == st->tail)) {
+      break;
+    }
+
+    // never block in a write: a node stuck sending us responses would wait
+    // on us just the same
+    int want_input = !st->in_eof && can_queue(st);
+    short net_events = st->out_end > st->out_off ? POLLIN | POLLOUT : POLLIN;
+    struct pollfd pfds[2] = {
+        {.fd = st->fd, .events = net_events, .revents = 0},
+        {.fd = want_input ? st->in_fd : -1, .events = POLLIN, .revents = 0}};
+    const script_slot *oldest = oldest_pending(st);
+    int timeout = -1;
+
+    if (oldest != NULL) {
+      int64_t left =
+          (timeout_ns(st) - (monotonic_ns() - oldest->sent_ns)) / 1000000;
+      timeout = left > 0 ? (int)left : 0;
+    }
+
+    if (poll(pfds, 2, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      fail_unanswered(st, "poll failed");
+      continue;
+    }
+
+    if ((pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+        fill_input(st) == -1) {
+      perror(ctx->script_path);
+      st->in_eof = 1;
+      st->failed = 1;
+    }
+    if (pfds[0].revents & POLLOUT) {
+      flush_output(st);
+    }
+    if ((pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !st->broken &&
+        read_responses(st, chunk) == -1) {
+      continue;
+    }
+
+    oldest = oldest_pending(st);
+    if (oldest != NULL &&
+        monotonic_ns() - oldest->sent_ns >= timeout_ns(st)) {
+      fail_unanswered(st, "timed out waiting for the server");
+    }
+  }
+
+  if (st->failed) {
+    ctx->exit_code = EXIT_FAILURE;
+  }
+
+done:
+  fflush(stdout);
+  if (st->fd != -1) {
+    trace_record(TRACE_CLOSE, st->fd, 0, 0, 0);
+    capture_close(st->fd);
+    conn_id_close(st->fd);
+    close(st->fd);
+  }
+  if (st->in_fd > STDIN_FILENO) {
+    close(st->in_fd);
+  }
+  free(st->body);
+  free(st->slots);
+  free(st);
+}
+
+// same exchange as the interactive discovery phase, without the chatter on
+// stdout
+static int discover(const client_context *ctx, struct sockaddr_in *node) {
+  struct sockaddr_in manager;
+  big_discovery_res_t req = {0};
+  big_discovery_res_t res;
+  big_header_t hdr;
+  int rc = -1;
+
+  memcpy(&manager, &ctx->addr, sizeof(manager));
+  manager.sin_port = htons(ctx->manager_port);
+
+  int fd = connect_blocking(&manager);
+  if (fd == -1) {
+    return -1;
+  }
+
+  if (frame_send(fd, TYPE_DISCOVERY_REQUEST, 0, &req, sizeof(req)) == 0 &&
+      frame_read_all(fd, &hdr, sizeof(hdr)) == 0) {
+    uint32_t len = ntohl(hdr.body);
+
+    trace_record(TRACE_FRAME_RECEIVED, fd, hdr.type, hdr.status, len);
+    metrics_frame_received(hdr.status, len);
+    if (hdr.type == TYPE_DISCOVERY_RESPONSE && hdr.status == STATUS_OK &&
+        len == sizeof(res) && frame_read_all(fd, &res, sizeof(res)) == 0) {
+      capture_frame(CAPTURE_RECEIVED, fd, &hdr, &res, sizeof(res));
+      // same port as the manager, like the interactive flow
+      *node = manager;
+      memcpy(&node->sin_addr.s_addr, &res.ip_address, sizeof(res.ip_address));
+      rc = 0;
+    }
+  }
+
+  if (rc == -1) {
+    fprintf(stderr, "script: discovery via %s:%u failed\n", ctx->manager_ip,
+            ctx->manager_port);
+  }
+  trace_record(TRACE_CLOSE, fd, 0, 0, 0);
+  capture_close(fd);
+  conn_id_close(fd);
+  close(fd);
+  return rc;
+}
+
+static int connect_blocking(const struct sockaddr_in *to) {
+  char addr_str[INET_ADDRSTRLEN];
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)to, sizeof(*to)) == -1) {
+    inet_ntop(AF_INET, &to->sin_addr, addr_str, sizeof(addr_str));
+    fprintf(stderr, "script: cannot connect to %s:%u: %s\n", addr_str,
+            ntohs(to->sin_port), strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  conn_id_open(fd);
+  trace_record(TRACE_CONNECT, fd, 0, 0, ntohs(to->sin_port));
+  capture_connect(fd);
+  metrics_add(&metrics.connects, 1);
+  return fd;
+}
+
+static int fill_input(script_state *st) {
+  // slide what is left of a partial line to the front
+  if (st->in_off > 0) {
+    memmove(st->in, st->in + st->in_off, st->in_end - st->in_off);
+    st->in_end -= st->in_off;
+    st->in_off = 0;
+  }
+  if (st->in_end == sizeof(st->in)) {
+    return 0;
+  }
+
+  ssize_t n = read(st->in_fd, st->in + st->in_end, sizeof(st->in) - st->in_end);
+  if (n == -1) {
+    return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  }
+  if (n == 0) {
+    st->in_eof = 1;
+  }
+  st->in_end += (size_t)n;
+  return 0;
+}
+
+// 1 with a line, 2 with the start of a line too long to run, 0 for nothing
+// complete yet
+static int next_line(script_state *st, char *line, size_t size) {
+  for (;;) {
+    char *start = st->in + st->in_off;
+    size_t have = st->in_end - st->in_off;
+    char *nl = memchr(start, '\n', have);
+    size_t len = nl != NULL ? (size_t)(nl - start) : have;
+    int complete = nl != NULL || (st->in_eof && have > 0);
+    int full = !complete && have == sizeof(st->in);
+
+    if (!complete && !full) {
+      return 0;
+    }
+    st->in_off += nl != NULL ? len + 1 : len;
+
+    // the tail of a line already reported as too long
+    if (st->skipping) {
+      st->skipping = !complete;
+      continue;
+    }
+
+    st->line_no++;
+    st->skipping = full;
+    size_t n = len < size ? len : size - 1;
+    memcpy(line, start, n);
+    line[n] = '\0';
+    if (n > 0 && line[n - 1] == '\r') {
+      line[n - 1] = '\0';
+    }
+    return len < size ? 1 : 2;
+  }
+}
+
+static void run_line(script_state *st, char *line, int too_long) {
+  char *save = NULL;
+  char *word = line + strspn(line, " \t");
+  char *rest = word + strcspn(word, " \t");
+
+  if (too_long) {
+    local_result(st, new_slot(st, SCRIPT_INVALID), 0, "line too long");
+    return;
+  }
+  if (*word == '\0' || *word == '#') {
+    return;
+  }
+  if (*rest != '\0') {
+    *rest++ = '\0';
+  }
+  rest += strspn(rest, " \t");
+
+  script_command command = parse_command(word);
+  script_slot *slot = new_slot(st, command);
+
+  switch (command) {
+  case SCRIPT_REGISTER: {
+    big_create_account_req_t body;
+    big_auth_t auth;
+    char *user = strtok_r(rest, " \t", &save);
+    char *pass = strtok_r(NULL, " \t", &save);
+
+    if (set_auth(&auth, user, pass) == -1) {
+      local_result(st, slot, 0, "usage: register <user> <password>");
+      return;
+    }
+    frame_create_account_body(&body, &auth);
+    send_request(st, slot, TYPE_ACCOUNT_CREATE_REQUEST, &body, sizeof(body));
+    return;
+  }
+
+  case SCRIPT_LOGIN: {
+    char *user = strtok_r(rest, " \t", &save);
+    char *pass = strtok_r(NULL, " \t", &save);
+
+    if (set_auth(&st->auth, user, pass) == -1) {
+      local_result(st, slot, 0, "usage: login <user> <password>");
+      return;
+    }
+    send_login_logout(st, slot, 1);
+    return;
+  }
+
+  case SCRIPT_JOIN: {
+    char *endptr;
+    unsigned long id = strtoul(rest, &endptr, PORT_BASE);
+
+    if (*rest == '\0' || *endptr != '\0' || id > UINT8_MAX) {
+      local_result(st, slot, 0, "usage: join <channel 0-255>");
+      return;
+    }
+    st->channel_id = (uint8_t)id;
+    local_result(st, slot, 1, rest);
+    return;
+  }
+
+  case SCRIPT_SEND: {
+    uint8_t buf[sizeof(big_send_message_t) + SCRIPT_LINE_LENGTH];
+    big_send_message_t *body = (big_send_message_t *)buf;
+    size_t len = strlen(rest);
+
+    if (len == 0) {
+      local_result(st, slot, 0, "usage: send <text>");
+      return;
+    }
+    frame_send_message_body(body, &st->auth, clock_sync_stamp(&st->clock),
+                            st->channel_id, (uint16_t)len);
+    memcpy(buf + sizeof(*body), rest, len);
+    send_request(st, slot, TYPE_SEND_MESSAGE_REQUEST, buf,
+                 sizeof(*body) + len);
+    return;
+  }
+
+  case SCRIPT_FETCH: {
+    big_get_message_t body;
+    uint64_t since = st->last_timestamp;
+
+    if (*rest != '\0') {
+      char *endptr;
+      errno = 0;
+      since = strtoull(rest, &endptr, PORT_BASE);
+      if (errno != 0 || *endptr != '\0') {
+        local_result(st, slot, 0, "usage: fetch [<since_ms>]");
+        return;
+      }
+    }
+    frame_get_message_body(&body, &st->auth, since, st->channel_id);
+    send_request(st, slot, TYPE_GET_MESSAGE_REQUEST, &body, sizeof(body));
+
+    // the next bare fetch needs this one's answer for its since, so hold
+    // everything after it until that is in
+    if (*rest == '\0') {
+      st->fetch_barrier = st->tail;
+    }
+    return;
+  }
+
+  case SCRIPT_LOGOUT:
+    send_login_logout(st, slot, 0);
+    return;
+
+  case SCRIPT_INVALID:
+  default:
+    local_result(st, slot, 0, "unknown command");
+    return;
+  }
+}
+
+static script_slot *new_slot(script_state *st, script_command command) {
+  script_slot *slot = &st->slots[st->tail % st->cap];
+
+  memset(slot, 0, sizeof(*slot));
+  slot->line = st->line_no;
+  slot->command = (uint8_t)command;
+  st->tail++;
+  return slot;
+}
+
+static void local_result(script_state *st, script_slot *slot, int ok,
+                         const char *detail) {
+  slot->done = 1;
+  slot->status = ok ? STATUS_OK : STATUS_MALFORMED_REQUEST;
+  snprintf(slot->detail, sizeof(slot->detail), "%s", detail);
+  if (!ok) {
+    st->failed = 1;
+  }
+}
+
+// fixed-width wire fields, NUL padded but not necessarily terminated
+static int set_auth(big_auth_t *auth, const char *user, const char *pass) {
+  if (user == NULL || pass == NULL || strlen(user) > sizeof(auth->username) ||
+      strlen(pass) > sizeof(auth->password)) {
+    return -1;
+  }
+  memset(auth, 0, sizeof(*auth));
+  memcpy(auth->username, user, strlen(user));
+  memcpy(auth->password, pass, strlen(pass));
+  return 0;
+}
+
+static int can_queue(const script_state *st) {
+  return st->in_flight < st->window && st->tail - st->head < st->cap &&
+         st->answer >= st->fetch_barrier &&
+         SCRIPT_OUTPUT_SIZE - (st->out_end - st->out_off) >= SCRIPT_FRAME_MAX;
+}
+
+// every request type is answered with the next type up. the frame is
+// queued, not written, and goes out as far as the socket takes it now
+static void send_request(script_state *st, script_slot *slot, uint8_t type,
+                         const void *body, size_t len) {
+  big_header_t hdr;
+
+  if (st->out_off > 0) {
+    memmove(st->out, st->out + st->out_off, st->out_end - st->out_off);
+    st->out_end -= st->out_off;
+    st->out_off = 0;
+  }
+  frame_header_init(&hdr, type, 0, (uint32_t)len);
+  memcpy(st->out + st->out_end, &hdr, sizeof(hdr));
+  memcpy(st->out + st->out_end + sizeof(hdr), body, len);
+  st->out_end += sizeof(hdr) + len;
+
+  trace_record(TRACE_FRAME_SENT, st->fd, type, 0, (uint32_t)len);
+  metrics_frame_sent(type, len);
+  capture_frame(CAPTURE_SENT, st->fd, &hdr, body, len);
+
+  slot->expect = (uint8_t)(type + 1);
+  slot->sent_ns = monotonic_ns();
+  st->in_flight++;
+  flush_output(st);
+}
+
+static void flush_output(script_state *st) {
+  while (st->out_off < st->out_end) {
+    ssize_t n =
+        write(st->fd, st->out + st->out_off, st->out_end - st->out_off);
+
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        char why[SCRIPT_DETAIL_LENGTH];
+
+        snprintf(why, sizeof(why), "send failed: %s", strerror(errno));
+        fail_unanswered(st, why);
+      }
+      return;
+    }
+    st->out_off += (size_t)n;
+  }
+  st->out_off = st->out_end = 0;
+}
+
+static void send_login_logout(script_state *st, script_slot *slot,
+                              uint8_t status_flag) {
+  big_login_logout_req_t body;
+
+  (void)frame_login_logout_body(&body, &st->auth, st->fd, status_flag);
+  send_request(st, slot, TYPE_LOGIN_OR_LOGOUT_REQUEST, &body, sizeof(body));
+}
+
+static int read_responses(script_state *st, uint8_t *chunk) {
+  ssize_t n = read(st->fd, chunk, SCRIPT_READ_CHUNK);
+
+  if (n == 0) {
+    fail_unanswered(st, "server closed the connection");
+    return -1;
+  }
+  if (n == -1) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
+    }
+    fail_unanswered(st, strerror(errno));
+    return -1;
+  }
+
+  size_t off = 0;
+  while (off < (size_t)n && !st->broken) {
+    size_t used = 0;
+    frame_result res =
+        frame_decoder_push(&st->dec, chunk + off, (size_t)n - off, &used);
+
+    off += used;
+    if (res == FRAME_ERROR) {
+      fail_unanswered(st, "malformed frame from server");
+      return -1;
+    }
+    if (res == FRAME_COMPLETE) {
+      trace_record(TRACE_FRAME_RECEIVED, st->fd, st->dec.hdr.type,
+                   st->dec.hdr.status, st->dec.hdr.body);
+      metrics_frame_received(st->dec.hdr.status, st->dec.hdr.body);
+      capture_decoded(st->fd, &st->dec);
+      handle_response(st);
+      frame_decoder_reset(&st->dec);
+    }
+  }
+  return st->broken ? -1 : 0;
+}
+
+// the request the next response belongs to, NULL when nothing is in flight
+static script_slot *oldest_pending(script_state *st) {
+  // local results never get an answer
+  while (st->answer < st->tail &&
+         st->slots[st->answer % st->cap].expect == 0) {
+    st->answer++;
+  }
+  return st->answer < st->tail ? &st->slots[st->answer % st->cap] : NULL;
+}
+
+// a pipelined request waits behind the ones ahead of it, which one burst
+// after a quiet stretch can push well past the RTO, so that only ever
+// stretches the fixed limit
+static int64_t timeout_ns(const script_state *st) {
+  int64_t ms = clock_sync_timeout_ms(&st->clock, SCRIPT_TIMEOUT_MS);
+
+  return (ms > SCRIPT_TIMEOUT_MS ? ms : SCRIPT_TIMEOUT_MS) * 1000000;
+}
+
+static void handle_response(script_state *st) {
+  const big_header_t *hdr = &st->dec.hdr;
+  script_slot *slot = oldest_pending(st);
+
+  if (slot == NULL) {
+    fprintf(stderr, "script: unsolicited frame type 0x%02X\n", hdr->type);
+    return;
+  }
+  if (hdr->type != slot->expect) {
+    // once the pairing is off every later result would be wrong
+    fprintf(stderr, "script: line %u expected type 0x%02X, got 0x%02X\n",
+            slot->line, slot->expect, hdr->type);
+    fail_unanswered(st, "out of sync with the server");
+    return;
+  }
+
+  slot->done = 1;
+  slot->answered = 1;
+  slot->status = hdr->status;
+  slot->rtt_ns = monotonic_ns() - slot->sent_ns;
+
+  // a pipelined answer also timed the requests queued ahead of it, only a
+  // lone request measures the link
+  if (st->in_flight == 1) {
+    uint64_t stamp = clock_sync_stamp_of(&st->clock, &st->dec);
+
+    if (stamp != 0) {
+      clock_sync_server_time(&st->clock, slot->sent_ns,
+                             slot->sent_ns + slot->rtt_ns, stamp);
+    } else {
+      clock_sync_rtt(&st->clock, slot->rtt_ns);
+    }
+    metrics_rtt(slot->rtt_ns);
+  }
+  st->answer++;
+  st->in_flight--;
+
+  // an empty fetch is how the node says there is nothing new
+  if (hdr->status != STATUS_OK &&
+      !(slot->command == SCRIPT_FETCH && hdr->status == STATUS_NOT_FOUND)) {
+    st->failed = 1;
+    return;
+  }
+  if (hdr->status != STATUS_OK) {
+    return;
+  }
+
+  if (slot->command == SCRIPT_REGISTER &&
+      st->dec.body_have >= sizeof(big_create_account_req_t)) {
+    big_create_account_req_t res;
+    memcpy(&res, st->dec.body, sizeof(res));
+    snprintf(slot->detail, sizeof(slot->detail), "%u", res.client_id);
+  } else if (slot->command == SCRIPT_FETCH &&
+             frame_validate_body(hdr, st->dec.body, st->dec.body_have) ==
+                 STATUS_OK) {
+    big_get_message_t msg;
+    memcpy(&msg, st->dec.body, sizeof(msg));
+
+    size_t text_len = ntohs(msg.message_length);
+    size_t avail = st->dec.body_have - sizeof(msg);
+    uint64_t ts = frame_ntoh64(msg.timestamp);
+    if (text_len > avail) {
+      text_len = avail;
+    }
+    if (ts > st->last_timestamp) {
+      st->last_timestamp = ts;
+    }
+
+    int n = snprintf(slot->detail, sizeof(slot->detail), "%u\t%u\t%llu\t",
+                     msg.channel_id, msg.sender_id, (unsigned long long)ts);
+    size_t off = n > 0 ? (size_t)n : 0;
+    const char *text = (const char *)st->dec.body + sizeof(msg);
+
+    // keep one result per line whatever the message contains
+    for (size_t i = 0; i < text_len && off + 1 < sizeof(slot->detail); i++) {
+      char c = text[i];
+      slot->detail[off++] = (c == '\t' || c == '\n' || c == '\r') ? ' ' : c;
+    }
+    slot->detail[off] = '\0';
+  }
+}
+
+// the connection is no use any more: everything still waiting fails
+static void fail_unanswered(script_state *st, const char *why) {
+  for (uint64_t i = st->answer; i < st->tail; i++) {
+    script_slot *slot = &st->slots[i % st->cap];
+
+    if (slot->expect != 0 && !slot->done) {
+      slot->done = 1;
+      slot->status = STATUS_INTERNAL_ERROR;
+      snprintf(slot->detail, sizeof(slot->detail), "%s", why);
+    }
+  }
+  st->answer = st->tail;
+  st->in_flight = 0;
+  st->failed = 1;
+  st->broken = 1;
+}
+
+static void print_done(script_state *st) {
+  int printed = 0;
+
+  while (st->head < st->tail && st->slots[st->head % st->cap].done) {
+    const script_slot *slot = &st->slots[st->head % st->cap];
+
+    if (slot->answered) {
+      printf("%u\t%s\t0x%02X\t%lld\t%s\n", slot->line,
+             command_name(slot->command), slot->status,
+             (long long)(slot->rtt_ns / 1000), slot->detail);
+    } else {
+      printf("%u\t%s\t%s\t0\t%s\n", slot->line, command_name(slot->command),
+             slot->status == STATUS_OK ? "local" : "error", slot->detail);
+    }
+    st->head++;
+    printed = 1;
+  }
+  if (printed) {
+    fflush(stdout);
+  }
+}
+
+static script_command parse_command(const char *word) {
+  for (uint8_t c = 0; c < SCRIPT_INVALID; c++) {
+    if (strcmp(word, command_name(c)) == 0) {
+      return (script_command)c;
+    }
+  }
+  return SCRIPT_INVALID;
+}
+
+static const char *command_name(uint8_t command) {
+  switch (command) {
+  case SCRIPT_REGISTER:
+    return "register";
+  case SCRIPT_LOGIN:
+    return "login";
+  case SCRIPT_JOIN:
+    return "join";
+  case SCRIPT_SEND:
+    return "send";
+  case SCRIPT_FETCH:
+    return "fetch";
+  case SCRIPT_LOGOUT:
+    return "logout";
+  default:
+    return "invalid";
+  }
+}
@@ -0,0 +1,690 @@
+#include "session.h"
+#include "capture.h"
+#include "metrics.h"
+#include "trace.h"
+#include "utils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum
+{
+    SESSION_READ_CHUNK = 4096,
+    SESSION_CONNECT_SPACING_MS = 5,
+    SESSION_MAX_POLL_MS = 1000
+};
+
+static void session_start(session_loop *loop, session *s,
+                          const struct sockaddr_in *to, client_state next,
+                          int64_t now);
+static void session_connected(session_loop *loop, session *s, int64_t now);
+static void session_timer(session_loop *loop, session *s, int64_t now);
+static void session_readable(session_loop *loop, session *s, int64_t now,
+                             uint8_t *chunk);
+static void session_frame(session_loop *loop, session *s, int64_t now);
+static void session_deliver(session_loop *loop, session *s);
+static void session_fail(session_loop *loop, session *s, int64_t now,
+                         const char *why);
+static void session_close(session_loop *loop, session *s);
+static void session_set_state(session_loop *loop, session *s,
+                              client_state state);
+static int session_write(session_loop *loop, session *s, int64_t now,
+                         uint8_t type, const void *body, size_t len);
+static void session_flush(session_loop *loop, session *s, int64_t now);
+static int send_discovery(session_loop *loop, session *s, int64_t now);
+static int send_create(session_loop *loop, session *s, int64_t now);
+static int send_login_logout(session_loop *loop, session *s, int64_t now,
+                             uint8_t status_flag);
+static int send_fetch(session_loop *loop, session *s, int64_t now);
+static int poll_timeout(const session_loop *loop, int64_t now);
+
+int session_loop_init(session_loop *loop, size_t capacity,
+                      session_message_fn on_message, void *arg) {
+  memset(loop, 0, sizeof(*loop));
+
+  loop->sessions = calloc(capacity, sizeof(session));
+  // one extra slot for the caller's fd
+  loop->pfds = calloc(capacity + 1, sizeof(struct pollfd));
+  if (loop->sessions == NULL || loop->pfds == NULL) {
+    free(loop->sessions);
+    free(loop->pfds);
+    return -1;
+  }
+
+  loop->capacity = capacity;
+  loop->on_message = on_message;
+  loop->arg = arg;
+  // a block holds a received body or an unsent frame, header included
+  buffer_pool_init(&loop->pool, sizeof(big_header_t) + SESSION_BUFFER_SIZE);
+  return 0;
+}
+
+void session_loop_destroy(session_loop *loop) {
+  for (size_t i = 0; i < loop->count; i++) {
+    session_close(loop, &loop->sessions[i]);
+    metrics_set_state((int)loop->sessions[i].state, -1);
+  }
+  buffer_pool_destroy(&loop->pool);
+  free(loop->sessions);
+  free(loop->pfds);
+  loop->sessions = NULL;
+  loop->pfds = NULL;
+}
+
+session *session_loop_add(session_loop *loop, const char *username,
+                          const char *password,
+                          const struct sockaddr_in *manager) {
+  if (loop->count == loop->capacity) {
+    return NULL;
+  }
+
+  session *s = &loop->sessions[loop->count];
+  memset(s, 0, sizeof(*s));
+  s->state = STATE_DISCONNECTED;
+  metrics_set_state(-1, STATE_DISCONNECTED);
+  s->fd = -1;
+  s->manager = *manager;
+  s->retry_ms = SESSION_RETRY_MIN_MS;
+  // fixed-width wire fields, NUL padded but not necessarily terminated
+  memcpy(s->auth.username, username,
+         strnlen(username, sizeof(s->auth.username)));
+  memcpy(s->auth.password, password,
+         strnlen(password, sizeof(s->auth.password)));
+  frame_decoder_init(&s->dec, NULL, 0);
+  clock_sync_init(&s->clock);
+
+  // spread the first connects out instead of hitting the manager at once
+  s->deadline = monotonic_ms() +
+                ((int64_t)loop->count * SESSION_CONNECT_SPACING_MS);
+
+  loop->count++;
+  return s;
+}
+
+session *session_loop_find(session_loop *loop, const char *username) {
+  for (size_t i = 0; i < loop->count; i++) {
+    if (strncmp(loop->sessions[i].auth.username, username,
+                sizeof(loop->sessions[i].auth.username)) == 0) {
+      return &loop->sessions[i];
+    }
+  }
+  return NULL;
+}
+
+int session_send_message(session_loop *loop, session *s, const char *text,
+                         size_t length) {
+  uint8_t buf[SESSION_BUFFER_SIZE];
+  big_send_message_t *body = (big_send_message_t *)buf;
+
+  if (s->state != STATE_MESSAGING) {
+    return -1;
+  }
+  if (length > sizeof(buf) - sizeof(*body)) {
+    length = sizeof(buf) - sizeof(*body);
+  }
+
+  frame_send_message_body(body, &s->auth, clock_sync_stamp(&s->clock),
+                          s->channel_id, (uint16_t)length);
+  memcpy(buf + sizeof(*body), text, length);
+
+  return session_write(loop, s, monotonic_ms(), TYPE_SEND_MESSAGE_REQUEST,
+                       buf, sizeof(*body) + length);
+}
+
+size_t session_loop_run_once(session_loop *loop, int extra_fd,
+                             int *extra_ready) {
+  uint8_t chunk[SESSION_READ_CHUNK];
+  int64_t now = monotonic_ms();
+
+  for (size_t i = 0; i < loop->count; i++) {
+    if (!loop->sessions[i].finished) {
+      session_timer(loop, &loop->sessions[i], now);
+    }
+  }
+
+  for (size_t i = 0; i < loop->count; i++) {
+    const session *s = &loop->sessions[i];
+
+    // poll skips negative fds, so idle sessions cost nothing here
+    loop->pfds[i].fd = s->fd;
+    loop->pfds[i].events = POLLIN;
+    if (s->connecting || s->tx != NULL) {
+      loop->pfds[i].events |= POLLOUT;
+    }
+    loop->pfds[i].revents = 0;
+  }
+  loop->pfds[loop->count].fd = extra_fd;
+  loop->pfds[loop->count].events = POLLIN;
+  loop->pfds[loop->count].revents = 0;
+
+  if (poll(loop->pfds, (nfds_t)(loop->count + 1), poll_timeout(loop, now)) ==
+      -1) {
+    if (errno != EINTR) {
+      perror("poll");
+    }
+    if (extra_ready != NULL) {
+      *extra_ready = 0;
+    }
+  } else {
+    now = monotonic_ms();
+    for (size_t i = 0; i < loop->count; i++) {
+      session *s = &loop->sessions[i];
+      short rev = loop->pfds[i].revents;
+
+      if (rev == 0 || s->fd == -1) {
+        continue;
+      }
+
+      if (s->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0) {
+          session_fail(loop, s, now, strerror(err ? err : errno));
+        } else {
+          session_connected(loop, s, now);
+        }
+        continue;
+      }
+
+      if ((rev & POLLOUT) && s->tx != NULL) {
+        session_flush(loop, s, now);
+      }
+      if ((rev & (POLLIN | POLLHUP | POLLERR)) && s->fd != -1) {
+        session_readable(loop, s, now, chunk);
+      }
+    }
+    if (extra_ready != NULL) {
+      *extra_ready = (loop->pfds[loop->count].revents & (POLLIN | POLLHUP)) != 0;
+    }
+  }
+
+  size_t alive = 0;
+  for (size_t i = 0; i < loop->count; i++) {
+    alive += loop->sessions[i].finished ? 0 : 1;
+  }
+  return alive;
+}
+
+void session_loop_shutdown(session_loop *loop) {
+  int64_t now = monotonic_ms();
+
+  loop->stopping = 1;
+  for (size_t i = 0; i < loop->count; i++) {
+    session *s = &loop->sessions[i];
+
+    if (s->finished) {
+      continue;
+    }
+
+    // only a logged-in session has anything to log out of
+    if (s->state == STATE_MESSAGING && s->tx == NULL &&
+        send_login_logout(loop, s, now, 0) == 0) {
+      session_set_state(loop, s, STATE_EXITING);
+      s->deadline = now + SESSION_LOGOUT_GRACE_MS;
+      continue;
+    }
+
+    session_close(loop, s);
+    s->finished = 1;
+  }
+}
+
+static void session_start(session_loop *loop, session *s,
+                          const struct sockaddr_in *to, client_state next,
+                          int64_t now) {
+  session_set_state(loop, s, next);
+
+  // NOLINTNEXTLINE(android-cloexec-socket)
+  s->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (s->fd == -1) {
+    session_fail(loop, s, now, strerror(errno));
+    return;
+  }
+
+  int flags = fcntl(s->fd, F_GETFL);
+  fcntl(s->fd, F_SETFL, flags | O_NONBLOCK);
+
+  if (connect(s->fd, (const struct sockaddr *)to, sizeof(*to)) == 0) {
+    session_connected(loop, s, now);
+    return;
+  }
+  if (errno != EINPROGRESS) {
+    session_fail(loop, s, now, strerror(errno));
+    return;
+  }
+
+  s->connecting = 1;
+  s->deadline = now + SESSION_TIMEOUT_MS;
+}
+
+static void session_connected(session_loop *loop, session *s, int64_t now) {
+  int rc = -1;
+
+  s->connecting = 0;
+  metrics_add(&metrics.connects, 1);
+  conn_id_open(s->fd);
+  trace_record(TRACE_CONNECT, s->fd, 0, 0,
+               ntohs(s->state == STATE_DISCOVERING ? s->manager.sin_port
+                                                   : s->node.sin_port));
+  capture_connect(s->fd);
+  if (s->state == STATE_DISCOVERING) {
+    rc = send_discovery(loop, s, now);
+  } else if (s->state == STATE_CONNECTING_TO_SERVER) {
+    rc = send_create(loop, s, now);
+  }
+
+  if (rc == -1 && s->fd != -1) {
+    session_fail(loop, s, now, "failed to send request");
+  }
+}
+
+static void session_timer(session_loop *loop, session *s, int64_t now) {
+  if (s->state == STATE_DISCONNECTED) {
+    if (!loop->stopping && now >= s->deadline) {
+      session_start(loop, s, &s->manager, STATE_DISCOVERING, now);
+    }
+    return;
+  }
+
+  if ((s->connecting || s->pending > 0) && now >= s->deadline) {
+    if (s->state == STATE_EXITING) {
+      // the node never confirmed the logout, leave anyway
+      session_close(loop, s);
+      s->finished = 1;
+      return;
+    }
+    if (s->state != STATE_DISCOVERING) {
+      clock_sync_backoff(&s->clock);
+    }
+    session_fail(loop, s, now, "timed out waiting for the server");
+    return;
+  }
+
+  if (s->state == STATE_MESSAGING && !s->fetch_outstanding &&
+      s->tx == NULL && now >= s->next_fetch) {
+    if (send_fetch(loop, s, now) == -1 && s->fd != -1) {
+      session_fail(loop, s, now, "failed to send fetch request");
+      return;
+    }
+    // on a link slower than the interval, polling faster only queues
+    int64_t srtt = clock_sync_srtt_ms(&s->clock, 0);
+    s->next_fetch =
+        now + (srtt > SESSION_FETCH_INTERVAL_MS ? srtt
+                                                : SESSION_FETCH_INTERVAL_MS);
+  }
+}
+
+static void session_readable(session_loop *loop, session *s, int64_t now,
+                             uint8_t *chunk) {
+  ssize_t n = read(s->fd, chunk, SESSION_READ_CHUNK);
+
+  if (n == 0) {
+    session_fail(loop, s, now, "server closed the connection");
+    return;
+  }
+  if (n == -1) {
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+      session_fail(loop, s, now, strerror(errno));
+    }
+    return;
+  }
+
+  // borrow a body buffer only for as long as a frame is in flight
+  if (s->rx == NULL) {
+    s->rx = buffer_pool_get(&loop->pool);
+    if (s->rx == NULL) {
+      session_fail(loop, s, now, "out of memory");
+      return;
+    }
+    s->dec.body = s->rx;
+    s->dec.body_cap = SESSION_BUFFER_SIZE;
+  }
+
+  int fd = s->fd;
+  size_t off = 0;
+  while (off < (size_t)n && s->fd == fd) {
+    size_t used = 0;
+    frame_result res =
+        frame_decoder_push(&s->dec, chunk + off, (size_t)n - off, &used);
+
+    off += used;
+    if (res == FRAME_ERROR) {
+      session_fail(loop, s, now, "malformed frame from server");
+      return;
+    }
+    if (res == FRAME_COMPLETE) {
+      trace_record(TRACE_FRAME_RECEIVED, s->fd, s->dec.hdr.type,
+                   s->dec.hdr.status, s->dec.hdr.body);
+      metrics_frame_received(s->dec.hdr.status, s->dec.hdr.body);
+      capture_decoded(s->fd, &s->dec);
+      session_frame(loop, s, now);
+      frame_decoder_reset(&s->dec);
+    }
+  }
+
+  if (s->rx != NULL && s->dec.hdr_have == 0) {
+    buffer_pool_put(&loop->pool, s->rx);
+    s->rx = NULL;
+    s->dec.body = NULL;
+    s->dec.body_cap = 0;
+  }
+}
+
+static void session_frame(session_loop *loop, session *s, int64_t now) {
+  const big_header_t *hdr = &s->dec.hdr;
+
+  // responses come back in order, so with one request in flight this is
+  // the answer to the newest send. the manager is a different host and
+  // stays out of the node's estimate
+  if (s->pending == 1) {
+    int64_t received_ns = monotonic_ns();
+    uint64_t stamp = clock_sync_stamp_of(&s->clock, &s->dec);
+
+    metrics_rtt(received_ns - s->sent_ns);
+    if (s->state != STATE_DISCOVERING && stamp != 0) {
+      clock_sync_server_time(&s->clock, s->sent_ns, received_ns, stamp);
+    } else if (s->state != STATE_DISCOVERING) {
+      clock_sync_rtt(&s->clock, received_ns - s->sent_ns);
+    }
+  }
+  if (s->pending > 0) {
+    s->pending--;
+  }
+
+  switch (s->state) {
+  case STATE_DISCOVERING: {
+    big_discovery_res_t res;
+
+    if (hdr->type != TYPE_DISCOVERY_RESPONSE || hdr->status != STATUS_OK ||
+        s->dec.body_have < sizeof(res)) {
+      session_fail(loop, s, now, "discovery failed");
+      return;
+    }
+    memcpy(&res, s->dec.body, sizeof(res));
+
+    // same port as the manager, like the interactive flow
+    s->node = s->manager;
+    memcpy(&s->node.sin_addr.s_addr, &res.ip_address, sizeof(res.ip_address));
+    session_close(loop, s);
+    session_start(loop, s, &s->node, STATE_CONNECTING_TO_SERVER, now);
+    return;
+  }
+
+  case STATE_CONNECTING_TO_SERVER:
+    // an account left over from an earlier run is fine for a bridge
+    if (hdr->type != TYPE_ACCOUNT_CREATE_RESPONSE ||
+        (hdr->status != STATUS_OK && hdr->status != STATUS_ALREADY_EXISTS)) {
+      session_fail(loop, s, now, "account creation failed");
+      return;
+    }
+    if (s->dec.body_have >= sizeof(big_create_account_req_t)) {
+      big_create_account_req_t res;
+      memcpy(&res, s->dec.body, sizeof(res));
+      s->account_id = res.client_id;
+    }
+    session_set_state(loop, s, STATE_AWAITING_USER_INFO);
+    if (send_login_logout(loop, s, now, 1) == -1 && s->fd != -1) {
+      session_fail(loop, s, now, "failed to send login");
+    }
+    return;
+
+  case STATE_AWAITING_USER_INFO:
+    if (hdr->type != TYPE_LOGIN_OR_LOGOUT_RESPONSE ||
+        hdr->status != STATUS_OK) {
+      session_fail(loop, s, now, "login failed");
+      return;
+    }
+    s->retry_ms = SESSION_RETRY_MIN_MS;
+
+    // stagger fetches so hundreds of sessions do not poll in lockstep
+    session_set_state(loop, s, STATE_MESSAGING);
+    s->next_fetch =
+        now + (int64_t)(((size_t)(s - loop->sessions) * 37U) %
+                        SESSION_FETCH_INTERVAL_MS);
+    return;
+
+  case STATE_MESSAGING:
+    if (hdr->type == TYPE_GET_MESSAGE_RESPONSE) {
+      s->fetch_outstanding = 0;
+      session_deliver(loop, s);
+    } else if (hdr->status != STATUS_OK) {
+      fprintf(stderr, "[%.*s] Server Error Code: 0x%02X (type 0x%02X)\n",
+              (int)sizeof(s->auth.username), s->auth.username, hdr->status,
+              hdr->type);
+    }
+    return;
+
+  case STATE_EXITING:
+    if (hdr->type == TYPE_LOGIN_OR_LOGOUT_RESPONSE) {
+      session_close(loop, s);
+      s->finished = 1;
+    }
+    return;
+
+  default:
+    return;
+  }
+}
+
+static void session_deliver(session_loop *loop, session *s) {
+  big_get_message_t msg;
+
+  if (s->dec.hdr.status != STATUS_OK ||
+      frame_validate_body(&s->dec.hdr, s->dec.body, s->dec.body_have) !=
+          STATUS_OK) {
+    return;
+  }
+  memcpy(&msg, s->dec.body, sizeof(msg));
+
+  size_t text_len = ntohs(msg.message_length);
+  size_t avail = s->dec.body_have - sizeof(msg);
+  if (text_len > avail) {
+    text_len = avail;
+  }
+  if (text_len == 0) {
+    return;
+  }
+
+  uint64_t ts = frame_ntoh64(msg.timestamp);
+  if (ts > s->last_timestamp) {
+    s->last_timestamp = ts;
+  }
+  metrics_add(&metrics.messages_received, 1);
+  if (loop->on_message != NULL) {
+    loop->on_message(loop->arg, s, msg.channel_id, msg.sender_id, ts,
+                     (const char *)s->dec.body + sizeof(msg), text_len);
+  }
+}
+
+static void session_fail(session_loop *loop, session *s, int64_t now,
+                         const char *why) {
+  fprintf(stderr, "[%.*s] %s\n", (int)sizeof(s->auth.username),
+          s->auth.username, why);
+  session_close(loop, s);
+
+  if (loop->stopping || s->state == STATE_EXITING) {
+    s->finished = 1;
+    return;
+  }
+
+  // back off before the next attempt
+  metrics_add(&metrics.reconnects, 1);
+  session_set_state(loop, s, STATE_DISCONNECTED);
+  s->deadline = now + s->retry_ms;
+  s->retry_ms = s->retry_ms * 2 > SESSION_RETRY_MAX_MS ? SESSION_RETRY_MAX_MS
+                                                        : s->retry_ms * 2;
+}
+
+// the trace id is 1 + the session's slot, its fd changes on every reconnect
+// and 0 is the interactive client's
+static void session_set_state(session_loop *loop, session *s,
+                              client_state state) {
+  trace_record(TRACE_STATE, (int32_t)(s - loop->sessions) + 1,
+               (uint8_t)state, (uint8_t)s->state, 0);
+  metrics_set_state((int)s->state, (int)state);
+  s->state = state;
+}
+
+static void session_close(session_loop *loop, session *s) {
+  if (s->fd != -1) {
+    trace_record(TRACE_CLOSE, s->fd, 0, 0, 0);
+    capture_close(s->fd);
+    conn_id_close(s->fd);
+    close(s->fd);
+    s->fd = -1;
+  }
+  buffer_pool_put(&loop->pool, s->rx);
+  buffer_pool_put(&loop->pool, s->tx);
+  s->rx = NULL;
+  s->tx = NULL;
+  s->tx_len = 0;
+  s->tx_off = 0;
+  frame_decoder_init(&s->dec, NULL, 0);
+  s->connecting = 0;
+  s->pending = 0;
+  s->fetch_outstanding = 0;
+}
+
+// queue one frame. whatever the socket does not take right away is parked in
+// a pooled block and flushed on POLLOUT
+static int session_write(session_loop *loop, session *s, int64_t now,
+                         uint8_t type, const void *body, size_t len) {
+  uint8_t buf[sizeof(big_header_t) + SESSION_BUFFER_SIZE];
+  size_t total = sizeof(big_header_t) + len;
+  size_t off = 0;
+
+  if (s->fd == -1 || s->tx != NULL || len > SESSION_BUFFER_SIZE) {
+    return -1;
+  }
+
+  frame_header_init((big_header_t *)buf, type, 0, (uint32_t)len);
+  memcpy(buf + sizeof(big_header_t), body, len);
+
+  while (off < total) {
+    ssize_t n = write(s->fd, buf + off, total - off);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      session_fail(loop, s, now, strerror(errno));
+      return -1;
+    }
+    off += (size_t)n;
+  }
+
+  trace_record(TRACE_FRAME_SENT, s->fd, type, 0, (uint32_t)len);
+  metrics_frame_sent(type, len);
+  capture_frame(CAPTURE_SENT, s->fd, (const big_header_t *)buf,
+                buf + sizeof(big_header_t), len);
+
+  if (off < total) {
+    s->tx = buffer_pool_get(&loop->pool);
+    if (s->tx == NULL) {
+      session_fail(loop, s, now, "out of memory");
+      return -1;
+    }
+    // blocks are sized for a whole frame, so the remainder always fits
+    s->tx_len = total - off;
+    s->tx_off = 0;
+    memcpy(s->tx, buf + off, s->tx_len);
+  }
+
+  // fetch samples say nothing about how long a login takes, so the RTO can
+  // only stretch the fixed limit on a slow link, never shorten it
+  int64_t rto = clock_sync_timeout_ms(&s->clock, SESSION_TIMEOUT_MS);
+
+  s->pending++;
+  s->sent_ns = monotonic_ns();
+  s->deadline = now + (s->state != STATE_DISCOVERING && rto > SESSION_TIMEOUT_MS
+                           ? rto
+                           : SESSION_TIMEOUT_MS);
+  return 0;
+}
+
+static void session_flush(session_loop *loop, session *s, int64_t now) {
+  ssize_t n = write(s->fd, s->tx + s->tx_off, s->tx_len - s->tx_off);
+
+  if (n == -1) {
+    if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+      session_fail(loop, s, now, strerror(errno));
+    }
+    return;
+  }
+
+  s->tx_off += (size_t)n;
+  if (s->tx_off == s->tx_len) {
+    buffer_pool_put(&loop->pool, s->tx);
+    s->tx = NULL;
+    s->tx_len = 0;
+    s->tx_off = 0;
+  }
+}
+
+static int send_discovery(session_loop *loop, session *s, int64_t now) {
+  big_discovery_res_t body = {0};
+
+  return session_write(loop, s, now, TYPE_DISCOVERY_REQUEST, &body,
+                       sizeof(body));
+}
+
+static int send_create(session_loop *loop, session *s, int64_t now) {
+  big_create_account_req_t body;
+
+  frame_create_account_body(&body, &s->auth);
+  return session_write(loop, s, now, TYPE_ACCOUNT_CREATE_REQUEST, &body,
+                       sizeof(body));
+}
+
+static int send_login_logout(session_loop *loop, session *s, int64_t now,
+                             uint8_t status_flag) {
+  big_login_logout_req_t body;
+
+  // a node that cares about client_ip will say so in its answer
+  (void)frame_login_logout_body(&body, &s->auth, s->fd, status_flag);
+  return session_write(loop, s, now, TYPE_LOGIN_OR_LOGOUT_REQUEST, &body,
+                       sizeof(body));
+}
+
+static int send_fetch(session_loop *loop, session *s, int64_t now) {
+  big_get_message_t body;
+
+  frame_get_message_body(&body, &s->auth, s->last_timestamp, s->channel_id);
+  if (session_write(loop, s, now, TYPE_GET_MESSAGE_REQUEST, &body,
+                    sizeof(body)) == -1) {
+    return -1;
+  }
+  s->fetch_outstanding = 1;
+  return 0;
+}
+
+// sleep until the earliest timer across all sessions
+static int poll_timeout(const session_loop *loop, int64_t now) {
+  int64_t next = now + SESSION_MAX_POLL_MS;
+
+  for (size_t i = 0; i < loop->count; i++) {
+    const session *s = &loop->sessions[i];
+
+    if (s->finished) {
+      continue;
+    }
+    if ((s->state == STATE_DISCONNECTED || s->connecting || s->pending > 0) &&
+        s->deadline < next) {
+      next = s->deadline;
+    }
+    if (s->state == STATE_MESSAGING && !s->fetch_outstanding &&
+        s->next_fetch < next) {
+      next = s->next_fetch;
+    }
+  }
+  return next > now ? (int)(next - now) : 0;
+}
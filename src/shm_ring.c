@@ -0,0 +1,172 @@
+#include "shm_ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// the ring is shared across processes, so the atomics must not hide a lock
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+               "shm_ring needs address-free 64-bit atomics");
+
+static void ring_path(char *dest, size_t size, const char *name);
+
+int shm_ring_create(shm_ring *r, const char *name) {
+  memset(r, 0, sizeof(*r));
+  ring_path(r->name, sizeof(r->name), name);
+  r->writer = 1;
+
+  // never take over a running daemon's ring. a crashed one leaves its ring
+  // behind, and removing that is left to whoever knows it is dead
+  int fd = shm_open(r->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd == -1) {
+    if (errno == EEXIST) {
+      fprintf(stderr, "%s exists: a daemon with this name is running, or "
+                      "remove /dev/shm%s after a crash\n",
+              r->name, r->name);
+    } else {
+      perror("shm_open");
+    }
+    return -1;
+  }
+
+  if (ftruncate(fd, (off_t)sizeof(shm_ring_layout)) == -1) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(r->name);
+    return -1;
+  }
+
+  void *p = mmap(NULL, sizeof(shm_ring_layout), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(r->name);
+    return -1;
+  }
+
+  r->ring = p;
+  r->ring->slot_count = SHM_RING_SLOTS;
+  r->ring->slot_size = sizeof(shm_ring_slot);
+  r->ring->version = SHM_RING_VERSION;
+  atomic_init(&r->ring->head, 0);
+  for (size_t i = 0; i < SHM_RING_SLOTS; i++) {
+    atomic_init(&r->ring->slots[i].seq, 0);
+  }
+
+  // magic last, readers refuse the mapping until it is set
+  atomic_thread_fence(memory_order_release);
+  r->ring->magic = SHM_RING_MAGIC;
+  return 0;
+}
+
+int shm_ring_attach(shm_ring *r, const char *name) {
+  memset(r, 0, sizeof(*r));
+  ring_path(r->name, sizeof(r->name), name);
+
+  int fd = shm_open(r->name, O_RDONLY, 0);
+  if (fd == -1) {
+    perror("shm_open");
+    return -1;
+  }
+
+  void *p = mmap(NULL, sizeof(shm_ring_layout), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+
+  r->ring = p;
+  atomic_thread_fence(memory_order_acquire);
+  if (r->ring->magic != SHM_RING_MAGIC ||
+      r->ring->version != SHM_RING_VERSION ||
+      r->ring->slot_size != sizeof(shm_ring_slot)) {
+    fprintf(stderr, "Error: %s is not a compatible message ring.\n", r->name);
+    shm_ring_close(r);
+    return -1;
+  }
+
+  // new readers start at the live edge
+  r->cursor = atomic_load_explicit(&r->ring->head, memory_order_acquire);
+  return 0;
+}
+
+void shm_ring_close(shm_ring *r) {
+  if (r->ring != NULL) {
+    munmap(r->ring, sizeof(shm_ring_layout));
+    r->ring = NULL;
+  }
+  if (r->writer) {
+    shm_unlink(r->name);
+    r->writer = 0;
+  }
+}
+
+void shm_ring_publish(shm_ring *r, uint8_t channel_id, uint8_t sender_id,
+                      uint64_t timestamp, const char *text, size_t length) {
+  uint64_t n = atomic_load_explicit(&r->ring->head, memory_order_relaxed);
+  shm_ring_slot *slot = &r->ring->slots[n % SHM_RING_SLOTS];
+
+  // mark the slot busy before touching its payload
+  atomic_store_explicit(&slot->seq, (2 * n) + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  if (length > SHM_RING_TEXT_LENGTH) {
+    length = SHM_RING_TEXT_LENGTH;
+  }
+  slot->timestamp = timestamp;
+  slot->channel_id = channel_id;
+  slot->sender_id = sender_id;
+  slot->length = (uint16_t)length;
+  memcpy(slot->text, text, length);
+
+  atomic_store_explicit(&slot->seq, 2 * (n + 1), memory_order_release);
+  atomic_store_explicit(&r->ring->head, n + 1, memory_order_release);
+}
+
+const shm_ring_slot *shm_ring_begin(shm_ring *r, uint64_t *lost) {
+  *lost = 0;
+
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&r->ring->head, memory_order_acquire);
+
+    if (r->cursor >= head) {
+      return NULL;
+    }
+
+    // lapped by the writer, jump to the oldest message still in the ring
+    if (head - r->cursor > SHM_RING_SLOTS) {
+      *lost += head - r->cursor - SHM_RING_SLOTS;
+      r->cursor = head - SHM_RING_SLOTS;
+    }
+
+    const shm_ring_slot *slot = &r->ring->slots[r->cursor % SHM_RING_SLOTS];
+    uint64_t seq = atomic_load_explicit(
+        &((shm_ring_slot *)(uintptr_t)slot)->seq, memory_order_acquire);
+    if (seq == 2 * (r->cursor + 1)) {
+      return slot;
+    }
+
+    // overwritten between the head load and now, skip it
+    *lost += 1;
+    r->cursor++;
+  }
+}
+
+int shm_ring_end(shm_ring *r, const shm_ring_slot *slot) {
+  // the payload reads must happen before the re-check
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t seq = atomic_load_explicit(
+      &((shm_ring_slot *)(uintptr_t)slot)->seq, memory_order_relaxed);
+  int ok = seq == 2 * (r->cursor + 1) ? 0 : -1;
+
+  r->cursor++;
+  return ok;
+}
+
+static void ring_path(char *dest, size_t size, const char *name) {
+  snprintf(dest, size, "/bigchat-%s", name);
+}
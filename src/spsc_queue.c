@@ -0,0 +1,64 @@
+#include "spsc_queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+int spsc_queue_init(spsc_queue *q, size_t capacity, size_t slot_size) {
+  size_t cap = 1;
+
+  while (cap < capacity) {
+    cap <<= 1U;
+  }
+
+  q->slots = calloc(cap, slot_size);
+  if (q->slots == NULL) {
+    return -1;
+  }
+
+  q->mask = cap - 1;
+  q->slot_size = slot_size;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return 0;
+}
+
+void spsc_queue_destroy(spsc_queue *q) {
+  free(q->slots);
+  q->slots = NULL;
+}
+
+int spsc_queue_push(spsc_queue *q, const void *item) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (tail - head > q->mask) {
+    return -1;
+  }
+
+  memcpy(q->slots + ((tail & q->mask) * q->slot_size), item, q->slot_size);
+
+  // publish the slot contents before the new tail
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+int spsc_queue_pop(spsc_queue *q, void *item) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (head == tail) {
+    return -1;
+  }
+
+  memcpy(item, q->slots + ((head & q->mask) * q->slot_size), q->slot_size);
+
+  // hand the slot back to the producer
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 0;
+}
+
+size_t spsc_queue_depth(spsc_queue *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  return tail - head;
+}
@@ -0,0 +1,217 @@
+#include "trace.h"
+#include "frame.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum
+{
+    TRACE_WRITE_BATCH = 1024 // events per write()
+};
+
+atomic_int trace_enabled;
+
+// rings are handed out once per thread and never freed: a thread can be
+// inside trace_emit with its local_ring while trace_stop runs at exit
+static _Atomic(trace_ring *) rings[TRACE_MAX_THREADS];
+static atomic_uint ring_count;
+static _Thread_local trace_ring *local_ring;
+static _Thread_local int local_ring_full; // ran out of ring slots
+
+static int trace_fd = -1;
+static int64_t trace_start_ns;
+static pthread_t flusher;
+static atomic_int flusher_stop;
+static int exit_hooked;
+
+static trace_ring *claim_ring(void);
+static void *flusher_main(void *arg);
+static void drain_all(trace_event *batch);
+static void drain_ring(trace_ring *ring, trace_event *batch);
+
+int trace_start(const char *path) {
+  trace_file_header fh = {0};
+
+  if (atomic_load(&trace_enabled)) {
+    return 0;
+  }
+
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace_fd == -1) {
+    fprintf(stderr, "trace: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fh.magic = TRACE_MAGIC;
+  fh.version = TRACE_VERSION;
+  fh.start_wall_ms = wall_clock_ms();
+  if (frame_write_all(trace_fd, &fh, sizeof(fh)) == -1) {
+    fprintf(stderr, "trace: write failed: %s\n", strerror(errno));
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  trace_start_ns = monotonic_ns();
+  atomic_store(&flusher_stop, 0);
+  if (spawn_thread(&flusher, flusher_main, NULL) != 0) {
+    fputs("trace: cannot start flusher thread\n", stderr);
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+  }
+
+  if (!exit_hooked) {
+    atexit(trace_stop);
+    exit_hooked = 1;
+  }
+
+  atomic_store(&trace_enabled, 1);
+  return 0;
+}
+
+void trace_stop(void) {
+  if (!atomic_exchange(&trace_enabled, 0)) {
+    return;
+  }
+
+  // the flusher drains every ring once more on its way out
+  atomic_store(&flusher_stop, 1);
+  pthread_join(flusher, NULL);
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+void trace_emit(trace_kind kind, int32_t id, uint8_t a, uint8_t b,
+                uint32_t value) {
+  trace_ring *ring = local_ring;
+
+  if (kind == TRACE_FRAME_SENT || kind == TRACE_FRAME_RECEIVED ||
+      kind == TRACE_CONNECT || kind == TRACE_CLOSE) {
+    id = (int32_t)conn_id_of(id);
+  }
+  if (ring == NULL) {
+    ring = claim_ring();
+    if (ring == NULL) {
+      return;
+    }
+  }
+
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (tail - head >= TRACE_RING_EVENTS) {
+    // never block the traced thread, the flusher reports the gap
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  trace_event *e = &ring->events[tail & (TRACE_RING_EVENTS - 1)];
+  e->t_ns = (uint64_t)(monotonic_ns() - trace_start_ns);
+  e->value = value;
+  e->id = id;
+  e->tid = ring->tid;
+  e->kind = (uint8_t)kind;
+  e->a = a;
+  e->b = b;
+  memset(e->reserved, 0, sizeof(e->reserved));
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static trace_ring *claim_ring(void) {
+  if (local_ring_full) {
+    return NULL;
+  }
+
+  unsigned idx = atomic_fetch_add(&ring_count, 1);
+  if (idx >= TRACE_MAX_THREADS) {
+    local_ring_full = 1;
+    return NULL;
+  }
+
+  trace_ring *ring = calloc(1, sizeof(*ring));
+  if (ring == NULL) {
+    local_ring_full = 1;
+    return NULL;
+  }
+  ring->tid = (uint16_t)idx;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->dropped, 0);
+
+  // the flusher skips slots that are still NULL
+  atomic_store_explicit(&rings[idx], ring, memory_order_release);
+  local_ring = ring;
+  return ring;
+}
+
+static void *flusher_main(void *arg) {
+  trace_event *batch = malloc(TRACE_WRITE_BATCH * sizeof(*batch));
+  const struct timespec interval = {
+      .tv_sec = 0, .tv_nsec = (long)TRACE_FLUSH_INTERVAL_MS * 1000000L};
+
+  (void)arg;
+  if (batch == NULL) {
+    fputs("trace: out of memory\n", stderr);
+    return NULL;
+  }
+
+  while (!atomic_load(&flusher_stop)) {
+    nanosleep(&interval, NULL);
+    drain_all(batch);
+  }
+  drain_all(batch);
+  free(batch);
+  return NULL;
+}
+
+static void drain_all(trace_event *batch) {
+  unsigned count = atomic_load(&ring_count);
+
+  for (unsigned i = 0; i < count && i < TRACE_MAX_THREADS; i++) {
+    trace_ring *ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+    if (ring != NULL) {
+      drain_ring(ring, batch);
+    }
+  }
+}
+
+static void drain_ring(trace_ring *ring, trace_event *batch) {
+  size_t n = 0;
+  uint32_t dropped = (uint32_t)atomic_exchange_explicit(&ring->dropped, 0,
+                                                         memory_order_relaxed);
+
+  if (dropped > 0) {
+    memset(&batch[n], 0, sizeof(batch[n]));
+    batch[n].t_ns = (uint64_t)(monotonic_ns() - trace_start_ns);
+    batch[n].tid = ring->tid;
+    batch[n].kind = TRACE_DROPPED;
+    batch[n].value = dropped;
+    n++;
+  }
+
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  while (head != tail) {
+    batch[n++] = ring->events[head & (TRACE_RING_EVENTS - 1)];
+    head++;
+    if (n == TRACE_WRITE_BATCH || head == tail) {
+      // release the slots before the slow part
+      atomic_store_explicit(&ring->head, head, memory_order_release);
+      if (frame_write_all(trace_fd, batch, n * sizeof(*batch)) == -1) {
+        fprintf(stderr, "trace: write failed: %s\n", strerror(errno));
+      }
+      n = 0;
+    }
+  }
+
+  if (n > 0 && frame_write_all(trace_fd, batch, n * sizeof(*batch)) == -1) {
+    fprintf(stderr, "trace: write failed: %s\n", strerror(errno));
+  }
+}
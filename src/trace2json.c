@@ -0,0 +1,285 @@
+#include "client.h"
+#include "protocol.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// turns a binary trace written by `main -t` into Chrome trace event JSON for
+// chrome://tracing or https://ui.perfetto.dev. state transitions become
+// slices per session, frames and connects become instants, queue depths
+// become counters
+
+typedef struct
+{
+    uint16_t tid;
+    int32_t id;
+    uint8_t state;
+    uint64_t since_ns;
+} open_slice;
+
+static int load(const char *path, trace_file_header *fh, trace_event **events,
+                size_t *count);
+static int compare_events(const void *a, const void *b);
+static const char *state_name(uint8_t state);
+static const char *type_name(uint8_t type);
+static void emit_slice(FILE *out, const open_slice *s, uint64_t end_ns,
+                       int *first);
+static void begin_event(FILE *out, int *first);
+
+int main(int argc, char **argv) {
+  trace_file_header fh;
+  trace_event *events = NULL;
+  size_t count = 0;
+  FILE *out = stdout;
+
+  if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0) {
+    fprintf(stderr, "Usage: %s <trace> [<output.json>]\n", argv[0]);
+    return argc == 2 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (load(argv[1], &fh, &events, &count) == -1) {
+    return EXIT_FAILURE;
+  }
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (out == NULL) {
+      perror(argv[2]);
+      free(events);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // rings are flushed one after another, put them back in time order
+  qsort(events, count, sizeof(*events), compare_events);
+
+  open_slice *slices = calloc(count > 0 ? count : 1, sizeof(*slices));
+  size_t slice_count = 0;
+  uint16_t max_tid = 0;
+  int first = 1;
+  if (slices == NULL) {
+    fputs("trace2json: out of memory\n", stderr);
+    free(events);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(out,
+          "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"start_wall_ms\":%llu},"
+          "\"traceEvents\":[\n",
+          (unsigned long long)fh.start_wall_ms);
+
+  for (size_t i = 0; i < count; i++) {
+    const trace_event *e = &events[i];
+    double ts = (double)e->t_ns / 1000.0;
+
+    if (e->tid > max_tid) {
+      max_tid = e->tid;
+    }
+
+    switch (e->kind) {
+    case TRACE_STATE: {
+      open_slice *s = NULL;
+      for (size_t j = 0; j < slice_count; j++) {
+        if (slices[j].tid == e->tid && slices[j].id == e->id) {
+          s = &slices[j];
+          break;
+        }
+      }
+      if (s == NULL) {
+        s = &slices[slice_count++];
+        s->tid = e->tid;
+        s->id = e->id;
+      } else {
+        emit_slice(out, s, e->t_ns, &first);
+      }
+      s->state = e->a;
+      s->since_ns = e->t_ns;
+      break;
+    }
+    case TRACE_FRAME_SENT:
+    case TRACE_FRAME_RECEIVED:
+      begin_event(out, &first);
+      fprintf(out,
+              "{\"name\":\"%s %s\",\"cat\":\"frame\",\"ph\":\"i\",\"s\":\"t\","
+              "\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"conn\":%d,"
+              "\"status\":%u,\"size\":%u}}",
+              e->kind == TRACE_FRAME_SENT ? "send" : "recv", type_name(e->a),
+              ts, e->tid, e->id, e->b, e->value);
+      break;
+    case TRACE_CONNECT:
+    case TRACE_CLOSE:
+      begin_event(out, &first);
+      fprintf(out,
+              "{\"name\":\"%s\",\"cat\":\"socket\",\"ph\":\"i\",\"s\":\"t\","
+              "\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"conn\":%d,"
+              "\"port\":%u}}",
+              e->kind == TRACE_CONNECT ? "connect" : "close", ts, e->tid,
+              e->id, e->value);
+      break;
+    case TRACE_QUEUE_DEPTH:
+      begin_event(out, &first);
+      fprintf(out,
+              "{\"name\":\"%s\",\"cat\":\"queue\",\"ph\":\"C\",\"ts\":%.3f,"
+              "\"pid\":1,\"args\":{\"depth\":%u}}",
+              e->id == TRACE_QUEUE_NET_COMMANDS ? "net commands"
+                                                : "net events",
+              ts, e->value);
+      break;
+    case TRACE_DROPPED:
+      begin_event(out, &first);
+      fprintf(out,
+              "{\"name\":\"dropped\",\"cat\":\"trace\",\"ph\":\"i\","
+              "\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+              "\"args\":{\"events\":%u}}",
+              ts, e->tid, e->value);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // whatever state things were in when the trace ended
+  uint64_t end_ns = count > 0 ? events[count - 1].t_ns : 0;
+  for (size_t j = 0; j < slice_count; j++) {
+    emit_slice(out, &slices[j], end_ns, &first);
+  }
+  for (unsigned tid = 0; count > 0 && tid <= max_tid; tid++) {
+    begin_event(out, &first);
+    fprintf(out,
+            "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"name\":\"%s %u\"}}",
+            tid, tid == 0 ? "main" : "thread", tid);
+  }
+  fputs("\n]}\n", out);
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  fprintf(stderr, "%zu events\n", count);
+  free(slices);
+  free(events);
+  return EXIT_SUCCESS;
+}
+
+static int load(const char *path, trace_file_header *fh, trace_event **events,
+                size_t *count) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  if (fread(fh, sizeof(*fh), 1, fp) != 1 || fh->magic != TRACE_MAGIC ||
+      fh->version != TRACE_VERSION) {
+    fprintf(stderr, "trace2json: %s is not a trace file\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  size_t cap = 4096;
+  *count = 0;
+  *events = malloc(cap * sizeof(**events));
+  while (*events != NULL) {
+    if (*count == cap) {
+      trace_event *grown = realloc(*events, cap * 2 * sizeof(**events));
+      if (grown == NULL) {
+        free(*events);
+        *events = NULL;
+        break;
+      }
+      *events = grown;
+      cap *= 2;
+    }
+    size_t n = fread(*events + *count, sizeof(**events), cap - *count, fp);
+    if (n == 0) {
+      break;
+    }
+    *count += n;
+  }
+  fclose(fp);
+
+  if (*events == NULL) {
+    fputs("trace2json: out of memory\n", stderr);
+    return -1;
+  }
+  return 0;
+}
+
+static int compare_events(const void *a, const void *b) {
+  const trace_event *x = a;
+  const trace_event *y = b;
+
+  return (x->t_ns > y->t_ns) - (x->t_ns < y->t_ns);
+}
+
+static const char *state_name(uint8_t state) {
+  switch (state) {
+  case STATE_DISCONNECTED:
+    return "disconnected";
+  case STATE_DISCOVERING:
+    return "discovering";
+  case STATE_CONNECTING_TO_SERVER:
+    return "connecting to server";
+  case STATE_AWAITING_USER_INFO:
+    return "awaiting user info";
+  case STATE_LOGGED_IN:
+    return "logged in";
+  case STATE_MESSAGING:
+    return "messaging";
+  case STATE_EXITING:
+    return "exiting";
+  default:
+    return "unknown";
+  }
+}
+
+static const char *type_name(uint8_t type) {
+  switch (type) {
+  case TYPE_DISCOVERY_REQUEST:
+    return "discovery request";
+  case TYPE_DISCOVERY_RESPONSE:
+    return "discovery response";
+  case TYPE_ACCOUNT_CREATE_REQUEST:
+    return "account create request";
+  case TYPE_ACCOUNT_CREATE_RESPONSE:
+    return "account create response";
+  case TYPE_LOGIN_OR_LOGOUT_REQUEST:
+    return "login/logout request";
+  case TYPE_LOGIN_OR_LOGOUT_RESPONSE:
+    return "login/logout response";
+  case TYPE_GET_CHANNEL_INFO_REQUEST:
+    return "channel info request";
+  case TYPE_GET_CHANNEL_INFO_RESPONSE:
+    return "channel info response";
+  case TYPE_LIST_ALL_CHANNELS_REQUEST:
+    return "list channels request";
+  case TYPE_LIST_ALL_CHANNELS_RESPONSE:
+    return "list channels response";
+  case TYPE_SEND_MESSAGE_REQUEST:
+    return "send message request";
+  case TYPE_SEND_MESSAGE_RESPONSE:
+    return "send message response";
+  case TYPE_GET_MESSAGE_REQUEST:
+    return "get message request";
+  case TYPE_GET_MESSAGE_RESPONSE:
+    return "get message response";
+  default:
+    return "unknown";
+  }
+}
+
+static void emit_slice(FILE *out, const open_slice *s, uint64_t end_ns,
+                       int *first) {
+  begin_event(out, first);
+  fprintf(out,
+          "{\"name\":\"%s\",\"cat\":\"state\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"session\":%d}}",
+          state_name(s->state), (double)s->since_ns / 1000.0,
+          (double)(end_ns - s->since_ns) / 1000.0, s->tid, s->id);
+}
+
+static void begin_event(FILE *out, int *first) {
+  if (!*first) {
+    fputs(",\n", out);
+  }
+  *first = 0;
+}
@@ -0,0 +1,111 @@
+#include "user_directory.h"
+#include <string.h>
+
+static int is_stale(const user_directory *d, const user_entry *e,
+                    int64_t now);
+
+void user_directory_init(user_directory *d, int64_t ttl_ms,
+                         user_directory_fetch_fn fetch, void *arg) {
+  memset(d, 0, sizeof(*d));
+  d->ttl_ms = ttl_ms > 0 ? ttl_ms : USER_DIRECTORY_TTL_MS;
+  d->fetch = fetch;
+  d->arg = arg;
+}
+
+const char *user_directory_lookup(user_directory *d, uint8_t id, int64_t now) {
+  user_entry *e = &d->entries[id];
+
+  // a stale name is still better than a number while the refetch runs
+  const char *name = e->state == USER_KNOWN ? e->name : NULL;
+
+  if (!is_stale(d, e, now)) {
+    return name;
+  }
+
+  // a full batch leaves the entry as it is, the next lookup queues it
+  if (d->batch_count < USER_DIRECTORY_BATCH) {
+    d->batch[d->batch_count++] = id;
+    e->fetching = 1;
+    e->expires = now + USER_DIRECTORY_RETRY_MS;
+  }
+  return name;
+}
+
+user_entry_state user_directory_state(const user_directory *d, uint8_t id) {
+  const user_entry *e = &d->entries[id];
+
+  if (!e->pinned && e->version != d->version) {
+    return USER_EMPTY;
+  }
+  return (user_entry_state)e->state;
+}
+
+void user_directory_flush(user_directory *d) {
+  if (d->batch_count == 0) {
+    return;
+  }
+  if (d->fetch != NULL) {
+    d->fetch(d->arg, d->batch, d->batch_count);
+  }
+  d->batch_count = 0;
+}
+
+void user_directory_learn(user_directory *d, uint8_t id, const char *name,
+                          size_t length, int pinned, int64_t now) {
+  user_entry *e = &d->entries[id];
+
+  // the wire field is NUL padded, not necessarily terminated
+  length = strnlen(name, length < USERNAME_LENGTH ? length : USERNAME_LENGTH);
+  if (length == 0) {
+    return;
+  }
+  memcpy(e->name, name, length);
+  e->name[length] = '\0';
+  e->state = USER_KNOWN;
+  e->pinned = (uint8_t)(pinned != 0);
+  e->fetching = 0;
+  e->version = d->version;
+  e->expires = now + d->ttl_ms;
+}
+
+void user_directory_members(user_directory *d, const uint8_t *ids,
+                            size_t count, int64_t now) {
+  uint8_t listed[USER_DIRECTORY_SLOTS] = {0};
+
+  for (size_t i = 0; i < count; i++) {
+    listed[ids[i]] = 1;
+  }
+
+  // one answer covers every id that was waiting on it
+  for (size_t id = 0; id < USER_DIRECTORY_SLOTS; id++) {
+    user_entry *e = &d->entries[id];
+
+    if (!listed[id] && !e->fetching) {
+      continue;
+    }
+    // a known name stays known, members just come and go
+    if (e->state != USER_KNOWN) {
+      e->state = listed[id] ? USER_MEMBER : USER_ABSENT;
+    }
+    e->fetching = 0;
+    e->version = d->version;
+    e->expires = now + d->ttl_ms;
+  }
+}
+
+void user_directory_invalidate(user_directory *d) { d->version++; }
+
+static int is_stale(const user_directory *d, const user_entry *e,
+                    int64_t now) {
+  if (e->pinned) {
+    return 0;
+  }
+  // an unanswered fetch is retried once its deadline passes
+  if (e->fetching) {
+    return now >= e->expires;
+  }
+  if (e->state == USER_EMPTY) {
+    return 1;
+  }
+  return e->version != d->version || now >= e->expires;
+}
@@ -1,23 +1,65 @@
 #include "utils.h"
+#include "capture.h"
+#include "metrics.h"
+#include "trace.h"
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+// written by whichever thread owns the fd, read by any
+static _Atomic uint32_t conn_ids[CONN_ID_FDS];
+static atomic_uint conn_id_next;
+
 void cleanup_client(client_context *ctx) {
   if (ctx->active_sock_fd >= 0) {
     printf("Closing connection and exiting...\n");
+    trace_record(TRACE_CLOSE, ctx->active_sock_fd, 0, 0, 0);
+    capture_close(ctx->active_sock_fd);
+    conn_id_close(ctx->active_sock_fd);
     close(ctx->active_sock_fd);
     ctx->active_sock_fd = -1;
   }
 }
 
 void print_usage(client_context *ctx) {
-  fprintf(stderr, "Usage: %s -m <manager_server_ip> -p <manager_port> [-h]\n",
-          ctx->argv[0]);
+  fprintf(stderr, "Usage: %s -m <manager_server_ip> -p <manager_port> [-d <name>] "
+                  "[-b <accounts_file>] [-w <trace>]\n"
+                  "          [-t <timeline>] [-M <metrics>] [-h]\n       %s -a <name>\n"
+                  "       %s -m <node_ip> -p <node_port> -r <trace> [-x <speed>]\n"
+                  "       %s -m <manager_server_ip> -p <manager_port> -s <script> [-W <window>]\n",
+          ctx->argv[0], ctx->argv[0], ctx->argv[0], ctx->argv[0]);
   fputs("\nOptions: \n", stderr);
   fputs("  -m <manager_ip_address> The server manager's IP address\n", stderr);
   fputs("  -p <manager_port> The server manager's port\n", stderr);
+  fputs("  -d <name> Run as a daemon sharing one session with local "
+        "front-ends\n",
+        stderr);
+  fputs("  -a <name> Attach to the daemon <name> instead of connecting\n",
+        stderr);
+  fputs("  -b <accounts_file> Run every \"user password\" line on one event "
+        "loop\n",
+        stderr);
+  fputs("  -w <trace> Record every frame sent and received to <trace>\n",
+        stderr);
+  fputs("  -t <timeline> Record state changes and frame events to "
+        "<timeline>\n",
+        stderr);
+  fputs("  -M <metrics> Serve metrics on unix:<path> or http:<port>, or "
+        "rewrite file:<path>\n",
+        stderr);
+  fputs("  -r <trace> Replay the frames sent in <trace> against -m/-p\n",
+        stderr);
+  fputs("  -x <speed> Replay time scale, e.g. 1, 10 or max (default 1)\n",
+        stderr);
+  fputs("  -s <script> Run register/login/join/send/fetch/logout lines from "
+        "<script>\n             (- for stdin) and print one result per line\n",
+        stderr);
+  fputs("  -W <window> Script requests in flight at once (default 16)\n",
+        stderr);
   fputs(" -h Display this help and exit\n", stderr);
 }
 
@@ -30,6 +72,12 @@ void quit(client_context *ctx) {
   exit(ctx->exit_code);
 }
 
+void client_set_state(client_context *ctx, client_state state) {
+  trace_record(TRACE_STATE, 0, (uint8_t)state, (uint8_t)ctx->state, 0);
+  metrics_set_state((int)ctx->state, (int)state);
+  ctx->state = state;
+}
+
 // ai helped me with this cuz darcys flags kept screaming at me
 void get_user_input(char *dest, size_t size, const char *prompt) {
   if (prompt) {
@@ -53,4 +101,66 @@ void get_user_input(char *dest, size_t size, const char *prompt) {
   } else {
     dest[0] = '\0';
   }
-}
\ No newline at end of file
+}
+
+int64_t monotonic_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+int64_t monotonic_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+uint64_t wall_clock_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec * 1000U) + ((uint64_t)ts.tv_nsec / 1000000U);
+}
+
+int spawn_thread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  sigset_t block;
+  sigset_t old;
+
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+
+  // the new thread inherits the mask, the caller gets its own back
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int rc = pthread_create(thread, NULL, fn, arg);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return rc;
+}
+
+uint32_t conn_id_open(int fd) {
+  uint32_t id =
+      (atomic_fetch_add_explicit(&conn_id_next, 1, memory_order_relaxed) + 1) %
+      CONN_ID_UNTRACKED;
+
+  if (fd >= 0 && fd < CONN_ID_FDS) {
+    atomic_store_explicit(&conn_ids[fd], id, memory_order_relaxed);
+  }
+  return id;
+}
+
+void conn_id_close(int fd) {
+  if (fd >= 0 && fd < CONN_ID_FDS) {
+    atomic_store_explicit(&conn_ids[fd], 0, memory_order_relaxed);
+  }
+}
+
+uint32_t conn_id_of(int fd) {
+  uint32_t id = 0;
+
+  if (fd >= 0 && fd < CONN_ID_FDS) {
+    id = atomic_load_explicit(&conn_ids[fd], memory_order_relaxed);
+  }
+  return id != 0 ? id : CONN_ID_UNTRACKED | (uint32_t)fd;
+}